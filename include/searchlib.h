@@ -8,12 +8,23 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <condition_variable>
 #include <functional>
+#include <limits>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace searchlib {
@@ -22,6 +33,23 @@ namespace searchlib {
 // Interface
 //-----------------------------------------------------------------------------
 
+class IPostingsCursor {
+public:
+  virtual ~IPostingsCursor() = 0;
+
+  virtual bool is_end() const = 0;
+
+  virtual void next() = 0;
+  virtual void advance_to(size_t document_id) = 0;
+
+  virtual size_t document_id() const = 0;
+  virtual size_t freq() const = 0;
+
+  virtual size_t term_position(size_t search_hit_index) const = 0;
+  virtual size_t term_length(size_t search_hit_index) const = 0;
+  virtual bool is_term_position(size_t term_pos) const = 0;
+};
+
 class IPostings {
 public:
   virtual ~IPostings() = 0;
@@ -34,13 +62,28 @@ public:
   virtual size_t term_position(size_t index, size_t search_hit_index) const = 0;
   virtual size_t term_length(size_t index, size_t search_hit_index) const = 0;
   virtual bool is_term_position(size_t index, size_t term_pos) const = 0;
+
+  virtual std::unique_ptr<IPostingsCursor> cursor() const = 0;
 };
 
+class DocumentSet;
+class LiveDocuments;
+
 class IInvertedIndex {
 public:
   virtual ~IInvertedIndex() = 0;
 
+  // The size of the internal id space, which includes deleted documents.
   virtual size_t document_count() const = 0;
+  // Documents which aren't deleted, as used for collection statistics.
+  virtual size_t live_document_count() const;
+
+  // Documents are identified by dense internal ids, assigned in the order
+  // they are first indexed. These map them to and from the ids given to the
+  // indexer.
+  virtual size_t external_document_id(size_t document_id) const = 0;
+  virtual std::optional<size_t>
+  internal_document_id(size_t external_document_id) const = 0;
 
   virtual size_t document_term_count(size_t document_id) const = 0;
   virtual double average_document_term_count() const = 0;
@@ -54,14 +97,32 @@ public:
   virtual double tf(const std::u32string &str, size_t document_id) const = 0;
 
   virtual const IPostings &postings(const std::u32string &str) const = 0;
+
+  // Document ids of a frequent term as a compressed bitmap, or nullptr when
+  // the postings are sparse enough to be scanned directly.
+  virtual const DocumentSet *document_set(const std::u32string &str) const;
+
+  // A term can also be resolved once to a dense id, so that the overloads
+  // below don't have to look up the string again.
+  virtual std::optional<size_t> term_id(const std::u32string &str) const = 0;
+
+  virtual size_t term_count(size_t term_id) const = 0;
+  virtual size_t term_count(size_t term_id, size_t document_id) const = 0;
+
+  virtual size_t df(size_t term_id) const = 0;
+  virtual double tf(size_t term_id, size_t document_id) const = 0;
+
+  virtual const IPostings &postings(size_t term_id) const = 0;
+  virtual const DocumentSet *document_set(size_t term_id) const;
+
+  // Deleted documents keep their ids and postings until the index is
+  // rebuilt or merged, and search results skip them. Returns nullptr when no
+  // document is deleted.
+  virtual const LiveDocuments *live_documents() const;
 };
 
 using Normalizer = std::function<std::u32string(const std::u32string &str)>;
 
-template <typename T>
-using TextRangeList =
-    std::unordered_map<size_t /*document_id*/, std::vector<T>>;
-
 template <typename T>
 using Tokenizer =
     std::function<void(Normalizer normalizer,
@@ -69,6 +130,12 @@ using Tokenizer =
                                           size_t term_pos, T text_range)>
                            callback)>;
 
+// Gives a tokenizer over the original text of a document, so that text
+// ranges can be recomputed instead of being kept in the index.
+template <typename T>
+using DocumentSource =
+    std::function<Tokenizer<T>(size_t external_document_id)>;
+
 template <typename T> class ITextRange {
 public:
   virtual ~ITextRange(){};
@@ -78,11 +145,139 @@ public:
 };
 
 template <typename T>
-class IInvertedIndexWithTextRange : public IInvertedIndex, ITextRange<T> {
+class IInvertedIndexWithTextRange : public IInvertedIndex,
+                                    public ITextRange<T> {
 public:
   virtual ~IInvertedIndexWithTextRange(){};
 };
 
+//-----------------------------------------------------------------------------
+// Document Sets
+//-----------------------------------------------------------------------------
+
+// A compressed set of document ids in the style of Roaring bitmaps. Ids are
+// split into chunks by their upper bits, and each chunk is held in whichever
+// container is smallest: a sorted array, a bitmap or a list of runs.
+class DocumentSet {
+public:
+  // Document ids must be added in ascending order.
+  void add(size_t document_id);
+  void optimize();
+  void clear();
+
+  bool empty() const;
+  size_t size() const;
+  bool contains(size_t document_id) const;
+  bool has_dense_containers() const;
+  size_t storage_size() const;
+
+  void for_each(std::function<void(size_t document_id)> fn) const;
+  std::vector<size_t> to_vector() const;
+
+  static DocumentSet intersect(const DocumentSet &a, const DocumentSet &b);
+  static DocumentSet unite(const DocumentSet &a, const DocumentSet &b);
+
+  // Appends the set to `out`, for sealed index images, and reads it back.
+  // The data from `data` to `end` is checked, as it may be corrupted.
+  void serialize(std::vector<uint8_t> &out) const;
+  static DocumentSet deserialize(const uint8_t *data, const uint8_t *end);
+
+  struct Container {
+    enum class Type : uint8_t { Array, Bitmap, Run };
+
+    Type type = Type::Array;
+    uint32_t cardinality = 0;
+    // Sorted values for `Array`, or (start, length - 1) pairs for `Run`
+    std::vector<uint16_t> values;
+    std::vector<uint64_t> words;
+  };
+
+private:
+  std::vector<uint64_t> keys_;
+  std::vector<Container> containers_;
+};
+
+// Which documents of an index are live, as one bit per document, so that
+// a search result can skip deleted documents with a single test.
+class LiveDocuments {
+public:
+  LiveDocuments() = default;
+  explicit LiveDocuments(size_t document_count);
+
+  // Documents added by growing the set are live.
+  void resize(size_t document_count);
+
+  // Returns false if the document was deleted already.
+  bool remove(size_t document_id);
+
+  bool contains(size_t document_id) const {
+    return (words_[document_id / 64] >> (document_id % 64)) & 1;
+  }
+
+  size_t document_count() const;
+  size_t deleted_count() const;
+
+  void for_each_deleted(std::function<void(size_t document_id)> fn) const;
+
+private:
+  std::vector<uint64_t> words_;
+  size_t document_count_ = 0;
+  size_t deleted_count_ = 0;
+};
+
+//-----------------------------------------------------------------------------
+// Term Dictionary
+//-----------------------------------------------------------------------------
+
+// An immutable sorted dictionary for sealed indexes. Terms are stored as
+// UTF-8 in blocks of `block_size`. The first term of a block is kept whole,
+// and the others keep only the suffix after the prefix shared with the
+// previous term. A term id is the rank of the term, so per-term data such as
+// postings offsets can be kept in plain arrays indexed by the id.
+class TermDictionary {
+public:
+  TermDictionary() = default;
+
+  // `terms` must be sorted and unique.
+  explicit TermDictionary(const std::vector<std::u32string> &terms);
+
+  // Reads an encoded dictionary kept elsewhere, such as in a sealed index
+  // image. The memory must outlive the dictionary.
+  TermDictionary(size_t term_count, const uint8_t *data, size_t data_size,
+                 const uint32_t *block_offsets, size_t block_count);
+
+  size_t size() const;
+  std::optional<size_t> find(const std::u32string &str) const;
+  std::u32string term(size_t term_id) const;
+
+  // Visits terms in ascending order, which is also the order of term ids.
+  void for_each(
+      std::function<void(size_t term_id, const std::u32string &str)> fn) const;
+
+  size_t storage_size() const;
+
+  // The encoded form
+  const uint8_t *data() const;
+  size_t data_size() const;
+  const uint32_t *block_offsets() const;
+  size_t block_count() const;
+
+  static constexpr size_t block_size = 16;
+
+private:
+  std::string_view block_first_term(size_t block) const;
+
+  size_t term_count_ = 0;
+  std::vector<uint8_t> data_;
+  std::vector<uint32_t> block_offsets_;
+
+  // Set when the dictionary reads external memory
+  const uint8_t *data_view_ = nullptr;
+  size_t data_view_size_ = 0;
+  const uint32_t *block_offsets_view_ = nullptr;
+  size_t block_count_view_ = 0;
+};
+
 //-----------------------------------------------------------------------------
 // Search
 //-----------------------------------------------------------------------------
@@ -92,6 +287,7 @@ enum class Operation { Term, And, Adjacent, Or, Near };
 struct Expression {
   Operation operation;
   std::u32string term_str;
+  size_t term_id;
   size_t near_operation_distance;
   std::vector<Expression> nodes;
 };
@@ -103,6 +299,11 @@ std::optional<Expression> parse_query(const IInvertedIndex &invidx,
 std::shared_ptr<IPostings> perform_search(const IInvertedIndex &invidx,
                                           const Expression &expr);
 
+// Evaluates only which documents match, without term positions, so that
+// boolean queries over frequent terms can run on document sets.
+DocumentSet search_documents(const IInvertedIndex &invidx,
+                             const Expression &expr);
+
 size_t term_count_score(const IInvertedIndex &invidx, const Expression &expr,
                         const IPostings &postings, size_t index);
 
@@ -113,6 +314,22 @@ double bm25_score(const IInvertedIndex &invidx, const Expression &expr,
                   const IPostings &postings, size_t index, double k1 = 1.2,
                   double b = 0.75);
 
+// Score every entry of `postings` in one pass. Term frequencies come from
+// cursors which move along with the results, instead of a fresh lookup for
+// each document.
+std::vector<size_t> term_count_scores(const IInvertedIndex &invidx,
+                                      const Expression &expr,
+                                      const IPostings &postings);
+
+std::vector<double> tf_idf_scores(const IInvertedIndex &invidx,
+                                  const Expression &expr,
+                                  const IPostings &postings);
+
+std::vector<double> bm25_scores(const IInvertedIndex &invidx,
+                                const Expression &expr,
+                                const IPostings &postings, double k1 = 1.2,
+                                double b = 0.75);
+
 //-----------------------------------------------------------------------------
 // Indexers
 //-----------------------------------------------------------------------------
@@ -120,7 +337,16 @@ double bm25_score(const IInvertedIndex &invidx, const Expression &expr,
 template <typename T> class IIndexer {
 public:
   virtual ~IIndexer(){};
+
+  // A document indexed again replaces the previous one.
   virtual void index_document(size_t document_id, Tokenizer<T> tokenizer) = 0;
+
+  // Returns false if there is no such document.
+  virtual bool delete_document(size_t document_id) = 0;
+
+  void update_document(size_t document_id, Tokenizer<T> tokenizer) {
+    index_document(document_id, std::move(tokenizer));
+  }
 };
 
 template <typename T>
@@ -137,10 +363,102 @@ struct TextRange {
   size_t length;
 };
 
+// Text ranges of every token, bit-packed per document. Ranges are kept in
+// blocks of `block_size` tokens: the position and length of the first token,
+// then the position delta and length of each of the others, with the fewest
+// bits the document needs. A lookup sums at most `block_size - 1` deltas.
+class TextRangeStore {
+public:
+  TextRangeStore() = default;
+
+  // Reads a store kept elsewhere, such as in a sealed index image. The memory
+  // must outlive the store, and no documents can be added to it.
+  TextRangeStore(const uint64_t *entries, size_t entry_count,
+                 const uint64_t *words, size_t word_count);
+
+  // Ranges are given in term position order and their positions must not
+  // decrease. Adding a document again replaces its ranges.
+  void add_document(size_t document_id,
+                    const std::vector<TextRange> &text_ranges);
+
+  // Adds the documents of `other` after the last document of this store.
+  void append(const TextRangeStore &other);
+
+  TextRange text_range(size_t document_id, size_t term_pos) const;
+
+  size_t storage_size() const;
+
+  // The encoded form: one packed entry per document, then the bits
+  const uint64_t *entries() const;
+  size_t entry_count() const;
+  const uint64_t *words() const;
+  size_t word_count() const;
+
+  static constexpr size_t block_size = 16;
+
+private:
+  struct Entry {
+    uint64_t bit_offset;
+    size_t position_bits;
+    size_t length_bits;
+    size_t delta_bits;
+  };
+
+  static uint64_t pack_entry(const Entry &entry);
+  static Entry unpack_entry(uint64_t packed);
+  static size_t token_offset(const Entry &entry, size_t term_pos);
+
+  std::vector<uint64_t> entries_;
+  std::vector<uint64_t> words_;
+  size_t bit_size_ = 0;
+
+  // Set when the store reads external memory
+  const uint64_t *entries_view_ = nullptr;
+  size_t entry_count_view_ = 0;
+  const uint64_t *words_view_ = nullptr;
+  size_t word_count_view_ = 0;
+};
+
 //-----------------------------------------------------------------------------
 // Tokenizers
 //-----------------------------------------------------------------------------
 
+// Buffers which tokenizers reuse for the terms they emit. Kept across
+// documents, they stop allocating once they have grown to the longest term.
+struct TokenBuffers {
+  std::u32string str;
+  std::u32string normalized;
+};
+
+// Lowercases terms as `unicode::to_lowercase` does. The two-argument form
+// writes into `out`, and doesn't allocate for ASCII terms once `out` has
+// grown.
+class LowercaseNormalizer {
+public:
+  std::u32string operator()(const std::u32string &str) const;
+  void operator()(const std::u32string &str, std::u32string &out) const;
+};
+
+// Remembers what `normalizer` returns for short ASCII terms, which make up
+// most tokens of a typical text. A key lives in one of the slots of its
+// bucket, and a full bucket evicts with the CLOCK algorithm, so that words
+// seen once go before the words used again since the hand last passed. Other
+// terms, and results which aren't short ASCII, go to `normalizer` every
+// time. Copies share one cache, which can be used from many threads: a hit
+// reads its bucket without locking, and only misses lock to insert.
+class CachingNormalizer {
+public:
+  explicit CachingNormalizer(Normalizer normalizer, size_t capacity = 8192);
+
+  std::u32string operator()(const std::u32string &str) const;
+  // Doesn't allocate on a hit once `out` has grown.
+  void operator()(const std::u32string &str, std::u32string &out) const;
+
+private:
+  struct Cache;
+  std::shared_ptr<Cache> cache_;
+};
+
 class UTF8PlainTextTokenizer {
 public:
   explicit UTF8PlainTextTokenizer(std::string_view text);
@@ -150,20 +468,103 @@ public:
                                      TextRange text_range)>
                       callback);
 
+  // Same as the call operator, but the types of `normalizer` and `callback`
+  // are known at compile time, so that both can be inlined. Terms are read
+  // into `buffers`, and so are normalized terms if `normalizer` takes an
+  // output buffer like LowercaseNormalizer does.
+  template <typename Norm, typename Callback>
+  void tokenize(const Norm &normalizer, Callback &&callback,
+                TokenBuffers &buffers) const {
+    if constexpr (std::is_same_v<Norm, Normalizer>) {
+      if (!normalizer) {
+        tokenize([](const auto &str) -> const auto & { return str; },
+                 callback, buffers);
+        return;
+      }
+    }
+
+    Scan scan;
+    size_t term_pos = 0;
+    size_t beg;
+    while (next_term(scan, beg, buffers.str)) {
+      TextRange text_range{beg, scan.pos - beg};
+      if constexpr (std::is_invocable_v<const Norm &, const std::u32string &,
+                                        std::u32string &>) {
+        normalizer(buffers.str, buffers.normalized);
+        callback(std::as_const(buffers.normalized), term_pos, text_range);
+      } else {
+        const auto &term = normalizer(buffers.str);
+        callback(term, term_pos, text_range);
+      }
+      term_pos++;
+    }
+  }
+
+  template <typename Norm, typename Callback>
+  void tokenize(const Norm &normalizer, Callback &&callback) const {
+    TokenBuffers buffers;
+    tokenize(normalizer, callback, buffers);
+  }
+
 private:
+  // The position in the text, and bitmaps of ASCII letters and of non-ASCII
+  // bytes over the 64 bytes of text from `block`
+  struct Scan {
+    size_t pos = 0;
+    size_t block = 0;
+    size_t block_end = 0;
+    uint64_t letters = 0;
+    uint64_t non_ascii = 0;
+  };
+
+  // Reads the term at or after `scan.pos` into `str`, and moves `scan.pos`
+  // past it.
+  bool next_term(Scan &scan, size_t &beg, std::u32string &str) const;
+
   std::string_view text_;
 };
 
+// Whether `Tok` has a `tokenize` member like UTF8PlainTextTokenizer's, which
+// indexers call in place of going through `Tokenizer<T>`.
+template <typename Tok, typename T, typename = void>
+struct has_tokenize : std::false_type {};
+
+template <typename Tok, typename T>
+struct has_tokenize<
+    Tok, T,
+    std::void_t<decltype(std::declval<const Tok &>().tokenize(
+        std::declval<const Normalizer &>(),
+        std::declval<void (&)(const std::u32string &, size_t, T)>(),
+        std::declval<TokenBuffers &>()))>>
+    : std::true_type {};
+
 //-----------------------------------------------------------------------------
 
-TextRange text_range(const TextRangeList<TextRange> &text_range_list,
+TextRange text_range(const TextRangeStore &text_range_store,
+                     const IPostings &positions, size_t index,
+                     size_t search_hit_index);
+
+// Tokenizes the document again to find the text range.
+TextRange text_range(Tokenizer<TextRange> tokenizer,
                      const IPostings &positions, size_t index,
                      size_t search_hit_index);
 
 class InMemoryInvertedIndexBase : public IInvertedIndex {
 public:
+  // Build structures draw from `memory_resource`, or from an arena owned by
+  // the index if none is given. The arena is released in bulk when the index
+  // is dropped.
+  explicit InMemoryInvertedIndexBase(
+      std::pmr::memory_resource *memory_resource = nullptr);
+  InMemoryInvertedIndexBase(InMemoryInvertedIndexBase &&) = default;
+  InMemoryInvertedIndexBase &operator=(InMemoryInvertedIndexBase &&) = delete;
+
   size_t document_count() const override;
 
+  size_t external_document_id(size_t document_id) const override;
+  std::optional<size_t>
+  internal_document_id(size_t external_document_id) const override;
+
   size_t document_term_count(size_t document_id) const override;
   double average_document_term_count() const override;
 
@@ -177,8 +578,49 @@ public:
 
   const IPostings &postings(const std::u32string &str) const override;
 
+  const DocumentSet *document_set(const std::u32string &str) const override;
+
+  std::optional<size_t> term_id(const std::u32string &str) const override;
+
+  size_t term_count(size_t term_id) const override;
+  size_t term_count(size_t term_id, size_t document_id) const override;
+
+  size_t df(size_t term_id) const override;
+  double tf(size_t term_id, size_t document_id) const override;
+
+  const IPostings &postings(size_t term_id) const override;
+  const DocumentSet *document_set(size_t term_id) const override;
+
+  const LiveDocuments *live_documents() const override;
+
+  // Assigns the next internal id to a document. If the document was indexed
+  // before, the previous one is deleted.
+  size_t add_document(size_t external_document_id);
+
+  bool delete_document(size_t external_document_id);
+  void remove_document(size_t document_id);
+
+  // Returns the id of a term, adding the term if it's new.
+  size_t add_term(std::u32string_view str);
+
+  // Records the length of a document, and keeps the collection statistics
+  // up to date.
+  void set_document_term_count(size_t document_id, size_t term_count);
+
+  size_t total_term_count() const;
+
+  void flush();
+
+  // Postings are stored in blocks of `block_size` documents. Document id
+  // deltas, frequencies and term position deltas of a block are compressed
+  // with Stream VByte, and a block is decoded only when it is visited.
+  // Recently added documents stay uncompressed in `tail_` until a block fills
+  // up or `flush` is called.
   class Postings : public IPostings {
   public:
+    Postings() = default;
+    explicit Postings(std::pmr::memory_resource *memory_resource);
+
     size_t size() const override;
 
     size_t document_id(size_t index) const override;
@@ -188,35 +630,140 @@ public:
     size_t term_length(size_t index, size_t search_hit_index) const override;
     bool is_term_position(size_t index, size_t term_pos) const override;
 
+    std::unique_ptr<IPostingsCursor> cursor() const override;
+
     void add_term_position(size_t document_id, size_t term_pos);
+    // Positions must be in ascending order.
+    void add_term_positions(size_t document_id, const uint32_t *positions,
+                            size_t count);
+    void flush();
+
+    const DocumentSet *document_set() const;
+
+    size_t storage_size() const;
+
+    static constexpr size_t block_size = 128;
+
+    enum BlockFlags : uint16_t {
+      // Document ids are stored as raw 64-bit values, because the span of
+      // the block doesn't fit in 32-bit deltas.
+      WideDocumentIds = 1,
+    };
+
+    struct Block {
+      uint64_t first_document_id;
+      uint64_t last_document_id;
+      uint64_t data_offset;
+      uint32_t position_count;
+      uint16_t document_count;
+      uint16_t flags;
+    };
+
+    struct DecodedBlock {
+      DecodedBlock() = default;
+      explicit DecodedBlock(std::pmr::memory_resource *memory_resource);
+
+      std::pmr::vector<size_t> document_ids;
+      std::pmr::vector<uint32_t> position_offsets;
+      std::pmr::vector<uint32_t> positions;
+
+      size_t size() const { return document_ids.size(); }
+      size_t positions_begin(size_t offset) const;
+      size_t positions_end(size_t offset) const;
+      void clear();
+    };
+
+    // Block-level access for cursors. The block at `block_count()` is the
+    // uncompressed tail.
+    size_t block_count() const;
+    uint64_t block_last_document_id(size_t block) const;
+    size_t skip_blocks(size_t block, size_t document_id) const;
+    const DecodedBlock &decode_block(size_t block, DecodedBlock &decoded,
+                                     bool with_positions) const;
 
   private:
-    using PositionsMap =
-        std::map<size_t /*document_id*/, std::vector<size_t /*position*/>>;
+    friend class SealedInvertedIndex;
 
-    PositionsMap::const_iterator find_positions_map(size_t index) const;
-    PositionsMap positions_map_;
-  };
+    size_t block_document_count() const;
+    const DecodedBlock &find_block(size_t index, bool with_positions,
+                                   size_t &offset) const;
 
-  struct Document {
-    size_t term_count;
+    void flush_tail(size_t count);
+    void encode_block(size_t beg, size_t end);
+    void reopen_blocks(size_t first_block);
+
+    void add_skip_entries();
+    void rebuild_skip_levels();
+
+    std::vector<Block> blocks_;
+    std::vector<uint8_t> data_;
+    DecodedBlock tail_;
+
+    // Keys decoded blocks cached for index access. Renewed when encoded
+    // blocks are reopened.
+    static uint64_t new_stamp();
+    uint64_t stamp_ = new_stamp();
+
+    // Multi-level skip data over the blocks. `skip_levels_[level][i]` is
+    // the last document id of the i-th run of `skip_interval^(level + 1)`
+    // blocks, so that `skip_blocks` can step over whole runs of blocks.
+    static constexpr size_t skip_interval = 16;
+    std::vector<std::vector<size_t>> skip_levels_;
+
+    // Built by `flush` only when the document ids have dense regions
+    static constexpr size_t document_set_threshold = 1024;
+    DocumentSet document_set_;
   };
 
   struct Term {
-    std::u32string str;
     size_t term_count;
     Postings postings;
   };
 
-  std::unordered_map<size_t /*document_id*/, Document> documents_;
-  std::unordered_map<std::u32string /*str*/, Term> term_dictionary_;
+  std::unique_ptr<std::pmr::monotonic_buffer_resource> arena_;
+  std::pmr::memory_resource *memory_resource_;
+
+  std::pmr::unordered_map<size_t /*external_document_id*/,
+                          uint32_t /*document_id*/>
+      internal_document_ids_;
+  std::vector<size_t /*external_document_id*/> external_document_ids_;
+  std::vector<size_t /*term_count*/> document_term_counts_;
+  size_t total_term_count_ = 0;
+  LiveDocuments live_documents_;
+  // Keys point to characters in `memory_resource_`
+  std::pmr::unordered_map<std::u32string_view /*str*/, size_t /*term_id*/>
+      term_dictionary_;
+  std::vector<Term> terms_;
 };
 
 template <typename T>
 class InMemoryInvertedIndex : public IInvertedIndexWithTextRange<T> {
 public:
+  InMemoryInvertedIndex() = default;
+
+  // Build structures draw from `memory_resource` instead of an arena owned by
+  // the index. It must outlive the index.
+  explicit InMemoryInvertedIndex(std::pmr::memory_resource *memory_resource)
+      : base_(memory_resource) {}
+
+  // Keeps no text ranges, and recomputes them from `document_source` on
+  // demand.
+  explicit InMemoryInvertedIndex(
+      DocumentSource<T> document_source,
+      std::pmr::memory_resource *memory_resource = nullptr)
+      : base_(memory_resource), document_source_(std::move(document_source)) {}
+
   size_t document_count() const override { return base_.document_count(); }
 
+  size_t external_document_id(size_t document_id) const override {
+    return base_.external_document_id(document_id);
+  }
+
+  std::optional<size_t>
+  internal_document_id(size_t external_document_id) const override {
+    return base_.internal_document_id(external_document_id);
+  }
+
   size_t document_term_count(size_t document_id) const override {
     return base_.document_term_count(document_id);
   }
@@ -248,48 +795,204 @@ public:
     return base_.postings(str);
   }
 
+  const DocumentSet *document_set(const std::u32string &str) const override {
+    return base_.document_set(str);
+  }
+
+  std::optional<size_t> term_id(const std::u32string &str) const override {
+    return base_.term_id(str);
+  }
+
+  size_t term_count(size_t term_id) const override {
+    return base_.term_count(term_id);
+  }
+
+  size_t term_count(size_t term_id, size_t document_id) const override {
+    return base_.term_count(term_id, document_id);
+  }
+
+  size_t df(size_t term_id) const override { return base_.df(term_id); }
+
+  double tf(size_t term_id, size_t document_id) const override {
+    return base_.tf(term_id, document_id);
+  }
+
+  const IPostings &postings(size_t term_id) const override {
+    return base_.postings(term_id);
+  }
+
+  const DocumentSet *document_set(size_t term_id) const override {
+    return base_.document_set(term_id);
+  }
+
+  const LiveDocuments *live_documents() const override {
+    return base_.live_documents();
+  }
+
   T text_range(const IPostings &positions, size_t index,
                size_t search_hit_index) const override {
-    return searchlib::text_range(text_range_list_, positions, index,
+    if (document_source_) {
+      auto document_id = positions.document_id(index);
+      return searchlib::text_range(
+          document_source_(base_.external_document_id(document_id)),
+          positions, index, search_hit_index);
+    }
+    return searchlib::text_range(text_range_store_, positions, index,
                                  search_hit_index);
   }
 
+  const InMemoryInvertedIndexBase &base() const { return base_; }
+  const TextRangeStore &text_range_store() const { return text_range_store_; }
+  const DocumentSource<T> &document_source() const { return document_source_; }
+
 private:
-  template <typename> friend class InMemoryIndexer;
+  template <typename, typename> friend class InMemoryIndexer;
 
   InMemoryInvertedIndexBase base_;
-  TextRangeList<T> text_range_list_;
+  TextRangeStore text_range_store_;
+  DocumentSource<T> document_source_;
 };
 
-template <typename T> class InMemoryIndexer : public IIndexer<T> {
+// `Norm` is the type of the normalizer. When it's known at compile time, and
+// a tokenizer such as UTF8PlainTextTokenizer is passed as is, tokenizing,
+// normalizing and indexing are inlined into one loop.
+template <typename T, typename Norm = Normalizer>
+class InMemoryIndexer : public IIndexer<T> {
 public:
-  InMemoryIndexer(InMemoryInvertedIndex<T> &invidx, Normalizer normalizer)
-      : invidx_(invidx), normalizer_(normalizer) {}
-
-  void index_document(size_t document_id, Tokenizer<T> tokenizer) override {
-    size_t term_count = 0;
-    tokenizer(normalizer_, [&](const auto &str, auto term_pos,
-                               auto text_range) {
-      if (invidx_.base_.term_dictionary_.find(str) ==
-          invidx_.base_.term_dictionary_.end()) {
-        invidx_.base_.term_dictionary_[str] = {str, 0};
-      }
+  InMemoryIndexer(InMemoryInvertedIndex<T> &invidx, Norm normalizer)
+      : invidx_(invidx), normalizer_(std::move(normalizer)) {}
 
-      auto &term = invidx_.base_.term_dictionary_.at(str);
-      term.term_count++;
-      term.postings.add_term_position(document_id, term_pos);
+  ~InMemoryIndexer() override { invidx_.base_.flush(); }
 
-      invidx_.text_range_list_[document_id].push_back(std::move(text_range));
+  void index_document(size_t external_document_id,
+                      Tokenizer<T> tokenizer) override {
+    index_tokens(external_document_id, [&](const auto &callback) {
+      tokenizer(normalizer_, callback);
+    });
+  }
 
-      term_count++;
+  template <typename Tok,
+            typename = std::enable_if_t<has_tokenize<Tok, T>::value>>
+  void index_document(size_t external_document_id, const Tok &tokenizer) {
+    index_tokens(external_document_id, [&](const auto &callback) {
+      tokenizer.tokenize(normalizer_, callback, token_buffers_);
     });
+  }
 
-    invidx_.base_.documents_[document_id] = {term_count};
+  bool delete_document(size_t external_document_id) override {
+    return invidx_.base_.delete_document(external_document_id);
   }
 
 private:
+  // `tokenize` runs the tokenizer with the callback it's given.
+  template <typename Tokenize>
+  void index_tokens(size_t external_document_id, const Tokenize &tokenize) {
+    auto document_id = invidx_.base_.add_document(external_document_id);
+    auto keep_text_ranges = !invidx_.document_source_;
+    text_ranges_.clear();
+
+    chars_.clear();
+    tokens_.clear();
+    tokenize([&](const auto &str, auto term_pos, auto text_range) {
+      assert(term_pos <= std::numeric_limits<uint32_t>::max());
+      // The group is assigned once the whole document is tokenized
+      tokens_.push_back({chars_.size(), str.size(),
+                         static_cast<uint32_t>(term_pos), 0});
+      chars_.insert(chars_.end(), str.begin(), str.end());
+
+      if (keep_text_ranges) {
+        text_ranges_.push_back(std::move(text_range));
+      }
+    });
+
+    add_terms(document_id);
+
+    invidx_.base_.set_document_term_count(document_id, tokens_.size());
+    if (keep_text_ranges) {
+      invidx_.text_range_store_.add_document(document_id, text_ranges_);
+    }
+  }
+
+  struct Token {
+    size_t offset;
+    size_t length;
+    uint32_t term_pos;
+    uint32_t group;
+  };
+
+  // Tokens of a document which share a term
+  struct Group {
+    size_t token;
+    uint32_t count;
+    uint32_t positions_offset;
+  };
+
+  std::u32string_view token_str(const Token &token) const {
+    return std::u32string_view(chars_.data() + token.offset, token.length);
+  }
+
+  // Groups the tokens of a document by term in a small hash table, so that
+  // each term is looked up in the dictionary once and gets all its positions
+  // in the document at once.
+  void add_terms(size_t document_id) {
+    constexpr auto empty = std::numeric_limits<uint32_t>::max();
+    size_t table_size = 16;
+    while (table_size < tokens_.size() * 2) {
+      table_size *= 2;
+    }
+    table_.assign(table_size, empty);
+    groups_.clear();
+
+    for (size_t i = 0; i < tokens_.size(); i++) {
+      auto str = token_str(tokens_[i]);
+      auto slot = std::hash<std::u32string_view>()(str) & (table_size - 1);
+      while (table_[slot] != empty &&
+             token_str(tokens_[groups_[table_[slot]].token]) != str) {
+        slot = (slot + 1) & (table_size - 1);
+      }
+      if (table_[slot] == empty) {
+        table_[slot] = static_cast<uint32_t>(groups_.size());
+        groups_.push_back({i, 0, 0});
+      }
+      tokens_[i].group = table_[slot];
+      groups_[table_[slot]].count++;
+    }
+
+    // Positions of each group follow those of the previous one, and stay in
+    // ascending order
+    uint32_t offset = 0;
+    for (auto &group : groups_) {
+      group.positions_offset = offset;
+      offset += group.count;
+    }
+    positions_.resize(tokens_.size());
+    for (const auto &token : tokens_) {
+      positions_[groups_[token.group].positions_offset++] = token.term_pos;
+    }
+
+    auto &base = invidx_.base_;
+    for (const auto &group : groups_) {
+      auto term_id = base.add_term(token_str(tokens_[group.token]));
+      auto &term = base.terms_[term_id];
+      term.term_count += group.count;
+      term.postings.add_term_positions(
+          document_id, &positions_[group.positions_offset - group.count],
+          group.count);
+    }
+  }
+
   InMemoryInvertedIndex<T> &invidx_;
-  Normalizer normalizer_;
+  Norm normalizer_;
+  TokenBuffers token_buffers_;
+  std::vector<T> text_ranges_;
+
+  // Tokens of the document being indexed, with their characters kept in
+  // one buffer
+  std::vector<char32_t> chars_;
+  std::vector<Token> tokens_;
+  std::vector<uint32_t> table_;
+  std::vector<Group> groups_;
+  std::vector<uint32_t> positions_;
 };
 
 template <typename T>
@@ -302,4 +1005,309 @@ inline std::shared_ptr<IInvertedIndexWithTextRange<T>> make_in_memory_index(
   return std::shared_ptr<IInvertedIndexWithTextRange<T>>(invidx);
 }
 
+//-----------------------------------------------------------------------------
+// Sealed Index
+//-----------------------------------------------------------------------------
+
+// An immutable index for queries, made from a built index by `seal`. All of
+// its data is one contiguous image: document ids and lengths in flat arrays, a
+// front-coded term dictionary whose ranks are the term ids, the compressed
+// postings blocks of all terms back to back, document sets of frequent terms
+// and bit-packed text ranges. The index reads the image in place.
+class SealedInvertedIndex : public IInvertedIndexWithTextRange<TextRange> {
+public:
+  // `image` must stay valid as long as `owner` is alive. Text ranges are
+  // recomputed from `document_source` if the image doesn't keep them.
+  SealedInvertedIndex(std::shared_ptr<const void> owner, const uint8_t *image,
+                      size_t image_size,
+                      DocumentSource<TextRange> document_source = nullptr);
+  ~SealedInvertedIndex() override;
+
+  size_t document_count() const override;
+
+  size_t external_document_id(size_t document_id) const override;
+  std::optional<size_t>
+  internal_document_id(size_t external_document_id) const override;
+
+  size_t document_term_count(size_t document_id) const override;
+  double average_document_term_count() const override;
+
+  bool term_exists(const std::u32string &str) const override;
+  size_t term_count(const std::u32string &str) const override;
+  size_t term_count(const std::u32string &str,
+                    size_t document_id) const override;
+
+  size_t df(const std::u32string &str) const override;
+  double tf(const std::u32string &str, size_t document_id) const override;
+
+  const IPostings &postings(const std::u32string &str) const override;
+
+  const DocumentSet *document_set(const std::u32string &str) const override;
+
+  std::optional<size_t> term_id(const std::u32string &str) const override;
+
+  size_t term_count(size_t term_id) const override;
+  size_t term_count(size_t term_id, size_t document_id) const override;
+
+  size_t df(size_t term_id) const override;
+  double tf(size_t term_id, size_t document_id) const override;
+
+  const IPostings &postings(size_t term_id) const override;
+  const DocumentSet *document_set(size_t term_id) const override;
+
+  TextRange text_range(const IPostings &positions, size_t index,
+                       size_t search_hit_index) const override;
+
+  const TermDictionary &term_dictionary() const;
+
+  const uint8_t *image() const;
+  size_t image_size() const;
+
+  // The image plus what is built when it is opened
+  size_t storage_size() const;
+
+  size_t total_term_count() const;
+
+  // Deleted documents are left out of the image.
+  static std::vector<uint8_t>
+  build_image(const InMemoryInvertedIndex<TextRange> &invidx);
+
+  // Builds one image from in-memory indexes of consecutive runs of
+  // documents, as if they were indexed into one. Postings are encoded on
+  // `thread_count` threads, each taking a range of terms at a time.
+  // `thread_count` is capped at `std::thread::hardware_concurrency()`. A
+  // single part is sealed as it is.
+  static std::vector<uint8_t> build_image(
+      const std::vector<const InMemoryInvertedIndex<TextRange> *> &parts,
+      size_t thread_count);
+
+  // Builds one image from several sealed indexes. Documents keep their
+  // order, with the ids of each index following those of the previous one.
+  // Documents which aren't in `live_documents` of their index are purged.
+  static std::vector<uint8_t>
+  merge_images(const std::vector<const SealedInvertedIndex *> &segments,
+               const std::vector<const LiveDocuments *> &live_documents = {});
+
+private:
+  class Postings;
+  class ImageBuilder;
+  struct TermEntry;
+  struct TermState;
+
+  size_t checked_term_id(const std::u32string &str) const;
+  const TermState &term_state(size_t term_id) const;
+
+  std::shared_ptr<const void> owner_;
+  const uint8_t *image_;
+  size_t image_size_;
+
+  size_t document_count_ = 0;
+  size_t total_term_count_ = 0;
+  const uint64_t *external_document_ids_ = nullptr;
+  // Internal ids sorted by their external ids
+  const uint32_t *sorted_document_ids_ = nullptr;
+  const uint32_t *document_term_counts_ = nullptr;
+
+  TermDictionary term_dictionary_;
+  const TermEntry *terms_ = nullptr;
+  const InMemoryInvertedIndexBase::Postings::Block *blocks_ = nullptr;
+  size_t block_count_ = 0;
+  const uint8_t *postings_data_ = nullptr;
+  size_t postings_data_size_ = 0;
+  const uint64_t *document_set_offsets_ = nullptr;
+  size_t document_set_offset_count_ = 0;
+  const uint8_t *document_set_data_ = nullptr;
+  size_t document_set_data_size_ = 0;
+  // Loaded by `term_state` on first use
+  std::unique_ptr<std::atomic<TermState *>[]> term_states_;
+
+  TextRangeStore text_range_store_;
+  DocumentSource<TextRange> document_source_;
+};
+
+// Builds the image of a sealed index from `invidx`, which can then be
+// dropped.
+std::shared_ptr<SealedInvertedIndex>
+seal(const InMemoryInvertedIndex<TextRange> &invidx);
+
+// Builds a sealed index on `thread_count` threads. The documents given to the
+// indexer in `callback` are split into consecutive runs, each indexed by a
+// worker, and the runs are merged by term range. The result is the same as
+// indexing the documents in order with one `InMemoryIndexer` and sealing the
+// index. Tokenizers run after `callback` returns, so the text they read must
+// outlive this call. `thread_count` is capped at
+// `std::thread::hardware_concurrency()`, and with one thread the documents
+// are indexed and sealed as they are given, without the merge.
+std::shared_ptr<SealedInvertedIndex> make_sealed_index(
+    Normalizer normalizer,
+    std::function<void(IIndexer<TextRange> &indexer)> callback,
+    size_t thread_count = std::thread::hardware_concurrency());
+
+// Writes the image of a sealed index to `path`. The file replaces any
+// previous one only once it is complete.
+void save_index(const InMemoryInvertedIndex<TextRange> &invidx,
+                const std::string &path);
+void save_index(const SealedInvertedIndex &invidx, const std::string &path);
+
+// Reads an index written by `save_index` in one go.
+std::shared_ptr<SealedInvertedIndex>
+load_index(const std::string &path,
+           DocumentSource<TextRange> document_source = nullptr);
+
+// Maps an index written by `save_index` into memory and reads it in place.
+// Pages are loaded on demand, shared by every process which maps the file,
+// and can be dropped by the OS while they are cold. Falls back to
+// `load_index` where memory mapping isn't available.
+std::shared_ptr<SealedInvertedIndex>
+map_index(const std::string &path,
+          DocumentSource<TextRange> document_source = nullptr);
+
+//-----------------------------------------------------------------------------
+// Segmented Index
+//-----------------------------------------------------------------------------
+
+// A read-only view over sealed segments, which presents them as one index.
+// Document ids of each segment follow those of the previous one, and the
+// postings of a term are those of the segments put end to end. Documents
+// deleted from a segment are those missing from its `live_documents` entry,
+// where nullptr means none.
+class MultiSegmentIndex : public IInvertedIndexWithTextRange<TextRange> {
+public:
+  explicit MultiSegmentIndex(
+      std::vector<std::shared_ptr<const SealedInvertedIndex>> segments,
+      const std::vector<std::shared_ptr<const LiveDocuments>> &live_documents =
+          {});
+  ~MultiSegmentIndex() override;
+
+  size_t document_count() const override;
+
+  size_t external_document_id(size_t document_id) const override;
+  std::optional<size_t>
+  internal_document_id(size_t external_document_id) const override;
+
+  size_t document_term_count(size_t document_id) const override;
+  double average_document_term_count() const override;
+
+  bool term_exists(const std::u32string &str) const override;
+  size_t term_count(const std::u32string &str) const override;
+  size_t term_count(const std::u32string &str,
+                    size_t document_id) const override;
+
+  size_t df(const std::u32string &str) const override;
+  double tf(const std::u32string &str, size_t document_id) const override;
+
+  const IPostings &postings(const std::u32string &str) const override;
+
+  std::optional<size_t> term_id(const std::u32string &str) const override;
+
+  size_t term_count(size_t term_id) const override;
+  size_t term_count(size_t term_id, size_t document_id) const override;
+
+  size_t df(size_t term_id) const override;
+  double tf(size_t term_id, size_t document_id) const override;
+
+  const IPostings &postings(size_t term_id) const override;
+
+  const LiveDocuments *live_documents() const override;
+
+  TextRange text_range(const IPostings &positions, size_t index,
+                       size_t search_hit_index) const override;
+
+  const std::vector<std::shared_ptr<const SealedInvertedIndex>> &
+  segments() const;
+
+private:
+  class Postings;
+  class Cursor;
+  struct Terms;
+
+  size_t checked_term_id(const std::u32string &str) const;
+  size_t segment_of(size_t document_id) const;
+  const Postings &term_postings(size_t term_id) const;
+
+  std::vector<std::shared_ptr<const SealedInvertedIndex>> segments_;
+  // The first document id of each segment, and the total at the end
+  std::vector<size_t> bases_;
+  size_t total_term_count_ = 0;
+  // Live documents of all segments, empty when none is deleted
+  LiveDocuments live_documents_;
+
+  // Terms are looked up in the segments when they are first used, so that
+  // building a view costs nothing per term. Term ids are given out in that
+  // order, and hold for this view only.
+  std::unique_ptr<Terms> terms_;
+};
+
+// Takes documents into a small in-memory segment, and seals it into an
+// immutable segment once it holds `segment_size` documents or `flush` is
+// called. A background thread keeps merging segments with a tiered policy:
+// segments are grouped into tiers by size, growing by `merge_factor` from one
+// tier to the next, and `merge_factor` adjacent segments of one tier are
+// merged into a segment of the next. Queries run on `reader`, an immutable
+// snapshot which is swapped in atomically, so that queries never wait for
+// indexing or merging.
+//
+// Deleting a document clears its bit in the live documents of its segment,
+// and merges purge deleted documents. Like new documents, deletions show in
+// `reader` after the next `flush`.
+class SegmentedIndex : public IIndexer<TextRange> {
+public:
+  explicit SegmentedIndex(Normalizer normalizer, size_t segment_size = 10000,
+                          size_t merge_factor = 10);
+  ~SegmentedIndex() override;
+
+  SegmentedIndex(const SegmentedIndex &) = delete;
+  SegmentedIndex &operator=(const SegmentedIndex &) = delete;
+
+  void index_document(size_t external_document_id,
+                      Tokenizer<TextRange> tokenizer) override;
+
+  bool delete_document(size_t external_document_id) override;
+
+  // Seals the documents indexed so far into a segment, and publishes them
+  // along with the deletions.
+  void flush();
+
+  // Blocks until no merge is pending.
+  void wait_for_merges();
+
+  // The segments sealed so far. The view stays valid while it is held, even
+  // after its segments are merged away. Safe to call from any thread.
+  std::shared_ptr<const MultiSegmentIndex> reader() const;
+
+private:
+  void reset_buffer();
+  bool delete_from_segments(size_t external_document_id);
+  void merge_loop();
+  std::optional<std::pair<size_t, size_t>> find_merge() const;
+  size_t tier(const SealedInvertedIndex &segment) const;
+  void publish(std::unique_lock<std::mutex> &lock);
+
+  Normalizer normalizer_;
+  size_t segment_size_;
+  size_t merge_factor_;
+
+  // Owned by the indexing thread
+  std::unique_ptr<InMemoryInvertedIndex<TextRange>> buffer_;
+  std::unique_ptr<InMemoryIndexer<TextRange>> indexer_;
+
+  // Guarded by `mutex_`. Views are built outside of the lock, so a view is
+  // published only if it is newer than the current one.
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<std::shared_ptr<const SealedInvertedIndex>> segments_;
+  // Copied on write while a merge or a view being built holds them
+  std::vector<std::shared_ptr<LiveDocuments>> live_documents_;
+  bool deleted_ = false;
+  size_t version_ = 0;
+  size_t reader_version_ = 0;
+  bool merging_ = false;
+  bool stop_ = false;
+
+  // Written under `mutex_`, but read with atomic loads only
+  std::shared_ptr<const MultiSegmentIndex> reader_;
+
+  std::thread merge_thread_;
+};
+
 } // namespace searchlib
@@ -0,0 +1,399 @@
+//
+//  codec.cpp
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include "codec.h"
+
+#include <array>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SEARCHLIB_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace searchlib {
+
+static uint8_t svb_code(uint32_t val) {
+  if (val < (1u << 8)) {
+    return 0;
+  } else if (val < (1u << 16)) {
+    return 1;
+  } else if (val < (1u << 24)) {
+    return 2;
+  }
+  return 3;
+}
+
+size_t svb_encode(const uint32_t *in, size_t count, uint8_t *out) {
+  auto control = out;
+  auto data = out + (count + 3) / 4;
+  std::memset(control, 0, (count + 3) / 4);
+
+  for (size_t i = 0; i < count; i++) {
+    auto val = in[i];
+    auto code = svb_code(val);
+    control[i / 4] |= code << ((i % 4) * 2);
+    for (size_t j = 0; j <= code; j++) {
+      *data++ = static_cast<uint8_t>(val >> (j * 8));
+    }
+  }
+
+  return data - out;
+}
+
+static const uint8_t *svb_decode_values(const uint8_t *control,
+                                        const uint8_t *data, size_t beg,
+                                        size_t end, uint32_t *out) {
+  for (auto i = beg; i < end; i++) {
+    size_t code = (control[i / 4] >> ((i % 4) * 2)) & 0x03;
+    uint32_t val = 0;
+    for (size_t j = 0; j <= code; j++) {
+      val |= static_cast<uint32_t>(*data++) << (j * 8);
+    }
+    out[i] = val;
+  }
+  return data;
+}
+
+size_t svb_encoded_size(const uint8_t *in, size_t count) {
+  auto size = (count + 3) / 4;
+  for (size_t i = 0; i < count; i++) {
+    size += ((in[i / 4] >> ((i % 4) * 2)) & 0x03) + 1;
+  }
+  return size;
+}
+
+size_t svb_decode_scalar(const uint8_t *in, size_t count, uint32_t *out) {
+  auto control = in;
+  auto data = in + (count + 3) / 4;
+  return svb_decode_values(control, data, 0, count, out) - in;
+}
+
+void prefix_sum_scalar(uint32_t *values, size_t count) {
+  for (size_t i = 1; i < count; i++) {
+    values[i] += values[i - 1];
+  }
+}
+
+static void bitmap_and_scalar(const uint64_t *a, const uint64_t *b,
+                              uint64_t *out, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    out[i] = a[i] & b[i];
+  }
+}
+
+static void bitmap_or_scalar(const uint64_t *a, const uint64_t *b,
+                             uint64_t *out, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    out[i] = a[i] | b[i];
+  }
+}
+
+static bool is_ascii_letter(uint8_t c) {
+  return static_cast<uint8_t>((c | 0x20) - 'a') < 26;
+}
+
+void classify_ascii_scalar(const char *text, size_t size, uint64_t &letters,
+                           uint64_t &non_ascii) {
+  letters = 0;
+  non_ascii = 0;
+  for (size_t i = 0; i < size; i++) {
+    auto c = static_cast<uint8_t>(text[i]);
+    letters |= uint64_t(is_ascii_letter(c)) << i;
+    non_ascii |= uint64_t(c >> 7) << i;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// SIMD kernels
+//-----------------------------------------------------------------------------
+
+#ifdef SEARCHLIB_X86_SIMD
+
+namespace {
+
+// For every control byte: the byte count of its four values, and a shuffle
+// mask which spreads those bytes into four 32-bit lanes.
+struct SvbTables {
+  std::array<uint8_t, 256> lengths;
+  std::array<std::array<uint8_t, 16>, 256> shuffles;
+
+  SvbTables() {
+    for (size_t control = 0; control < 256; control++) {
+      uint8_t offset = 0;
+      for (size_t k = 0; k < 4; k++) {
+        auto len = ((control >> (k * 2)) & 0x03) + 1;
+        for (size_t j = 0; j < 4; j++) {
+          shuffles[control][k * 4 + j] = j < len ? offset + j : 0x80;
+        }
+        offset += len;
+      }
+      lengths[control] = offset;
+    }
+  }
+};
+
+const SvbTables &svb_tables() {
+  static SvbTables tables;
+  return tables;
+}
+
+} // namespace
+
+__attribute__((target("sse4.1"))) static size_t
+svb_decode_sse41(const uint8_t *in, size_t count, uint32_t *out) {
+  const auto &tables = svb_tables();
+  auto control = in;
+  auto data = in + (count + 3) / 4;
+
+  // A 16-byte load may read past the last value, so stop the vector loop
+  // where fewer than 16 bytes of data are left.
+  auto full_groups = count / 4;
+  size_t data_size = 0;
+  for (size_t i = 0; i < full_groups; i++) {
+    data_size += tables.lengths[control[i]];
+  }
+  auto safe_end = data + data_size;
+
+  size_t group = 0;
+  for (; group < full_groups && data + 16 <= safe_end; group++) {
+    auto c = control[group];
+    auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+    auto mask = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(tables.shuffles[c].data()));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + group * 4),
+                     _mm_shuffle_epi8(bytes, mask));
+    data += tables.lengths[c];
+  }
+
+  return svb_decode_values(control, data, group * 4, count, out) - in;
+}
+
+__attribute__((target("sse4.1"))) static void
+prefix_sum_sse41(uint32_t *values, size_t count) {
+  auto carry = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    auto p = reinterpret_cast<__m128i *>(values + i);
+    auto x = _mm_loadu_si128(p);
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi32(x, carry);
+    _mm_storeu_si128(p, x);
+    carry = _mm_shuffle_epi32(x, 0xFF);
+  }
+
+  auto prev = i > 0 ? values[i - 1] : 0;
+  for (; i < count; i++) {
+    values[i] += prev;
+    prev = values[i];
+  }
+}
+
+__attribute__((target("avx2"))) static void prefix_sum_avx2(uint32_t *values,
+                                                            size_t count) {
+  auto carry = _mm256_setzero_si256();
+  auto last = _mm256_set1_epi32(7);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    auto p = reinterpret_cast<__m256i *>(values + i);
+    auto x = _mm256_loadu_si256(p);
+    // Prefix sums within each 128-bit lane...
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    // ...then carry the total of the low lane into the high lane.
+    auto low_total = _mm256_shuffle_epi32(x, 0xFF);
+    x = _mm256_add_epi32(x, _mm256_permute2x128_si256(low_total, low_total,
+                                                      0x08));
+    x = _mm256_add_epi32(x, carry);
+    _mm256_storeu_si256(p, x);
+    carry = _mm256_permutevar8x32_epi32(x, last);
+  }
+
+  auto prev = i > 0 ? values[i - 1] : 0;
+  for (; i < count; i++) {
+    values[i] += prev;
+    prev = values[i];
+  }
+}
+
+__attribute__((target("avx2"))) static void
+bitmap_and_avx2(const uint64_t *a, const uint64_t *b, uint64_t *out,
+                size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+    auto y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i),
+                        _mm256_and_si256(x, y));
+  }
+  bitmap_and_scalar(a + i, b + i, out + i, count - i);
+}
+
+__attribute__((target("avx2"))) static void
+bitmap_or_avx2(const uint64_t *a, const uint64_t *b, uint64_t *out,
+               size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+    auto y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i),
+                        _mm256_or_si256(x, y));
+  }
+  bitmap_or_scalar(a + i, b + i, out + i, count - i);
+}
+
+// A byte is an ASCII letter when it's in 'a'..'z' once the case bit is set.
+// Bytes of 0x80 and up never are.
+__attribute__((target("sse2"))) static void
+classify_ascii_sse2(const char *text, size_t size, uint64_t &letters,
+                    uint64_t &non_ascii) {
+  // Zeros past the end are neither letters nor non-ASCII
+  char padded[64] = {};
+  if (size < 64) {
+    std::memcpy(padded, text, size);
+    text = padded;
+  }
+
+  auto case_bit = _mm_set1_epi8(0x20);
+  auto a = _mm_set1_epi8('a');
+  auto max = _mm_set1_epi8(25);
+  letters = 0;
+  non_ascii = 0;
+  for (size_t i = 0; i < 64; i += 16) {
+    auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+    auto offsets = _mm_sub_epi8(_mm_or_si128(bytes, case_bit), a);
+    auto is_letter = _mm_cmpeq_epi8(_mm_min_epu8(offsets, max), offsets);
+    letters |= uint64_t(static_cast<uint16_t>(_mm_movemask_epi8(is_letter)))
+               << i;
+    non_ascii |= uint64_t(static_cast<uint16_t>(_mm_movemask_epi8(bytes)))
+                 << i;
+  }
+}
+
+__attribute__((target("avx2"))) static void
+classify_ascii_avx2(const char *text, size_t size, uint64_t &letters,
+                    uint64_t &non_ascii) {
+  // Zeros past the end are neither letters nor non-ASCII
+  char padded[64] = {};
+  if (size < 64) {
+    std::memcpy(padded, text, size);
+    text = padded;
+  }
+
+  auto case_bit = _mm256_set1_epi8(0x20);
+  auto a = _mm256_set1_epi8('a');
+  auto max = _mm256_set1_epi8(25);
+  letters = 0;
+  non_ascii = 0;
+  for (size_t i = 0; i < 64; i += 32) {
+    auto bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i));
+    auto offsets = _mm256_sub_epi8(_mm256_or_si256(bytes, case_bit), a);
+    auto is_letter =
+        _mm256_cmpeq_epi8(_mm256_min_epu8(offsets, max), offsets);
+    letters |= uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(is_letter)))
+               << i;
+    non_ascii |= uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(bytes)))
+                 << i;
+  }
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Dispatch
+//-----------------------------------------------------------------------------
+
+SimdLevel simd_level() {
+#ifdef SEARCHLIB_X86_SIMD
+  static auto level = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return SimdLevel::AVX2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+      return SimdLevel::SSE41;
+    }
+    return SimdLevel::Scalar;
+  }();
+  return level;
+#else
+  return SimdLevel::Scalar;
+#endif
+}
+
+size_t svb_decode(const uint8_t *in, size_t count, uint32_t *out) {
+#ifdef SEARCHLIB_X86_SIMD
+  static auto fn =
+      simd_level() != SimdLevel::Scalar ? svb_decode_sse41 : svb_decode_scalar;
+  return fn(in, count, out);
+#else
+  return svb_decode_scalar(in, count, out);
+#endif
+}
+
+void prefix_sum(uint32_t *values, size_t count) {
+#ifdef SEARCHLIB_X86_SIMD
+  static auto fn = [] {
+    switch (simd_level()) {
+    case SimdLevel::AVX2:
+      return prefix_sum_avx2;
+    case SimdLevel::SSE41:
+      return prefix_sum_sse41;
+    default:
+      return prefix_sum_scalar;
+    }
+  }();
+  return fn(values, count);
+#else
+  prefix_sum_scalar(values, count);
+#endif
+}
+
+void bitmap_and(const uint64_t *a, const uint64_t *b, uint64_t *out,
+                size_t count) {
+#ifdef SEARCHLIB_X86_SIMD
+  static auto fn = simd_level() == SimdLevel::AVX2 ? bitmap_and_avx2
+                                                   : bitmap_and_scalar;
+  fn(a, b, out, count);
+#else
+  bitmap_and_scalar(a, b, out, count);
+#endif
+}
+
+void bitmap_or(const uint64_t *a, const uint64_t *b, uint64_t *out,
+               size_t count) {
+#ifdef SEARCHLIB_X86_SIMD
+  static auto fn =
+      simd_level() == SimdLevel::AVX2 ? bitmap_or_avx2 : bitmap_or_scalar;
+  fn(a, b, out, count);
+#else
+  bitmap_or_scalar(a, b, out, count);
+#endif
+}
+
+void classify_ascii(const char *text, size_t size, uint64_t &letters,
+                    uint64_t &non_ascii) {
+#ifdef SEARCHLIB_X86_SIMD
+  // SSE4.1 implies SSE2
+  static auto fn = [] {
+    switch (simd_level()) {
+    case SimdLevel::AVX2:
+      return classify_ascii_avx2;
+    case SimdLevel::SSE41:
+      return classify_ascii_sse2;
+    default:
+      return classify_ascii_scalar;
+    }
+  }();
+  fn(text, size, letters, non_ascii);
+#else
+  classify_ascii_scalar(text, size, letters, non_ascii);
+#endif
+}
+
+} // namespace searchlib
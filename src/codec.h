@@ -0,0 +1,170 @@
+//
+//  codec.h
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace searchlib {
+
+// Stream VByte: a control byte holds four 2-bit codes, each telling whether
+// the matching value takes 1, 2, 3 or 4 bytes. All control bytes of a
+// sequence come first, followed by the little-endian data bytes.
+
+inline size_t svb_max_encoded_size(size_t count) {
+  return (count + 3) / 4 + count * sizeof(uint32_t);
+}
+
+size_t svb_encode(const uint32_t *in, size_t count, uint8_t *out);
+
+// The size of an encoded sequence, as told by its control bytes.
+size_t svb_encoded_size(const uint8_t *in, size_t count);
+
+// Decoders return the number of bytes consumed. `svb_decode` and
+// `prefix_sum` pick the fastest kernel the CPU supports at run time.
+size_t svb_decode(const uint8_t *in, size_t count, uint32_t *out);
+size_t svb_decode_scalar(const uint8_t *in, size_t count, uint32_t *out);
+
+// Turns deltas into running totals in place: out[i] = in[0] + ... + in[i].
+void prefix_sum(uint32_t *values, size_t count);
+void prefix_sum_scalar(uint32_t *values, size_t count);
+
+// LEB128 variable-length integers: seven bits per byte, low bits first.
+
+inline void varint_encode(uint64_t val, std::vector<uint8_t> &out) {
+  while (val >= 0x80) {
+    out.push_back(static_cast<uint8_t>(val | 0x80));
+    val >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(val));
+}
+
+inline uint64_t varint_decode(const uint8_t *&in) {
+  uint64_t val = 0;
+  for (size_t shift = 0;; shift += 7) {
+    auto byte = *in++;
+    val |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  return val;
+}
+
+// Same as above for untrusted data, but fails instead of reading at or past
+// `end`.
+inline bool varint_decode(const uint8_t *&in, const uint8_t *end,
+                          uint64_t &val) {
+  val = 0;
+  for (size_t shift = 0; shift < 64; shift += 7) {
+    if (in == end) {
+      return false;
+    }
+    auto byte = *in++;
+    val |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Fixed-width bit fields packed into 64-bit words, low bits first.
+
+inline void write_bits(std::vector<uint64_t> &words, size_t offset,
+                       uint64_t val, size_t bits) {
+  if (bits == 0) {
+    return;
+  }
+  auto i = offset / 64;
+  auto shift = offset % 64;
+  if (words.size() < (offset + bits + 63) / 64) {
+    words.resize((offset + bits + 63) / 64, 0);
+  }
+  words[i] |= val << shift;
+  if (shift + bits > 64) {
+    words[i + 1] |= val >> (64 - shift);
+  }
+}
+
+inline uint64_t read_bits(const uint64_t *words, size_t offset, size_t bits) {
+  if (bits == 0) {
+    return 0;
+  }
+  auto i = offset / 64;
+  auto shift = offset % 64;
+  auto val = words[i] >> shift;
+  if (shift + bits > 64) {
+    val |= words[i + 1] << (64 - shift);
+  }
+  return bits == 64 ? val : val & ((uint64_t(1) << bits) - 1);
+}
+
+// Bit scans and population counts, on the instructions each compiler
+// exposes. The scans are undefined for zero.
+
+inline size_t count_leading_zeros(uint64_t val) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanReverse64(&index, val);
+  return 63 - index;
+#else
+  return __builtin_clzll(val);
+#endif
+}
+
+inline size_t count_trailing_zeros(uint64_t val) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward64(&index, val);
+  return index;
+#else
+  return __builtin_ctzll(val);
+#endif
+}
+
+inline size_t popcount(uint64_t val) {
+#if defined(_MSC_VER) && defined(_M_X64)
+  return __popcnt64(val);
+#elif defined(_MSC_VER)
+  val -= (val >> 1) & 0x5555555555555555;
+  val = (val & 0x3333333333333333) + ((val >> 2) & 0x3333333333333333);
+  val = (val + (val >> 4)) & 0x0f0f0f0f0f0f0f0f;
+  return (val * 0x0101010101010101) >> 56;
+#else
+  return __builtin_popcountll(val);
+#endif
+}
+
+inline size_t bit_width(uint64_t val) {
+  return val == 0 ? 0 : 64 - count_leading_zeros(val);
+}
+
+// Word-parallel set operations on bitmaps of `count` 64-bit words.
+void bitmap_and(const uint64_t *a, const uint64_t *b, uint64_t *out,
+                size_t count);
+void bitmap_or(const uint64_t *a, const uint64_t *b, uint64_t *out,
+               size_t count);
+
+// Bitmaps over up to 64 bytes of text: bit i of `letters` is set when byte i
+// is an ASCII letter, and bit i of `non_ascii` when it's 0x80 or up.
+void classify_ascii(const char *text, size_t size, uint64_t &letters,
+                    uint64_t &non_ascii);
+void classify_ascii_scalar(const char *text, size_t size, uint64_t &letters,
+                           uint64_t &non_ascii);
+
+enum class SimdLevel { Scalar, SSE41, AVX2 };
+
+SimdLevel simd_level();
+
+} // namespace searchlib
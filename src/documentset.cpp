@@ -0,0 +1,499 @@
+//
+//  documentset.cpp
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+#include "./codec.h"
+#include "./utils.h"
+#include "searchlib.h"
+
+namespace searchlib {
+
+using Container = DocumentSet::Container;
+
+static constexpr size_t chunk_bits = 16;
+static constexpr size_t bitmap_words = (1 << chunk_bits) / 64;
+static constexpr size_t array_max_size = 4096;
+
+static bool container_contains(const Container &c, uint16_t low) {
+  switch (c.type) {
+  case Container::Type::Array:
+    return std::binary_search(c.values.begin(), c.values.end(), low);
+  case Container::Type::Bitmap:
+    return (c.words[low / 64] >> (low % 64)) & 1;
+  case Container::Type::Run: {
+    // Find the last run which starts at or before `low`
+    size_t lo = 0;
+    size_t hi = c.values.size() / 2;
+    while (lo < hi) {
+      auto mid = (lo + hi) / 2;
+      if (c.values[mid * 2] <= low) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo == 0) {
+      return false;
+    }
+    auto start = c.values[(lo - 1) * 2];
+    auto length = c.values[(lo - 1) * 2 + 1];
+    return low - start <= length;
+  }
+  }
+  return false;
+}
+
+template <typename T> static void for_each_value(const Container &c, T fn) {
+  switch (c.type) {
+  case Container::Type::Array:
+    for (auto low : c.values) {
+      fn(low);
+    }
+    break;
+  case Container::Type::Bitmap:
+    for (size_t i = 0; i < c.words.size(); i++) {
+      auto word = c.words[i];
+      while (word) {
+        fn(static_cast<uint16_t>(i * 64 + count_trailing_zeros(word)));
+        word &= word - 1;
+      }
+    }
+    break;
+  case Container::Type::Run:
+    for (size_t i = 0; i < c.values.size(); i += 2) {
+      uint32_t start = c.values[i];
+      uint32_t end = start + c.values[i + 1];
+      for (auto low = start; low <= end; low++) {
+        fn(static_cast<uint16_t>(low));
+      }
+    }
+    break;
+  }
+}
+
+static std::vector<uint64_t> to_words(const Container &c) {
+  if (c.type == Container::Type::Bitmap) {
+    return c.words;
+  }
+  std::vector<uint64_t> words(bitmap_words, 0);
+  for_each_value(c, [&](auto low) { words[low / 64] |= 1ull << (low % 64); });
+  return words;
+}
+
+static std::vector<uint16_t> to_array(const Container &c) {
+  if (c.type == Container::Type::Array) {
+    return c.values;
+  }
+  std::vector<uint16_t> values;
+  values.reserve(c.cardinality);
+  for_each_value(c, [&](auto low) { values.push_back(low); });
+  return values;
+}
+
+static std::vector<uint16_t> to_runs(const Container &c) {
+  std::vector<uint16_t> runs;
+  for_each_value(c, [&](auto low) {
+    if (!runs.empty() && runs[runs.size() - 2] + runs.back() + 1 == low) {
+      runs.back()++;
+    } else {
+      runs.push_back(low);
+      runs.push_back(0);
+    }
+  });
+  return runs;
+}
+
+static size_t count_runs(const Container &c) {
+  if (c.type == Container::Type::Run) {
+    return c.values.size() / 2;
+  }
+  size_t count = 0;
+  int32_t prev = -2;
+  for_each_value(c, [&](auto low) {
+    if (prev + 1 != low) {
+      count++;
+    }
+    prev = low;
+  });
+  return count;
+}
+
+static Container make_array(std::vector<uint16_t> &&values) {
+  Container c;
+  c.type = Container::Type::Array;
+  c.cardinality = static_cast<uint32_t>(values.size());
+  c.values = std::move(values);
+  return c;
+}
+
+static Container make_bitmap(std::vector<uint64_t> &&words) {
+  Container c;
+  c.type = Container::Type::Bitmap;
+  for (auto word : words) {
+    c.cardinality += static_cast<uint32_t>(popcount(word));
+  }
+  c.words = std::move(words);
+
+  if (c.cardinality <= array_max_size) {
+    return make_array(to_array(c));
+  }
+  return c;
+}
+
+static Container intersect_containers(const Container &a, const Container &b) {
+  if (a.type == Container::Type::Array && b.type == Container::Type::Array) {
+    const auto &x = a.cardinality <= b.cardinality ? a.values : b.values;
+    const auto &y = a.cardinality <= b.cardinality ? b.values : a.values;
+
+    std::vector<uint16_t> values;
+    auto it = y.begin();
+    for (auto low : x) {
+      it = gallop_lower_bound(it, y.end(), low);
+      if (it == y.end()) {
+        break;
+      }
+      if (*it == low) {
+        values.push_back(low);
+      }
+    }
+    return make_array(std::move(values));
+  }
+
+  // Probe the sparse side against the dense one instead of expanding it
+  if (a.type == Container::Type::Array || b.type == Container::Type::Array) {
+    const auto &sparse = a.type == Container::Type::Array ? a : b;
+    const auto &dense = a.type == Container::Type::Array ? b : a;
+
+    std::vector<uint16_t> values;
+    for (auto low : sparse.values) {
+      if (container_contains(dense, low)) {
+        values.push_back(low);
+      }
+    }
+    return make_array(std::move(values));
+  }
+
+  auto x = to_words(a);
+  auto y = to_words(b);
+  bitmap_and(x.data(), y.data(), x.data(), bitmap_words);
+  return make_bitmap(std::move(x));
+}
+
+static Container unite_containers(const Container &a, const Container &b) {
+  if (a.type == Container::Type::Array && b.type == Container::Type::Array &&
+      a.cardinality + b.cardinality <= array_max_size) {
+    std::vector<uint16_t> values;
+    std::set_union(a.values.begin(), a.values.end(), b.values.begin(),
+                   b.values.end(), std::back_inserter(values));
+    return make_array(std::move(values));
+  }
+
+  auto x = to_words(a);
+  auto y = to_words(b);
+  bitmap_or(x.data(), y.data(), x.data(), bitmap_words);
+  return make_bitmap(std::move(x));
+}
+
+//-----------------------------------------------------------------------------
+
+void DocumentSet::add(size_t document_id) {
+  uint64_t key = document_id >> chunk_bits;
+  auto low = static_cast<uint16_t>(document_id);
+
+  if (keys_.empty() || keys_.back() != key) {
+    assert(keys_.empty() || keys_.back() < key);
+    keys_.push_back(key);
+    containers_.emplace_back();
+  }
+
+  auto &c = containers_.back();
+  if (c.type == Container::Type::Run) {
+    c = make_array(to_array(c));
+  }
+
+  if (c.type == Container::Type::Array) {
+    assert(c.values.empty() || c.values.back() < low);
+    if (c.values.size() < array_max_size) {
+      c.values.push_back(low);
+      c.cardinality++;
+      return;
+    }
+    c.words = to_words(c);
+    c.values.clear();
+    c.type = Container::Type::Bitmap;
+  }
+
+  c.words[low / 64] |= 1ull << (low % 64);
+  c.cardinality++;
+}
+
+void DocumentSet::optimize() {
+  for (auto &c : containers_) {
+    auto array_size = c.cardinality * sizeof(uint16_t);
+    auto bitmap_size = bitmap_words * sizeof(uint64_t);
+    auto run_size = count_runs(c) * sizeof(uint16_t) * 2;
+
+    if (run_size < std::min(array_size, bitmap_size)) {
+      if (c.type != Container::Type::Run) {
+        auto runs = to_runs(c);
+        c.values = std::move(runs);
+        c.words = {};
+        c.type = Container::Type::Run;
+      }
+    } else if (array_size <= bitmap_size) {
+      if (c.type != Container::Type::Array) {
+        c = make_array(to_array(c));
+      }
+    } else if (c.type != Container::Type::Bitmap) {
+      c.words = to_words(c);
+      c.values = {};
+      c.type = Container::Type::Bitmap;
+    }
+  }
+}
+
+void DocumentSet::clear() {
+  keys_.clear();
+  containers_.clear();
+}
+
+bool DocumentSet::empty() const { return keys_.empty(); }
+
+size_t DocumentSet::size() const {
+  size_t size = 0;
+  for (const auto &c : containers_) {
+    size += c.cardinality;
+  }
+  return size;
+}
+
+bool DocumentSet::contains(size_t document_id) const {
+  uint64_t key = document_id >> chunk_bits;
+  auto it = std::lower_bound(keys_.begin(), keys_.end(), key);
+  if (it == keys_.end() || *it != key) {
+    return false;
+  }
+  const auto &c = containers_[std::distance(keys_.begin(), it)];
+  return container_contains(c, static_cast<uint16_t>(document_id));
+}
+
+bool DocumentSet::has_dense_containers() const {
+  for (const auto &c : containers_) {
+    if (c.type != Container::Type::Array) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t DocumentSet::storage_size() const {
+  auto size = keys_.size() * (sizeof(uint64_t) + sizeof(Container));
+  for (const auto &c : containers_) {
+    size += c.values.size() * sizeof(uint16_t) +
+            c.words.size() * sizeof(uint64_t);
+  }
+  return size;
+}
+
+void DocumentSet::for_each(std::function<void(size_t document_id)> fn) const {
+  for (size_t i = 0; i < keys_.size(); i++) {
+    auto high = static_cast<size_t>(keys_[i] << chunk_bits);
+    for_each_value(containers_[i], [&](auto low) { fn(high | low); });
+  }
+}
+
+std::vector<size_t> DocumentSet::to_vector() const {
+  std::vector<size_t> document_ids;
+  document_ids.reserve(size());
+  for_each([&](auto document_id) { document_ids.push_back(document_id); });
+  return document_ids;
+}
+
+DocumentSet DocumentSet::intersect(const DocumentSet &a,
+                                   const DocumentSet &b) {
+  DocumentSet result;
+  size_t i = 0;
+  size_t j = 0;
+  while (i < a.keys_.size() && j < b.keys_.size()) {
+    if (a.keys_[i] < b.keys_[j]) {
+      i++;
+    } else if (b.keys_[j] < a.keys_[i]) {
+      j++;
+    } else {
+      auto c = intersect_containers(a.containers_[i], b.containers_[j]);
+      if (c.cardinality > 0) {
+        result.keys_.push_back(a.keys_[i]);
+        result.containers_.push_back(std::move(c));
+      }
+      i++;
+      j++;
+    }
+  }
+  return result;
+}
+
+DocumentSet DocumentSet::unite(const DocumentSet &a, const DocumentSet &b) {
+  DocumentSet result;
+  size_t i = 0;
+  size_t j = 0;
+  while (i < a.keys_.size() || j < b.keys_.size()) {
+    if (j == b.keys_.size() ||
+        (i < a.keys_.size() && a.keys_[i] < b.keys_[j])) {
+      result.keys_.push_back(a.keys_[i]);
+      result.containers_.push_back(a.containers_[i++]);
+    } else if (i == a.keys_.size() || b.keys_[j] < a.keys_[i]) {
+      result.keys_.push_back(b.keys_[j]);
+      result.containers_.push_back(b.containers_[j++]);
+    } else {
+      result.keys_.push_back(a.keys_[i]);
+      result.containers_.push_back(
+          unite_containers(a.containers_[i++], b.containers_[j++]));
+    }
+  }
+  return result;
+}
+
+void DocumentSet::serialize(std::vector<uint8_t> &out) const {
+  auto append = [&](const void *data, size_t size) {
+    auto p = static_cast<const uint8_t *>(data);
+    out.insert(out.end(), p, p + size);
+  };
+
+  varint_encode(keys_.size(), out);
+  for (size_t i = 0; i < keys_.size(); i++) {
+    const auto &c = containers_[i];
+    varint_encode(keys_[i], out);
+    out.push_back(static_cast<uint8_t>(c.type));
+    varint_encode(c.cardinality, out);
+    varint_encode(c.values.size(), out);
+    varint_encode(c.words.size(), out);
+    append(c.values.data(), c.values.size() * sizeof(uint16_t));
+    append(c.words.data(), c.words.size() * sizeof(uint64_t));
+  }
+}
+
+DocumentSet DocumentSet::deserialize(const uint8_t *data,
+                                     const uint8_t *end) {
+  auto fail = []() {
+    throw std::runtime_error("DocumentSet: corrupted data");
+  };
+
+  auto p = data;
+  auto decode = [&]() {
+    uint64_t val;
+    if (!varint_decode(p, end, val)) {
+      fail();
+    }
+    return val;
+  };
+  auto read = [&](void *out, size_t size) {
+    if (size > static_cast<size_t>(end - p)) {
+      fail();
+    }
+    if (size > 0) {
+      std::memcpy(out, p, size);
+      p += size;
+    }
+  };
+  // Lengths are checked against the data left before anything is allocated
+  auto decode_length = [&](size_t element_size) {
+    auto length = decode();
+    if (length > static_cast<size_t>(end - p) / element_size) {
+      fail();
+    }
+    return static_cast<size_t>(length);
+  };
+
+  DocumentSet set;
+  auto count = decode_length(1);
+  set.keys_.resize(count);
+  set.containers_.resize(count);
+  for (size_t i = 0; i < count; i++) {
+    auto &c = set.containers_[i];
+    set.keys_[i] = decode();
+    if (i > 0 && set.keys_[i] <= set.keys_[i - 1]) {
+      fail();
+    }
+    uint8_t type;
+    read(&type, 1);
+    c.type = static_cast<Container::Type>(type);
+    c.cardinality = static_cast<uint32_t>(decode());
+    c.values.resize(decode_length(sizeof(uint16_t)));
+    c.words.resize(decode_length(sizeof(uint64_t)));
+    read(c.values.data(), c.values.size() * sizeof(uint16_t));
+    read(c.words.data(), c.words.size() * sizeof(uint64_t));
+
+    // Operations on the containers rely on these
+    switch (c.type) {
+    case Container::Type::Array:
+      if (c.values.size() != c.cardinality || !c.words.empty()) {
+        fail();
+      }
+      break;
+    case Container::Type::Bitmap:
+      if (c.words.size() != bitmap_words || !c.values.empty()) {
+        fail();
+      }
+      break;
+    case Container::Type::Run:
+      if (c.values.size() % 2 != 0 || !c.words.empty()) {
+        fail();
+      }
+      break;
+    default:
+      fail();
+    }
+  }
+
+  if (p != end) {
+    fail();
+  }
+  return set;
+}
+
+//-----------------------------------------------------------------------------
+
+LiveDocuments::LiveDocuments(size_t document_count) { resize(document_count); }
+
+void LiveDocuments::resize(size_t document_count) {
+  assert(document_count >= document_count_);
+  // Bits past `document_count_` are always set, so they are live already
+  words_.resize((document_count + 63) / 64, ~uint64_t(0));
+  document_count_ = document_count;
+}
+
+bool LiveDocuments::remove(size_t document_id) {
+  assert(document_id < document_count_);
+  auto &word = words_[document_id / 64];
+  auto bit = uint64_t(1) << (document_id % 64);
+  if (!(word & bit)) {
+    return false;
+  }
+  word &= ~bit;
+  deleted_count_++;
+  return true;
+}
+
+size_t LiveDocuments::document_count() const { return document_count_; }
+
+size_t LiveDocuments::deleted_count() const { return deleted_count_; }
+
+void LiveDocuments::for_each_deleted(
+    std::function<void(size_t document_id)> fn) const {
+  for (size_t i = 0; i < words_.size(); i++) {
+    auto word = ~words_[i];
+    while (word) {
+      fn(i * 64 + count_trailing_zeros(word));
+      word &= word - 1;
+    }
+  }
+}
+
+} // namespace searchlib
@@ -5,33 +5,260 @@
 //  MIT License
 //
 
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+#include "codec.h"
+#include "postings.h"
 #include "searchlib.h"
 #include "utils.h"
 
 namespace searchlib {
 
+IPostingsCursor::~IPostingsCursor() = default;
+
 IPostings::~IPostings() = default;
 
 IInvertedIndex::~IInvertedIndex() = default;
 
+const DocumentSet *IInvertedIndex::document_set(const std::u32string &) const {
+  return nullptr;
+}
+
+const DocumentSet *IInvertedIndex::document_set(size_t) const {
+  return nullptr;
+}
+
+const LiveDocuments *IInvertedIndex::live_documents() const { return nullptr; }
+
+size_t IInvertedIndex::live_document_count() const {
+  auto live = live_documents();
+  return document_count() - (live ? live->deleted_count() : 0);
+}
+
 //-----------------------------------------------------------------------------
 
+InMemoryInvertedIndexBase::Postings::DecodedBlock::DecodedBlock(
+    std::pmr::memory_resource *memory_resource)
+    : document_ids(memory_resource), position_offsets(memory_resource),
+      positions(memory_resource) {}
+
+size_t InMemoryInvertedIndexBase::Postings::DecodedBlock::positions_begin(
+    size_t offset) const {
+  return position_offsets[offset];
+}
+
+size_t InMemoryInvertedIndexBase::Postings::DecodedBlock::positions_end(
+    size_t offset) const {
+  return offset + 1 < position_offsets.size() ? position_offsets[offset + 1]
+                                               : positions.size();
+}
+
+void InMemoryInvertedIndexBase::Postings::DecodedBlock::clear() {
+  document_ids.clear();
+  position_offsets.clear();
+  positions.clear();
+}
+
+const DecodedPostingsBlock &decode_postings_block(const PostingsBlock &block,
+                                                  const uint8_t *data,
+                                                  DecodedPostingsBlock &decoded,
+                                                  bool with_positions) {
+  size_t count = block.document_count;
+  uint32_t values[InMemoryInvertedIndexBase::Postings::block_size];
+
+  auto p = data + block.data_offset;
+
+  decoded.document_ids.resize(count);
+  if (block.flags & InMemoryInvertedIndexBase::Postings::WideDocumentIds) {
+    for (size_t i = 0; i < count; i++) {
+      uint64_t id;
+      std::memcpy(&id, p, sizeof(id));
+      decoded.document_ids[i] = id;
+      p += sizeof(id);
+    }
+  } else {
+    p += svb_decode(p, count, values);
+    prefix_sum(values, count);
+    for (size_t i = 0; i < count; i++) {
+      decoded.document_ids[i] = block.first_document_id + values[i];
+    }
+  }
+
+  decoded.position_offsets.clear();
+  decoded.positions.clear();
+  if (!with_positions) {
+    return decoded;
+  }
+
+  // Frequencies are stored minus one, and positions are delta coded within
+  // each document.
+  p += svb_decode(p, count, values);
+  decoded.position_offsets.resize(count);
+  decoded.positions.resize(block.position_count);
+  svb_decode(p, block.position_count, decoded.positions.data());
+
+  uint32_t offset = 0;
+  for (size_t i = 0; i < count; i++) {
+    auto freq = values[i] + 1;
+    decoded.position_offsets[i] = offset;
+    prefix_sum(&decoded.positions[offset], freq);
+    offset += freq;
+  }
+
+  return decoded;
+}
+
+// Calls `fn` with a cursor on each entry of `postings` whose document is
+// deleted. Whichever of the deleted documents and the postings is shorter
+// drives the walk.
+template <typename T>
+static void for_each_deleted_entry(const IPostings &postings,
+                                   const LiveDocuments &live_documents, T fn) {
+  auto cursor = postings.cursor();
+  if (live_documents.deleted_count() < postings.size()) {
+    live_documents.for_each_deleted([&](auto document_id) {
+      cursor->advance_to(document_id);
+      if (!cursor->is_end() && cursor->document_id() == document_id) {
+        fn(*cursor);
+      }
+    });
+  } else {
+    for (; !cursor->is_end(); cursor->next()) {
+      if (!live_documents.contains(cursor->document_id())) {
+        fn(*cursor);
+      }
+    }
+  }
+}
+
+size_t live_document_frequency(const IPostings &postings,
+                               const LiveDocuments *live_documents) {
+  auto count = postings.size();
+  if (live_documents) {
+    for_each_deleted_entry(postings, *live_documents, [&](auto &) { count--; });
+  }
+  return count;
+}
+
+size_t live_term_count(const IPostings &postings, size_t term_count,
+                       const LiveDocuments *live_documents) {
+  if (live_documents) {
+    for_each_deleted_entry(postings, *live_documents,
+                           [&](auto &cursor) { term_count -= cursor.freq(); });
+  }
+  return term_count;
+}
+
+bool check_postings_block(const PostingsBlock &block, const uint8_t *data,
+                          size_t data_size, size_t document_count) {
+  size_t count = block.document_count;
+  uint32_t values[InMemoryInvertedIndexBase::Postings::block_size];
+
+  if (count == 0 || count > InMemoryInvertedIndexBase::Postings::block_size ||
+      block.first_document_id > block.last_document_id ||
+      block.last_document_id >= document_count ||
+      block.data_offset > data_size) {
+    return false;
+  }
+
+  auto p = data + block.data_offset;
+  auto end = data + data_size;
+  auto stream_fits = [&](size_t count) {
+    auto control_size = (count + 3) / 4;
+    return control_size <= static_cast<size_t>(end - p) &&
+           svb_encoded_size(p, count) <= static_cast<size_t>(end - p);
+  };
+
+  // Document ids must ascend from the first to the last one of the header
+  if (block.flags & InMemoryInvertedIndexBase::Postings::WideDocumentIds) {
+    if (count > static_cast<size_t>(end - p) / sizeof(uint64_t)) {
+      return false;
+    }
+    uint64_t prev = 0;
+    for (size_t i = 0; i < count; i++) {
+      uint64_t id;
+      std::memcpy(&id, p, sizeof(id));
+      p += sizeof(id);
+      if ((i == 0 && id != block.first_document_id) || (i > 0 && id <= prev)) {
+        return false;
+      }
+      prev = id;
+    }
+    if (prev != block.last_document_id) {
+      return false;
+    }
+  } else {
+    if (!stream_fits(count)) {
+      return false;
+    }
+    p += svb_decode(p, count, values);
+    uint64_t id = block.first_document_id;
+    for (size_t i = 0; i < count; i++) {
+      if ((i == 0 && values[i] != 0) || (i > 0 && values[i] == 0)) {
+        return false;
+      }
+      id += values[i];
+    }
+    if (id != block.last_document_id) {
+      return false;
+    }
+  }
+
+  // Frequencies must add up to the position count
+  if (!stream_fits(count)) {
+    return false;
+  }
+  p += svb_decode(p, count, values);
+  uint64_t position_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    position_count += uint64_t(values[i]) + 1;
+  }
+  return position_count == block.position_count &&
+         stream_fits(block.position_count);
+}
+
+uint64_t new_postings_stamp() {
+  // Zero is never handed out, so that it can mark an empty cache entry
+  static std::atomic<uint64_t> last_stamp{0};
+  return ++last_stamp;
+}
+
+uint64_t InMemoryInvertedIndexBase::Postings::new_stamp() {
+  return new_postings_stamp();
+}
+
+InMemoryInvertedIndexBase::Postings::Postings(
+    std::pmr::memory_resource *memory_resource)
+    : tail_(memory_resource) {}
+
 size_t InMemoryInvertedIndexBase::Postings::size() const {
-  return positions_map_.size();
+  return block_document_count() + tail_.size();
 }
 
 size_t InMemoryInvertedIndexBase::Postings::document_id(size_t index) const {
-  return find_positions_map(index)->first;
+  assert(index < size());
+  size_t offset;
+  const auto &block = find_block(index, false, offset);
+  return block.document_ids[offset];
 }
 
 size_t
 InMemoryInvertedIndexBase::Postings::search_hit_count(size_t index) const {
-  return find_positions_map(index)->second.size();
+  assert(index < size());
+  size_t offset;
+  const auto &block = find_block(index, true, offset);
+  return block.positions_end(offset) - block.positions_begin(offset);
 }
 
 size_t InMemoryInvertedIndexBase::Postings::term_position(
     size_t index, size_t search_hit_index) const {
-  return find_positions_map(index)->second[search_hit_index];
+  assert(index < size());
+  size_t offset;
+  const auto &block = find_block(index, true, offset);
+  return block.positions[block.positions_begin(offset) + search_hit_index];
 }
 
 size_t InMemoryInvertedIndexBase::Postings::term_length(
@@ -41,64 +268,462 @@ size_t InMemoryInvertedIndexBase::Postings::term_length(
 
 bool InMemoryInvertedIndexBase::Postings::is_term_position(
     size_t index, size_t term_pos) const {
-  const auto &positions = find_positions_map(index)->second;
-  return std::binary_search(positions.begin(), positions.end(), term_pos);
+  assert(index < size());
+  size_t offset;
+  const auto &block = find_block(index, true, offset);
+  auto beg = block.positions.begin() + block.positions_begin(offset);
+  auto end = block.positions.begin() + block.positions_end(offset);
+  return std::binary_search(beg, end, term_pos);
+}
+
+std::unique_ptr<IPostingsCursor>
+InMemoryInvertedIndexBase::Postings::cursor() const {
+  return std::make_unique<BlockCursor<Postings>>(*this);
 }
 
 void InMemoryInvertedIndexBase::Postings::add_term_position(size_t document_id,
                                                             size_t term_pos) {
-  return positions_map_[document_id].push_back(term_pos);
+  assert(term_pos <= std::numeric_limits<uint32_t>::max());
+  auto pos = static_cast<uint32_t>(term_pos);
+
+  // Fast path: documents are usually indexed in ascending order, and a
+  // tokenizer emits term positions in ascending order.
+  if (!tail_.document_ids.empty() && tail_.document_ids.back() == document_id) {
+    tail_.positions.push_back(pos);
+    return;
+  }
+
+  document_set_.clear();
+
+  if (tail_.document_ids.empty() && !blocks_.empty() &&
+      blocks_.back().document_count < block_size) {
+    reopen_blocks(blocks_.size() - 1);
+  }
+
+  auto last_document_id =
+      !tail_.document_ids.empty()
+          ? tail_.document_ids.back()
+          : (!blocks_.empty() ? blocks_.back().last_document_id : 0);
+
+  if (size() == 0 || last_document_id < document_id) {
+    if (tail_.size() >= block_size) {
+      flush_tail(tail_.size() - tail_.size() % block_size);
+    }
+    tail_.document_ids.push_back(document_id);
+    tail_.position_offsets.push_back(tail_.positions.size());
+    tail_.positions.push_back(pos);
+    return;
+  }
+
+  // Slow path: a document was indexed out of order. Move the blocks from the
+  // one which should contain the document back into `tail_`, and insert the
+  // entry there. They are encoded again once documents come in order.
+  if (tail_.document_ids.empty() || document_id < tail_.document_ids.front()) {
+    reopen_blocks(skip_blocks(0, document_id));
+  }
+
+  auto &ids = tail_.document_ids;
+  auto it = std::lower_bound(ids.begin(), ids.end(), document_id);
+  auto offset = static_cast<size_t>(std::distance(ids.begin(), it));
+
+  size_t i;
+  if (it != ids.end() && *it == document_id) {
+    auto beg = tail_.positions.begin() + tail_.positions_begin(offset);
+    auto end = tail_.positions.begin() + tail_.positions_end(offset);
+    i = std::distance(tail_.positions.begin(), std::upper_bound(beg, end, pos));
+  } else {
+    i = offset < ids.size() ? tail_.position_offsets[offset]
+                            : tail_.positions.size();
+    ids.insert(it, document_id);
+    tail_.position_offsets.insert(tail_.position_offsets.begin() + offset, i);
+  }
+
+  tail_.positions.insert(tail_.positions.begin() + i, pos);
+  for (auto j = offset + 1; j < tail_.position_offsets.size(); j++) {
+    tail_.position_offsets[j]++;
+  }
 }
 
-InMemoryInvertedIndexBase::Postings::PositionsMap::const_iterator
-InMemoryInvertedIndexBase::Postings::find_positions_map(size_t index) const {
-  assert(index < positions_map_.size());
-  // TODO: performance improvement with caching the last access value
-  auto it = positions_map_.begin();
-  std::advance(it, index);
-  return it;
+void InMemoryInvertedIndexBase::Postings::add_term_positions(
+    size_t document_id, const uint32_t *positions, size_t count) {
+  if (count == 0) {
+    return;
+  }
+
+  // When the document is new to the postings, the rest of the positions go
+  // right after the first one
+  add_term_position(document_id, positions[0]);
+  if (tail_.document_ids.back() == document_id &&
+      tail_.position_offsets.back() + 1 == tail_.positions.size()) {
+    tail_.positions.insert(tail_.positions.end(), positions + 1,
+                           positions + count);
+    return;
+  }
+
+  for (size_t i = 1; i < count; i++) {
+    add_term_position(document_id, positions[i]);
+  }
 }
 
-//-----------------------------------------------------------------------------
+void InMemoryInvertedIndexBase::Postings::flush() {
+  flush_tail(tail_.size());
+
+  if (size() < document_set_threshold || !document_set_.empty()) {
+    return;
+  }
+
+  auto cur = cursor();
+  while (!cur->is_end()) {
+    document_set_.add(cur->document_id());
+    cur->next();
+  }
+  document_set_.optimize();
+
+  // Sparse terms are scanned and probed as they are
+  if (!document_set_.has_dense_containers()) {
+    document_set_.clear();
+  }
+}
+
+const DocumentSet *InMemoryInvertedIndexBase::Postings::document_set() const {
+  return document_set_.empty() ? nullptr : &document_set_;
+}
+
+size_t InMemoryInvertedIndexBase::Postings::storage_size() const {
+  auto size = blocks_.size() * sizeof(Block) + data_.size() +
+              tail_.document_ids.size() * sizeof(size_t) +
+              (tail_.position_offsets.size() + tail_.positions.size()) *
+                  sizeof(uint32_t);
+  for (const auto &entries : skip_levels_) {
+    size += entries.size() * sizeof(size_t);
+  }
+  return size;
+}
+
+size_t InMemoryInvertedIndexBase::Postings::block_document_count() const {
+  // Only the last block can be partial, and then `tail_` is empty.
+  return blocks_.empty() ? 0
+                         : (blocks_.size() - 1) * block_size +
+                               blocks_.back().document_count;
+}
+
+const InMemoryInvertedIndexBase::Postings::DecodedBlock &
+InMemoryInvertedIndexBase::Postings::find_block(size_t index,
+                                                bool with_positions,
+                                                size_t &offset) const {
+  auto block_index = std::min(index / block_size, blocks_.size());
+  offset = index - block_index * block_size;
+  return decode_cached_block(*this, stamp_, block_index, with_positions);
+}
+
+size_t InMemoryInvertedIndexBase::Postings::block_count() const {
+  return blocks_.size();
+}
+
+uint64_t InMemoryInvertedIndexBase::Postings::block_last_document_id(
+    size_t block) const {
+  return blocks_[block].last_document_id;
+}
+
+const InMemoryInvertedIndexBase::Postings::DecodedBlock &
+InMemoryInvertedIndexBase::Postings::decode_block(size_t block_index,
+                                                  DecodedBlock &decoded,
+                                                  bool with_positions) const {
+  if (block_index == blocks_.size()) {
+    return tail_;
+  }
+  return decode_postings_block(blocks_[block_index], data_.data(), decoded,
+                               with_positions);
+}
+
+void InMemoryInvertedIndexBase::Postings::flush_tail(size_t count) {
+  if (count == 0) {
+    return;
+  }
+
+  for (size_t beg = 0; beg < count; beg += block_size) {
+    encode_block(beg, std::min(beg + block_size, count));
+  }
+
+  // Remove the encoded documents from `tail_`
+  auto position_count = tail_.positions_end(count - 1);
+  tail_.document_ids.erase(tail_.document_ids.begin(),
+                           tail_.document_ids.begin() + count);
+  tail_.position_offsets.erase(tail_.position_offsets.begin(),
+                               tail_.position_offsets.begin() + count);
+  tail_.positions.erase(tail_.positions.begin(),
+                        tail_.positions.begin() + position_count);
+  for (auto &offset : tail_.position_offsets) {
+    offset -= static_cast<uint32_t>(position_count);
+  }
+}
+
+void InMemoryInvertedIndexBase::Postings::encode_block(size_t beg,
+                                                       size_t end) {
+  const auto &ids = tail_.document_ids;
+  auto count = end - beg;
+  auto positions_beg = tail_.positions_begin(beg);
+  auto positions_end = tail_.positions_end(end - 1);
+  auto position_count = positions_end - positions_beg;
+
+  Block block;
+  block.first_document_id = ids[beg];
+  block.last_document_id = ids[end - 1];
+  block.data_offset = data_.size();
+  block.position_count = static_cast<uint32_t>(position_count);
+  block.document_count = static_cast<uint16_t>(count);
+  block.flags = 0;
+
+  if (block.last_document_id - block.first_document_id >
+      std::numeric_limits<uint32_t>::max()) {
+    block.flags |= WideDocumentIds;
+  }
+
+  data_.resize(data_.size() + count * sizeof(uint64_t) +
+               svb_max_encoded_size(count) +
+               svb_max_encoded_size(position_count));
+  auto p = data_.data() + block.data_offset;
+
+  uint32_t values[block_size];
 
-size_t find_postings_index_for_document_id_(const IPostings &p,
-                                            size_t document_id) {
-  // TODO: use binary search and cache...
-  for (size_t i = 0; i < p.size(); i++) {
-    if (p.document_id(i) == document_id) {
-      return i;
+  if (block.flags & WideDocumentIds) {
+    for (auto i = beg; i < end; i++) {
+      uint64_t val = ids[i];
+      std::memcpy(p, &val, sizeof(val));
+      p += sizeof(val);
     }
+  } else {
+    values[0] = 0;
+    for (size_t i = 1; i < count; i++) {
+      values[i] = static_cast<uint32_t>(ids[beg + i] - ids[beg + i - 1]);
+    }
+    p += svb_encode(values, count, p);
+  }
+
+  // Frequencies are stored minus one, and positions are delta coded within
+  // each document.
+  for (size_t i = 0; i < count; i++) {
+    values[i] = static_cast<uint32_t>(tail_.positions_end(beg + i) -
+                                      tail_.positions_begin(beg + i) - 1);
   }
-  return p.size();
+  p += svb_encode(values, count, p);
+
+  std::vector<uint32_t> deltas(tail_.positions.begin() + positions_beg,
+                               tail_.positions.begin() + positions_end);
+  for (auto i = beg; i < end; i++) {
+    auto first = tail_.positions_begin(i) - positions_beg;
+    for (auto j = tail_.positions_end(i) - positions_beg - 1; j > first; j--) {
+      deltas[j] -= deltas[j - 1];
+    }
+  }
+  p += svb_encode(deltas.data(), deltas.size(), p);
+
+  data_.resize(p - data_.data());
+  blocks_.push_back(block);
+
+  add_skip_entries();
+}
+
+void InMemoryInvertedIndexBase::Postings::reopen_blocks(size_t first_block) {
+  if (first_block == blocks_.size()) {
+    return;
+  }
+
+  DecodedBlock decoded;
+  DecodedBlock reopened;
+  for (auto i = first_block; i < blocks_.size(); i++) {
+    decode_block(i, decoded, true);
+    auto offset = static_cast<uint32_t>(reopened.positions.size());
+    for (auto position_offset : decoded.position_offsets) {
+      reopened.position_offsets.push_back(offset + position_offset);
+    }
+    reopened.document_ids.insert(reopened.document_ids.end(),
+                                 decoded.document_ids.begin(),
+                                 decoded.document_ids.end());
+    reopened.positions.insert(reopened.positions.end(),
+                              decoded.positions.begin(),
+                              decoded.positions.end());
+  }
+
+  auto offset = static_cast<uint32_t>(reopened.positions.size());
+  for (auto position_offset : tail_.position_offsets) {
+    reopened.position_offsets.push_back(offset + position_offset);
+  }
+  reopened.document_ids.insert(reopened.document_ids.end(),
+                               tail_.document_ids.begin(),
+                               tail_.document_ids.end());
+  reopened.positions.insert(reopened.positions.end(), tail_.positions.begin(),
+                            tail_.positions.end());
+
+  tail_ = std::move(reopened);
+  data_.resize(blocks_[first_block].data_offset);
+  blocks_.resize(first_block);
+  // Blocks from `first_block` on will be encoded again with other documents
+  stamp_ = new_stamp();
+  rebuild_skip_levels();
+}
+
+size_t InMemoryInvertedIndexBase::Postings::skip_blocks(
+    size_t block_index, size_t document_id) const {
+  // Walk down from the top level. A run whose last document id is less than
+  // `document_id` is skipped as a whole, so at most `skip_interval` entries
+  // are visited on each level.
+  for (auto level = skip_levels_.size(); level-- > 0;) {
+    const auto &entries = skip_levels_[level];
+    size_t run_size = skip_interval;
+    for (size_t i = 0; i < level; i++) {
+      run_size *= skip_interval;
+    }
+
+    auto run = block_index / run_size;
+    while (run < entries.size() && entries[run] < document_id) {
+      run++;
+    }
+    block_index = std::max(block_index, run * run_size);
+  }
+
+  while (block_index < blocks_.size() &&
+         blocks_[block_index].last_document_id < document_id) {
+    block_index++;
+  }
+  return block_index;
+}
+
+void InMemoryInvertedIndexBase::Postings::rebuild_skip_levels() {
+  skip_levels_.clear();
+  size_t run_size = skip_interval;
+  while (run_size <= blocks_.size()) {
+    auto &entries = skip_levels_.emplace_back();
+    for (auto i = run_size; i <= blocks_.size(); i += run_size) {
+      entries.push_back(blocks_[i - 1].last_document_id);
+    }
+    run_size *= skip_interval;
+  }
+}
+
+void InMemoryInvertedIndexBase::Postings::add_skip_entries() {
+  auto count = blocks_.size();
+  size_t level = 0;
+  while (count % skip_interval == 0) {
+    if (level == skip_levels_.size()) {
+      skip_levels_.emplace_back();
+    }
+    skip_levels_[level].push_back(blocks_.back().last_document_id);
+    count /= skip_interval;
+    level++;
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+static size_t search_hit_count_for_document_id(const IPostings &p,
+                                               size_t document_id) {
+  auto cursor = p.cursor();
+  cursor->advance_to(document_id);
+  if (!cursor->is_end() && cursor->document_id() == document_id) {
+    return cursor->freq();
+  }
+  return 0;
 }
 
+InMemoryInvertedIndexBase::InMemoryInvertedIndexBase(
+    std::pmr::memory_resource *memory_resource)
+    : arena_(memory_resource
+                 ? nullptr
+                 : std::make_unique<std::pmr::monotonic_buffer_resource>()),
+      memory_resource_(memory_resource ? memory_resource : arena_.get()),
+      internal_document_ids_(memory_resource_),
+      term_dictionary_(memory_resource_) {}
+
 size_t InMemoryInvertedIndexBase::document_count() const {
-  return documents_.size();
+  return external_document_ids_.size();
+}
+
+size_t
+InMemoryInvertedIndexBase::external_document_id(size_t document_id) const {
+  return external_document_ids_.at(document_id);
+}
+
+std::optional<size_t> InMemoryInvertedIndexBase::internal_document_id(
+    size_t external_document_id) const {
+  auto it = internal_document_ids_.find(external_document_id);
+  if (it == internal_document_ids_.end()) {
+    return std::nullopt;
+  }
+  return it->second;
 }
 
 size_t
 InMemoryInvertedIndexBase::document_term_count(size_t document_id) const {
-  return documents_.at(document_id).term_count;
+  return document_term_counts_.at(document_id);
 }
 
 double InMemoryInvertedIndexBase::average_document_term_count() const {
-  auto buffs = std::vector<std::pair<size_t, size_t>>{{0.0, 0}};
-  for (const auto &[_, document] : documents_) {
-    if (document.term_count <
-        std::numeric_limits<size_t>::max() - buffs.back().first) {
-      buffs.back().first += document.term_count;
-      buffs.back().second += 1;
-    } else {
-      buffs.emplace_back(std::pair(document.term_count, 1));
-    }
+  auto count = live_document_count();
+  if (count == 0) {
+    return 0.0;
   }
+  return static_cast<double>(total_term_count_) / static_cast<double>(count);
+}
+
+const LiveDocuments *InMemoryInvertedIndexBase::live_documents() const {
+  return live_documents_.deleted_count() > 0 ? &live_documents_ : nullptr;
+}
+
+size_t InMemoryInvertedIndexBase::add_document(size_t external_document_id) {
+  assert(external_document_ids_.size() < std::numeric_limits<uint32_t>::max());
+  auto document_id = static_cast<uint32_t>(external_document_ids_.size());
+  auto [it, inserted] =
+      internal_document_ids_.try_emplace(external_document_id, document_id);
+  if (!inserted) {
+    remove_document(it->second);
+    it->second = document_id;
+  }
+  external_document_ids_.push_back(external_document_id);
+  document_term_counts_.push_back(0);
+  live_documents_.resize(external_document_ids_.size());
+  return document_id;
+}
 
-  double avg = 0.0;
-  for (const auto [term_count, document_count] : buffs) {
-    avg +=
-        static_cast<double>(term_count) / static_cast<double>(document_count);
+bool InMemoryInvertedIndexBase::delete_document(size_t external_document_id) {
+  auto it = internal_document_ids_.find(external_document_id);
+  if (it == internal_document_ids_.end()) {
+    return false;
   }
-  return avg;
+  remove_document(it->second);
+  internal_document_ids_.erase(it);
+  return true;
+}
+
+void InMemoryInvertedIndexBase::remove_document(size_t document_id) {
+  live_documents_.remove(document_id);
+  total_term_count_ -= document_term_counts_[document_id];
+}
+
+void InMemoryInvertedIndexBase::set_document_term_count(size_t document_id,
+                                                        size_t term_count) {
+  total_term_count_ += term_count;
+  document_term_counts_[document_id] = term_count;
+}
+
+size_t InMemoryInvertedIndexBase::total_term_count() const {
+  return total_term_count_;
+}
+
+size_t InMemoryInvertedIndexBase::add_term(std::u32string_view str) {
+  auto it = term_dictionary_.find(str);
+  if (it != term_dictionary_.end()) {
+    return it->second;
+  }
+
+  std::pmr::polymorphic_allocator<char32_t> allocator(memory_resource_);
+  auto chars = allocator.allocate(str.size());
+  std::copy(str.begin(), str.end(), chars);
+
+  auto term_id = terms_.size();
+  term_dictionary_.emplace(std::u32string_view(chars, str.size()), term_id);
+  terms_.push_back({0, Postings(memory_resource_)});
+  return term_id;
 }
 
 bool InMemoryInvertedIndexBase::term_exists(const std::u32string &str) const {
@@ -106,38 +731,78 @@ bool InMemoryInvertedIndexBase::term_exists(const std::u32string &str) const {
 }
 
 size_t InMemoryInvertedIndexBase::term_count(const std::u32string &str) const {
-  return term_dictionary_.at(str).term_count;
+  return term_count(term_dictionary_.at(str));
 }
 
 size_t InMemoryInvertedIndexBase::term_count(const std::u32string &str,
                                              size_t document_id) const {
-  const auto &p = postings(str);
-  auto i = find_postings_index_for_document_id_(p, document_id);
-  if (i < p.size()) {
-    return p.search_hit_count(i);
-  }
-  return 0;
+  return term_count(term_dictionary_.at(str), document_id);
 }
 
 size_t InMemoryInvertedIndexBase::df(const std::u32string &str) const {
-  return postings(str).size();
+  return df(term_dictionary_.at(str));
 }
 
 double InMemoryInvertedIndexBase::tf(const std::u32string &str,
                                      size_t document_id) const {
-  const auto &p = postings(str);
-  auto i = find_postings_index_for_document_id_(p, document_id);
-  if (i < p.size()) {
-    return static_cast<double>(p.search_hit_count(i)) /
+  return tf(term_dictionary_.at(str), document_id);
+}
+
+const IPostings &
+InMemoryInvertedIndexBase::postings(const std::u32string &str) const {
+  return postings(term_dictionary_.at(str));
+}
+
+const DocumentSet *
+InMemoryInvertedIndexBase::document_set(const std::u32string &str) const {
+  return document_set(term_dictionary_.at(str));
+}
+
+std::optional<size_t>
+InMemoryInvertedIndexBase::term_id(const std::u32string &str) const {
+  auto it = term_dictionary_.find(str);
+  if (it == term_dictionary_.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+size_t InMemoryInvertedIndexBase::term_count(size_t term_id) const {
+  const auto &term = terms_.at(term_id);
+  return live_term_count(term.postings, term.term_count, live_documents());
+}
+
+size_t InMemoryInvertedIndexBase::term_count(size_t term_id,
+                                             size_t document_id) const {
+  return search_hit_count_for_document_id(postings(term_id), document_id);
+}
+
+size_t InMemoryInvertedIndexBase::df(size_t term_id) const {
+  return live_document_frequency(postings(term_id), live_documents());
+}
+
+double InMemoryInvertedIndexBase::tf(size_t term_id, size_t document_id) const {
+  auto count = search_hit_count_for_document_id(postings(term_id), document_id);
+  if (count > 0) {
+    return static_cast<double>(count) /
            static_cast<double>(document_term_count(document_id));
   }
   return 0.0;
 }
 
-const IPostings &
-InMemoryInvertedIndexBase::postings(const std::u32string &str) const {
-  return term_dictionary_.at(str).postings;
+const IPostings &InMemoryInvertedIndexBase::postings(size_t term_id) const {
+  return terms_.at(term_id).postings;
 }
 
-} // namespace searchlib
+const DocumentSet *
+InMemoryInvertedIndexBase::document_set(size_t term_id) const {
+  return terms_.at(term_id).postings.document_set();
+}
+
+void InMemoryInvertedIndexBase::flush() {
+  for (auto &term : terms_) {
+    term.postings.flush();
+  }
+}
 
+} // namespace searchlib
@@ -0,0 +1,167 @@
+//
+//  postings.h
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#pragma once
+
+#include "searchlib.h"
+#include "utils.h"
+
+namespace searchlib {
+
+using PostingsBlock = InMemoryInvertedIndexBase::Postings::Block;
+using DecodedPostingsBlock = InMemoryInvertedIndexBase::Postings::DecodedBlock;
+
+// Decodes a block whose data starts at `data + block.data_offset`.
+const DecodedPostingsBlock &decode_postings_block(const PostingsBlock &block,
+                                                  const uint8_t *data,
+                                                  DecodedPostingsBlock &decoded,
+                                                  bool with_positions);
+
+// Tells whether a block read from untrusted data, such as an index image,
+// can be decoded safely: its data lies within the `data_size` bytes at
+// `data`, and it holds document ids below `document_count` in ascending
+// order.
+bool check_postings_block(const PostingsBlock &block, const uint8_t *data,
+                          size_t data_size, size_t document_count);
+
+// The documents in `postings` which aren't deleted, and the occurrences of
+// the term in them. Deleted documents keep their postings until they are
+// purged, so these are counted through `live_documents`, where nullptr means
+// that no document is deleted.
+size_t live_document_frequency(const IPostings &postings,
+                               const LiveDocuments *live_documents);
+size_t live_term_count(const IPostings &postings, size_t term_count,
+                       const LiveDocuments *live_documents);
+
+// Returns a stamp which no other postings list has been given. It identifies
+// the blocks of one postings list in `decode_cached_block`, and has to be
+// renewed whenever encoded blocks change.
+uint64_t new_postings_stamp();
+
+// Decodes a block like `source.decode_block`, but keeps the last few decoded
+// blocks of the calling thread keyed by `stamp` and block, so that walking
+// postings by index decodes each block once rather than on every call. The
+// block at `block_count()` isn't cached, as it may still grow.
+template <typename Source>
+const DecodedPostingsBlock &decode_cached_block(const Source &source,
+                                                uint64_t stamp, size_t block,
+                                                bool with_positions) {
+  if (block == source.block_count()) {
+    thread_local DecodedPostingsBlock tail;
+    return source.decode_block(block, tail, with_positions);
+  }
+
+  struct Entry {
+    uint64_t stamp = 0;
+    size_t block = 0;
+    bool with_positions = false;
+    DecodedPostingsBlock decoded;
+  };
+  // A few entries keep alternating access to several terms cheap.
+  constexpr size_t entry_count = 4;
+  thread_local Entry entries[entry_count];
+  thread_local size_t next_victim = 0;
+
+  for (auto &entry : entries) {
+    if (entry.stamp == stamp && entry.block == block) {
+      if (with_positions && !entry.with_positions) {
+        source.decode_block(block, entry.decoded, true);
+        entry.with_positions = true;
+      }
+      return entry.decoded;
+    }
+  }
+
+  auto &entry = entries[next_victim];
+  next_victim = (next_victim + 1) % entry_count;
+  entry.stamp = stamp;
+  entry.block = block;
+  entry.with_positions = with_positions;
+  return source.decode_block(block, entry.decoded, with_positions);
+}
+
+// A cursor over postings stored in blocks. `Source` provides `block_count`,
+// `block_last_document_id`, `skip_blocks` and `decode_block`, where the
+// block at `block_count()` holds whatever isn't encoded yet and may be empty.
+template <typename Source> class BlockCursor : public IPostingsCursor {
+public:
+  explicit BlockCursor(const Source &source) : source_(source) {
+    load_block(0);
+  }
+
+  bool is_end() const override { return offset_ == block_->size(); }
+
+  void next() override {
+    offset_++;
+    if (offset_ == block_->size() && block_index_ < source_.block_count()) {
+      load_block(block_index_ + 1);
+    }
+  }
+
+  void advance_to(size_t document_id) override {
+    if (is_end()) {
+      return;
+    }
+
+    if (block_index_ < source_.block_count() &&
+        source_.block_last_document_id(block_index_) < document_id) {
+      load_block(source_.skip_blocks(block_index_ + 1, document_id));
+    }
+
+    const auto &ids = block_->document_ids;
+    auto it = gallop_lower_bound(ids.begin() + offset_, ids.end(), document_id);
+    offset_ = std::distance(ids.begin(), it);
+  }
+
+  size_t document_id() const override {
+    return block_->document_ids[offset_];
+  }
+
+  size_t freq() const override {
+    load_positions();
+    return block_->positions_end(offset_) - block_->positions_begin(offset_);
+  }
+
+  size_t term_position(size_t search_hit_index) const override {
+    load_positions();
+    return block_->positions[block_->positions_begin(offset_) +
+                             search_hit_index];
+  }
+
+  size_t term_length(size_t) const override { return 1; }
+
+  bool is_term_position(size_t term_pos) const override {
+    load_positions();
+    auto beg = block_->positions.begin() + block_->positions_begin(offset_);
+    auto end = block_->positions.begin() + block_->positions_end(offset_);
+    return std::binary_search(beg, end, term_pos);
+  }
+
+private:
+  void load_block(size_t block_index) {
+    block_index_ = block_index;
+    offset_ = 0;
+    block_ = &source_.decode_block(block_index, decoded_, false);
+    positions_loaded_ = block_index == source_.block_count();
+  }
+
+  void load_positions() const {
+    if (!positions_loaded_) {
+      source_.decode_block(block_index_, decoded_, true);
+      positions_loaded_ = true;
+    }
+  }
+
+  const Source &source_;
+  size_t block_index_ = 0;
+  size_t offset_ = 0;
+  const DecodedPostingsBlock *block_ = nullptr;
+  mutable DecodedPostingsBlock decoded_;
+  mutable bool positions_loaded_ = false;
+};
+
+} // namespace searchlib
@@ -14,7 +14,9 @@ namespace searchlib {
 std::optional<Expression> parse_query(const IInvertedIndex &inverted_index,
                                       Normalizer normalizer,
                                       std::string_view query) {
-  static peg::parser parser(R"(
+  // Actions capture the arguments of each call, so every thread gets its
+  // own parser.
+  static thread_local peg::parser parser(R"(
     ROOT        <- OR?
     OR          <- AND ('|' AND)*
     AND         <- NEAR+
@@ -40,7 +42,7 @@ std::optional<Expression> parse_query(const IInvertedIndex &inverted_index,
       if (vs.size() == 1) {
         return std::any_cast<Expression>(vs[0]);
       }
-      return Expression{operation, std::u32string(), DEFAULT_NEAR_SIZE,
+      return Expression{operation, std::u32string(), 0, DEFAULT_NEAR_SIZE,
                         vs.transform<Expression>()};
     };
   };
@@ -52,12 +54,13 @@ std::optional<Expression> parse_query(const IInvertedIndex &inverted_index,
   parser["TERM"] = [&](const peg::SemanticValues &vs) {
     auto term = normalizer(u32(vs.token()));
 
-    if (!inverted_index.term_exists(term)) {
+    auto term_id = inverted_index.term_id(term);
+    if (!term_id) {
       std::string msg = "invalid term '" + vs.token_to_string() + "'.";
       throw peg::parse_error(msg.c_str());
     }
 
-    return Expression{Operation::Term, term};
+    return Expression{Operation::Term, term, *term_id};
   };
 
   // parser.log = [](size_t line, size_t col, const std::string& msg) {
@@ -0,0 +1,1153 @@
+//
+//  sealedindex.cpp
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "postings.h"
+#include "searchlib.h"
+#include "utils.h"
+
+namespace searchlib {
+
+namespace {
+
+// Index image format, version 1. Integers are stored in the byte order of
+// the host, which is little-endian on all supported platforms.
+//
+//   Header    magic "SLIBIDX\0", version, section count, document count,
+//             term count and total term count, then the offset and size in
+//             bytes of every section
+//   Sections  in the order of `Section`, each starting at a multiple of 8 so
+//             that it can be read in place
+//
+// A term entry holds the term count, the first block and block count of its
+// postings, and the index of its document set if it has one. Blocks are
+// `InMemoryInvertedIndexBase::Postings::Block` with data offsets into
+// `PostingsData`, where the data of a block is encoded as in the in-memory
+// postings. Text ranges are the entries and words of a `TextRangeStore`.
+// Bump `image_version` whenever any of this changes.
+
+constexpr char image_magic[8] = {'S', 'L', 'I', 'B', 'I', 'D', 'X', '\0'};
+constexpr uint32_t image_version = 1;
+
+enum Section : uint32_t {
+  ExternalDocumentIds,    // uint64_t per document
+  SortedDocumentIds,      // uint32_t per document, ordered by external id
+  DocumentTermCounts,     // uint32_t per document
+  DictionaryData,         // front-coded terms
+  DictionaryBlockOffsets, // uint32_t per dictionary block
+  Terms,                  // TermEntry per term
+  Blocks,                 // postings block headers of all terms
+  PostingsData,           // compressed postings of all terms
+  DocumentSetOffsets,     // uint64_t per document set, and the end
+  DocumentSetData,        // serialized document sets
+  TextRangeEntries,       // uint64_t per document
+  TextRangeWords,         // bit-packed text ranges
+  SectionCount,
+};
+
+struct SectionEntry {
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t section_count;
+  uint64_t document_count;
+  uint64_t term_count;
+  uint64_t total_term_count;
+  SectionEntry sections[SectionCount];
+};
+
+constexpr uint32_t no_document_set = std::numeric_limits<uint32_t>::max();
+constexpr size_t no_document = std::numeric_limits<size_t>::max();
+
+class ImageWriter {
+public:
+  ImageWriter() : data_(sizeof(Header), 0) {}
+
+  void add_section(Section section, const void *data, size_t size) {
+    data_.resize((data_.size() + 7) / 8 * 8, 0);
+    header.sections[section] = {data_.size(), size};
+    auto p = static_cast<const uint8_t *>(data);
+    data_.insert(data_.end(), p, p + size);
+  }
+
+  template <typename T>
+  void add_section(Section section, const std::vector<T> &values) {
+    add_section(section, values.data(), values.size() * sizeof(T));
+  }
+
+  std::vector<uint8_t> finish() {
+    std::memcpy(data_.data(), &header, sizeof(header));
+    return std::move(data_);
+  }
+
+  Header header{};
+
+private:
+  std::vector<uint8_t> data_;
+};
+
+} // namespace
+
+using Block = InMemoryInvertedIndexBase::Postings::Block;
+
+struct SealedInvertedIndex::TermEntry {
+  uint64_t term_count;
+  uint64_t first_block;
+  uint32_t block_count;
+  uint32_t document_set;
+};
+
+//-----------------------------------------------------------------------------
+
+class SealedInvertedIndex::Postings : public IPostings {
+public:
+  Postings(const Block *blocks, size_t block_count, const uint8_t *data)
+      : blocks_(blocks), block_count_(block_count), data_(data) {}
+
+  size_t size() const override {
+    // Only the last block can be partial
+    return block_count_ == 0
+               ? 0
+               : (block_count_ - 1) * block_size +
+                     blocks_[block_count_ - 1].document_count;
+  }
+
+  size_t document_id(size_t index) const override {
+    assert(index < size());
+    const auto &block = find_block(index, false);
+    return block.document_ids[index % block_size];
+  }
+
+  size_t search_hit_count(size_t index) const override {
+    assert(index < size());
+    const auto &block = find_block(index, true);
+    auto offset = index % block_size;
+    return block.positions_end(offset) - block.positions_begin(offset);
+  }
+
+  size_t term_position(size_t index, size_t search_hit_index) const override {
+    assert(index < size());
+    const auto &block = find_block(index, true);
+    return block.positions[block.positions_begin(index % block_size) +
+                           search_hit_index];
+  }
+
+  size_t term_length(size_t, size_t) const override { return 1; }
+
+  bool is_term_position(size_t index, size_t term_pos) const override {
+    assert(index < size());
+    const auto &block = find_block(index, true);
+    auto offset = index % block_size;
+    auto beg = block.positions.begin() + block.positions_begin(offset);
+    auto end = block.positions.begin() + block.positions_end(offset);
+    return std::binary_search(beg, end, term_pos);
+  }
+
+  std::unique_ptr<IPostingsCursor> cursor() const override {
+    return std::make_unique<BlockCursor<Postings>>(*this);
+  }
+
+  size_t block_count() const { return block_count_; }
+
+  uint64_t block_last_document_id(size_t block) const {
+    return blocks_[block].last_document_id;
+  }
+
+  // Block headers are contiguous, so there is no need for skip data.
+  size_t skip_blocks(size_t block, size_t document_id) const {
+    auto it = gallop_lower_bound(
+        blocks_ + block, blocks_ + block_count_, document_id,
+        [](const auto &b, auto id) { return b.last_document_id < id; });
+    return std::distance(blocks_, it);
+  }
+
+  const DecodedPostingsBlock &decode_block(size_t block,
+                                           DecodedPostingsBlock &decoded,
+                                           bool with_positions) const {
+    if (block == block_count_) {
+      decoded.clear();
+      return decoded;
+    }
+    return decode_postings_block(blocks_[block], data_, decoded,
+                                 with_positions);
+  }
+
+private:
+  static constexpr size_t block_size =
+      InMemoryInvertedIndexBase::Postings::block_size;
+
+  const DecodedPostingsBlock &find_block(size_t index,
+                                         bool with_positions) const {
+    return decode_cached_block(*this, stamp_, index / block_size,
+                               with_positions);
+  }
+
+  const Block *blocks_;
+  size_t block_count_;
+  const uint8_t *data_;
+  // Blocks never change, so one stamp lasts for the lifetime of the postings
+  uint64_t stamp_ = new_postings_stamp();
+};
+
+// Terms are checked, and their document sets read, the first time they are
+// used. Opening an index then only reads the header and a few offsets, and
+// cold parts of a mapped image aren't paged in at all.
+struct SealedInvertedIndex::TermState {
+  std::optional<Postings> postings;
+  std::optional<DocumentSet> document_set;
+};
+
+[[noreturn]] static void fail(const char *msg) {
+  throw std::runtime_error(std::string("SealedInvertedIndex: ") + msg);
+}
+
+//-----------------------------------------------------------------------------
+
+SealedInvertedIndex::SealedInvertedIndex(
+    std::shared_ptr<const void> owner, const uint8_t *image, size_t image_size,
+    DocumentSource<TextRange> document_source)
+    : owner_(std::move(owner)), image_(image), image_size_(image_size),
+      document_source_(std::move(document_source)) {
+  Header header;
+  if (image_size < sizeof(header)) {
+    fail("image is too small");
+  }
+  std::memcpy(&header, image, sizeof(header));
+  if (std::memcmp(header.magic, image_magic, sizeof(image_magic)) != 0) {
+    fail("not an index image");
+  }
+  if (header.version != image_version) {
+    fail("unsupported image version");
+  }
+  if (header.section_count != SectionCount) {
+    fail("unexpected section count");
+  }
+
+  auto section = [&](Section s, size_t element_size) {
+    const auto &entry = header.sections[s];
+    if (entry.offset % 8 != 0 || entry.offset > image_size ||
+        entry.size > image_size - entry.offset ||
+        entry.size % element_size != 0) {
+      fail("broken section");
+    }
+    return std::make_pair(image + entry.offset, entry.size / element_size);
+  };
+
+  auto expect_count = [&](size_t count, size_t expected) {
+    if (count != expected) {
+      fail("inconsistent section size");
+    }
+  };
+
+  document_count_ = header.document_count;
+  total_term_count_ = header.total_term_count;
+
+  auto [external_ids, external_id_count] =
+      section(ExternalDocumentIds, sizeof(uint64_t));
+  auto [sorted_ids, sorted_id_count] =
+      section(SortedDocumentIds, sizeof(uint32_t));
+  auto [term_counts, term_count_count] =
+      section(DocumentTermCounts, sizeof(uint32_t));
+  expect_count(external_id_count, document_count_);
+  expect_count(sorted_id_count, document_count_);
+  expect_count(term_count_count, document_count_);
+  external_document_ids_ = reinterpret_cast<const uint64_t *>(external_ids);
+  sorted_document_ids_ = reinterpret_cast<const uint32_t *>(sorted_ids);
+  document_term_counts_ = reinterpret_cast<const uint32_t *>(term_counts);
+
+  auto [dictionary_data, dictionary_data_size] = section(DictionaryData, 1);
+  auto [block_offsets, block_offset_count] =
+      section(DictionaryBlockOffsets, sizeof(uint32_t));
+  expect_count(block_offset_count,
+               (header.term_count + TermDictionary::block_size - 1) /
+                   TermDictionary::block_size);
+  // Terms are checked as they are decoded, so only block offsets are here
+  auto dictionary_offsets = reinterpret_cast<const uint32_t *>(block_offsets);
+  for (size_t i = 0; i < block_offset_count; i++) {
+    if (dictionary_offsets[i] >= dictionary_data_size ||
+        (i > 0 && dictionary_offsets[i] <= dictionary_offsets[i - 1])) {
+      fail("broken term dictionary");
+    }
+  }
+  term_dictionary_ =
+      TermDictionary(header.term_count, dictionary_data, dictionary_data_size,
+                     dictionary_offsets, block_offset_count);
+
+  auto [terms, term_entry_count] = section(Terms, sizeof(TermEntry));
+  auto [blocks, block_count] = section(Blocks, sizeof(Block));
+  auto [postings_data, postings_data_size] = section(PostingsData, 1);
+  expect_count(term_entry_count, header.term_count);
+  terms_ = reinterpret_cast<const TermEntry *>(terms);
+  blocks_ = reinterpret_cast<const Block *>(blocks);
+  block_count_ = block_count;
+  postings_data_ = postings_data;
+  postings_data_size_ = postings_data_size;
+
+  auto [set_offsets, set_offset_count] =
+      section(DocumentSetOffsets, sizeof(uint64_t));
+  auto [set_data, set_data_size] = section(DocumentSetData, 1);
+  document_set_offsets_ = reinterpret_cast<const uint64_t *>(set_offsets);
+  document_set_offset_count_ = set_offset_count;
+  document_set_data_ = set_data;
+  document_set_data_size_ = set_data_size;
+
+  term_states_ =
+      std::make_unique<std::atomic<TermState *>[]>(header.term_count);
+
+  auto [entries, entry_count] = section(TextRangeEntries, sizeof(uint64_t));
+  auto [words, word_count] = section(TextRangeWords, sizeof(uint64_t));
+  text_range_store_ =
+      TextRangeStore(reinterpret_cast<const uint64_t *>(entries), entry_count,
+                     reinterpret_cast<const uint64_t *>(words), word_count);
+}
+
+SealedInvertedIndex::~SealedInvertedIndex() {
+  for (size_t i = 0; i < term_dictionary_.size(); i++) {
+    delete term_states_[i].load();
+  }
+}
+
+size_t SealedInvertedIndex::document_count() const { return document_count_; }
+
+size_t SealedInvertedIndex::external_document_id(size_t document_id) const {
+  if (document_id >= document_count_) {
+    throw std::out_of_range("SealedInvertedIndex::external_document_id");
+  }
+  return external_document_ids_[document_id];
+}
+
+std::optional<size_t>
+SealedInvertedIndex::internal_document_id(size_t external_document_id) const {
+  auto beg = sorted_document_ids_;
+  auto end = sorted_document_ids_ + document_count_;
+  auto it = std::lower_bound(beg, end, external_document_id,
+                             [&](auto document_id, auto id) {
+                               if (document_id >= document_count_) {
+                                 fail("broken document id");
+                               }
+                               return external_document_ids_[document_id] < id;
+                             });
+  if (it == end || external_document_ids_[*it] != external_document_id) {
+    return std::nullopt;
+  }
+  return *it;
+}
+
+size_t SealedInvertedIndex::total_term_count() const {
+  return total_term_count_;
+}
+
+size_t SealedInvertedIndex::document_term_count(size_t document_id) const {
+  if (document_id >= document_count_) {
+    throw std::out_of_range("SealedInvertedIndex::document_term_count");
+  }
+  return document_term_counts_[document_id];
+}
+
+double SealedInvertedIndex::average_document_term_count() const {
+  if (document_count_ == 0) {
+    return 0.0;
+  }
+  return static_cast<double>(total_term_count_) /
+         static_cast<double>(document_count_);
+}
+
+bool SealedInvertedIndex::term_exists(const std::u32string &str) const {
+  return term_dictionary_.find(str).has_value();
+}
+
+size_t SealedInvertedIndex::term_count(const std::u32string &str) const {
+  return term_count(checked_term_id(str));
+}
+
+size_t SealedInvertedIndex::term_count(const std::u32string &str,
+                                       size_t document_id) const {
+  return term_count(checked_term_id(str), document_id);
+}
+
+size_t SealedInvertedIndex::df(const std::u32string &str) const {
+  return df(checked_term_id(str));
+}
+
+double SealedInvertedIndex::tf(const std::u32string &str,
+                               size_t document_id) const {
+  return tf(checked_term_id(str), document_id);
+}
+
+const IPostings &
+SealedInvertedIndex::postings(const std::u32string &str) const {
+  return postings(checked_term_id(str));
+}
+
+const DocumentSet *
+SealedInvertedIndex::document_set(const std::u32string &str) const {
+  return document_set(checked_term_id(str));
+}
+
+std::optional<size_t>
+SealedInvertedIndex::term_id(const std::u32string &str) const {
+  return term_dictionary_.find(str);
+}
+
+size_t SealedInvertedIndex::term_count(size_t term_id) const {
+  if (term_id >= term_dictionary_.size()) {
+    throw std::out_of_range("SealedInvertedIndex::term_count");
+  }
+  return terms_[term_id].term_count;
+}
+
+static size_t search_hit_count_for_document_id(const IPostings &p,
+                                               size_t document_id) {
+  auto cursor = p.cursor();
+  cursor->advance_to(document_id);
+  if (!cursor->is_end() && cursor->document_id() == document_id) {
+    return cursor->freq();
+  }
+  return 0;
+}
+
+size_t SealedInvertedIndex::term_count(size_t term_id,
+                                       size_t document_id) const {
+  return search_hit_count_for_document_id(postings(term_id), document_id);
+}
+
+size_t SealedInvertedIndex::df(size_t term_id) const {
+  return postings(term_id).size();
+}
+
+double SealedInvertedIndex::tf(size_t term_id, size_t document_id) const {
+  auto count = search_hit_count_for_document_id(postings(term_id), document_id);
+  if (count > 0) {
+    return static_cast<double>(count) /
+           static_cast<double>(document_term_count(document_id));
+  }
+  return 0.0;
+}
+
+const IPostings &SealedInvertedIndex::postings(size_t term_id) const {
+  if (term_id >= term_dictionary_.size()) {
+    throw std::out_of_range("SealedInvertedIndex::postings");
+  }
+  return *term_state(term_id).postings;
+}
+
+const DocumentSet *SealedInvertedIndex::document_set(size_t term_id) const {
+  if (term_id >= term_dictionary_.size()) {
+    throw std::out_of_range("SealedInvertedIndex::document_set");
+  }
+  const auto &state = term_state(term_id);
+  return state.document_set ? &*state.document_set : nullptr;
+}
+
+TextRange SealedInvertedIndex::text_range(const IPostings &positions,
+                                          size_t index,
+                                          size_t search_hit_index) const {
+  if (document_source_) {
+    auto document_id = positions.document_id(index);
+    return searchlib::text_range(
+        document_source_(external_document_id(document_id)), positions, index,
+        search_hit_index);
+  }
+  return searchlib::text_range(text_range_store_, positions, index,
+                               search_hit_index);
+}
+
+const TermDictionary &SealedInvertedIndex::term_dictionary() const {
+  return term_dictionary_;
+}
+
+const uint8_t *SealedInvertedIndex::image() const { return image_; }
+
+size_t SealedInvertedIndex::image_size() const { return image_size_; }
+
+size_t SealedInvertedIndex::storage_size() const {
+  auto size = image_size_ + term_dictionary_.size() * sizeof(TermState *);
+  for (size_t i = 0; i < term_dictionary_.size(); i++) {
+    if (auto state = term_states_[i].load(std::memory_order_acquire)) {
+      size += sizeof(TermState);
+      if (state->document_set) {
+        size += state->document_set->storage_size();
+      }
+    }
+  }
+  return size;
+}
+
+const SealedInvertedIndex::TermState &
+SealedInvertedIndex::term_state(size_t term_id) const {
+  auto &slot = term_states_[term_id];
+  if (auto state = slot.load(std::memory_order_acquire)) {
+    return *state;
+  }
+
+  const auto &term = terms_[term_id];
+  if (term.first_block > block_count_ ||
+      term.block_count > block_count_ - term.first_block) {
+    fail("broken term entry");
+  }
+  auto blocks = blocks_ + term.first_block;
+  for (size_t i = 0; i < term.block_count; i++) {
+    if (!check_postings_block(blocks[i], postings_data_, postings_data_size_,
+                              document_count_) ||
+        (i > 0 &&
+         blocks[i].first_document_id <= blocks[i - 1].last_document_id)) {
+      fail("broken postings block");
+    }
+  }
+
+  auto state = std::make_unique<TermState>();
+  state->postings.emplace(blocks, term.block_count, postings_data_);
+  if (term.document_set != no_document_set) {
+    auto i = term.document_set;
+    auto offsets = document_set_offsets_;
+    if (i + size_t(1) >= document_set_offset_count_ ||
+        offsets[i] > offsets[i + 1] ||
+        offsets[i + 1] > document_set_data_size_) {
+      fail("broken document set");
+    }
+    state->document_set =
+        DocumentSet::deserialize(document_set_data_ + offsets[i],
+                                 document_set_data_ + offsets[i + 1]);
+  }
+
+  // Another thread may have loaded the term meanwhile
+  TermState *expected = nullptr;
+  if (slot.compare_exchange_strong(expected, state.get(),
+                                   std::memory_order_acq_rel)) {
+    return *state.release();
+  }
+  return *expected;
+}
+
+size_t SealedInvertedIndex::checked_term_id(const std::u32string &str) const {
+  auto term_id = term_dictionary_.find(str);
+  if (!term_id) {
+    throw std::out_of_range("SealedInvertedIndex: unknown term");
+  }
+  return *term_id;
+}
+
+//-----------------------------------------------------------------------------
+
+// Lays out an image from documents and terms given in order.
+class SealedInvertedIndex::ImageBuilder {
+public:
+  void add_document(uint64_t external_document_id, size_t term_count) {
+    assert(term_count <= std::numeric_limits<uint32_t>::max());
+    external_ids_.push_back(external_document_id);
+    term_counts_.push_back(static_cast<uint32_t>(term_count));
+    total_term_count_ += term_count;
+  }
+
+  // Terms must come in ascending order, and their postings must be flushed.
+  void add_term(std::u32string_view str, size_t term_count,
+                const InMemoryInvertedIndexBase::Postings &postings) {
+    assert(postings.tail_.document_ids.empty());
+    strs_.emplace_back(str);
+
+    TermEntry entry{term_count, blocks_.size(),
+                    static_cast<uint32_t>(postings.blocks_.size()),
+                    no_document_set};
+
+    // Block data offsets are rebased onto the data shared by all terms
+    for (auto block : postings.blocks_) {
+      block.data_offset += data_.size();
+      blocks_.push_back(block);
+    }
+    data_.insert(data_.end(), postings.data_.begin(), postings.data_.end());
+
+    if (auto set = postings.document_set()) {
+      entry.document_set = static_cast<uint32_t>(set_offsets_.size());
+      set_offsets_.push_back(set_data_.size());
+      set->serialize(set_data_);
+    }
+
+    terms_.push_back(entry);
+  }
+
+  std::vector<uint8_t> finish(const TextRangeStore &text_range_store) {
+    ImageWriter writer;
+    auto &header = writer.header;
+
+    std::memcpy(header.magic, image_magic, sizeof(image_magic));
+    header.version = image_version;
+    header.section_count = SectionCount;
+    header.document_count = external_ids_.size();
+    header.term_count = terms_.size();
+    header.total_term_count = total_term_count_;
+
+    std::vector<uint32_t> sorted_ids(external_ids_.size());
+    std::iota(sorted_ids.begin(), sorted_ids.end(), 0);
+    std::sort(sorted_ids.begin(), sorted_ids.end(), [&](auto a, auto b) {
+      return external_ids_[a] < external_ids_[b];
+    });
+
+    writer.add_section(ExternalDocumentIds, external_ids_);
+    writer.add_section(SortedDocumentIds, sorted_ids);
+    writer.add_section(DocumentTermCounts, term_counts_);
+
+    // Terms are numbered by their rank in the dictionary
+    TermDictionary term_dictionary(strs_);
+    writer.add_section(DictionaryData, term_dictionary.data(),
+                       term_dictionary.data_size());
+    writer.add_section(DictionaryBlockOffsets,
+                       term_dictionary.block_offsets(),
+                       term_dictionary.block_count() * sizeof(uint32_t));
+
+    set_offsets_.push_back(set_data_.size());
+    writer.add_section(Terms, terms_);
+    writer.add_section(Blocks, blocks_);
+    writer.add_section(PostingsData, data_);
+    writer.add_section(DocumentSetOffsets, set_offsets_);
+    writer.add_section(DocumentSetData, set_data_);
+
+    writer.add_section(TextRangeEntries, text_range_store.entries(),
+                       text_range_store.entry_count() * sizeof(uint64_t));
+    writer.add_section(TextRangeWords, text_range_store.words(),
+                       text_range_store.word_count() * sizeof(uint64_t));
+
+    return writer.finish();
+  }
+
+private:
+  std::vector<uint64_t> external_ids_;
+  std::vector<uint32_t> term_counts_;
+  size_t total_term_count_ = 0;
+
+  std::vector<std::u32string> strs_;
+  std::vector<TermEntry> terms_;
+  std::vector<Block> blocks_;
+  std::vector<uint8_t> data_;
+  std::vector<uint64_t> set_offsets_;
+  std::vector<uint8_t> set_data_;
+};
+
+std::vector<uint8_t> SealedInvertedIndex::build_image(
+    const InMemoryInvertedIndex<TextRange> &invidx) {
+  const auto &base = invidx.base();
+  ImageBuilder builder;
+
+  for (size_t i = 0; i < base.document_count(); i++) {
+    builder.add_document(base.external_document_ids_[i],
+                         base.document_term_counts_[i]);
+  }
+
+  std::vector<std::pair<std::u32string_view, size_t>> sorted_terms(
+      base.term_dictionary_.begin(), base.term_dictionary_.end());
+  std::sort(sorted_terms.begin(), sorted_terms.end());
+
+  for (const auto &[str, term_id] : sorted_terms) {
+    const auto &term = base.terms_[term_id];
+
+    // The uncompressed tail is left only if the index wasn't flushed
+    if (!term.postings.tail_.document_ids.empty()) {
+      auto flushed = term.postings;
+      flushed.flush();
+      builder.add_term(str, term.term_count, flushed);
+    } else {
+      builder.add_term(str, term.term_count, term.postings);
+    }
+  }
+
+  auto image = builder.finish(invidx.text_range_store());
+
+  // Deleted documents are purged by merging the image alone
+  if (auto live_documents = base.live_documents()) {
+    SealedInvertedIndex sealed(nullptr, image.data(), image.size());
+    return merge_images({&sealed}, {live_documents});
+  }
+  return image;
+}
+
+std::vector<uint8_t> SealedInvertedIndex::merge_images(
+    const std::vector<const SealedInvertedIndex *> &segments,
+    const std::vector<const LiveDocuments *> &live_documents) {
+  ImageBuilder builder;
+
+  // Live documents of each segment follow those of the previous one
+  std::vector<std::vector<size_t>> document_ids(segments.size());
+  size_t document_count = 0;
+  for (size_t s = 0; s < segments.size(); s++) {
+    auto live = s < live_documents.size() ? live_documents[s] : nullptr;
+    for (size_t i = 0; i < segments[s]->document_count(); i++) {
+      if (live && !live->contains(i)) {
+        document_ids[s].push_back(no_document);
+        continue;
+      }
+      document_ids[s].push_back(document_count++);
+      builder.add_document(segments[s]->external_document_id(i),
+                           segments[s]->document_term_count(i));
+    }
+  }
+
+  // Text ranges are kept only if every segment keeps them
+  TextRangeStore text_range_store;
+  auto keep_text_ranges =
+      std::all_of(segments.begin(), segments.end(), [](auto segment) {
+        return segment->document_count() == 0 ||
+               segment->text_range_store_.entry_count() > 0;
+      });
+  if (keep_text_ranges) {
+    std::vector<TextRange> text_ranges;
+    for (size_t s = 0; s < segments.size(); s++) {
+      const auto &store = segments[s]->text_range_store_;
+      for (size_t i = 0; i < segments[s]->document_count(); i++) {
+        if (document_ids[s][i] == no_document) {
+          continue;
+        }
+        text_ranges.clear();
+        for (size_t pos = 0; pos < segments[s]->document_term_count(i);
+             pos++) {
+          text_ranges.push_back(store.text_range(i, pos));
+        }
+        text_range_store.add_document(document_ids[s][i], text_ranges);
+      }
+    }
+  }
+
+  // Merge the sorted dictionaries, and encode the postings of each term
+  // again with the new document ids. Terms which only deleted documents had
+  // are dropped.
+  std::vector<std::vector<std::u32string>> strs(segments.size());
+  for (size_t s = 0; s < segments.size(); s++) {
+    segments[s]->term_dictionary_.for_each(
+        [&](auto, const auto &str) { strs[s].push_back(str); });
+  }
+
+  std::vector<size_t> heads(segments.size(), 0);
+  while (true) {
+    const std::u32string *min = nullptr;
+    for (size_t s = 0; s < segments.size(); s++) {
+      if (heads[s] < strs[s].size() && (!min || strs[s][heads[s]] < *min)) {
+        min = &strs[s][heads[s]];
+      }
+    }
+    if (!min) {
+      break;
+    }
+
+    InMemoryInvertedIndexBase::Postings postings;
+    size_t term_count = 0;
+    auto str = *min;
+    for (size_t s = 0; s < segments.size(); s++) {
+      if (heads[s] == strs[s].size() || strs[s][heads[s]] != str) {
+        continue;
+      }
+      auto term_id = heads[s]++;
+      auto cursor = segments[s]->postings(term_id).cursor();
+      for (; !cursor->is_end(); cursor->next()) {
+        auto document_id = document_ids[s][cursor->document_id()];
+        if (document_id == no_document) {
+          continue;
+        }
+        for (size_t i = 0; i < cursor->freq(); i++) {
+          postings.add_term_position(document_id, cursor->term_position(i));
+        }
+        term_count += cursor->freq();
+      }
+    }
+    if (postings.size() > 0) {
+      postings.flush();
+      builder.add_term(str, term_count, postings);
+    }
+  }
+
+  return builder.finish(text_range_store);
+}
+
+// More threads than cores only add switching and memory, so requests are
+// capped at the hardware concurrency when it is known.
+static size_t capped_thread_count(size_t thread_count) {
+  auto hardware_threads = std::thread::hardware_concurrency();
+  if (hardware_threads > 0) {
+    thread_count = std::min<size_t>(thread_count, hardware_threads);
+  }
+  return std::max<size_t>(thread_count, 1);
+}
+
+// Runs `fn` on `thread_count` threads, the calling one included. Every
+// thread is joined before the first exception thrown by `fn` is rethrown on
+// the calling thread. A thread which can't be started runs on the calling
+// thread instead.
+static void run_threads(size_t thread_count,
+                        const std::function<void(size_t thread)> &fn) {
+  std::vector<std::exception_ptr> errors(thread_count);
+  auto run = [&](size_t t) {
+    try {
+      fn(t);
+    } catch (...) {
+      errors[t] = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(thread_count);
+  for (size_t t = 1; t < thread_count; t++) {
+    try {
+      threads.emplace_back(run, t);
+    } catch (const std::system_error &) {
+      run(t);
+    }
+  }
+  run(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  for (const auto &error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+std::vector<uint8_t> SealedInvertedIndex::build_image(
+    const std::vector<const InMemoryInvertedIndex<TextRange> *> &parts,
+    size_t thread_count) {
+  if (parts.size() == 1) {
+    return build_image(*parts[0]);
+  }
+  thread_count = capped_thread_count(thread_count);
+
+  ImageBuilder builder;
+  TextRangeStore text_range_store;
+
+  std::vector<size_t> bases;
+  size_t document_count = 0;
+  std::vector<std::u32string_view> strs;
+  for (auto part : parts) {
+    const auto &base = part->base();
+    assert(!base.live_documents());
+    bases.push_back(document_count);
+    for (size_t i = 0; i < base.document_count(); i++) {
+      builder.add_document(base.external_document_ids_[i],
+                           base.document_term_counts_[i]);
+    }
+    document_count += base.document_count();
+    text_range_store.append(part->text_range_store());
+    for (const auto &[str, term_id] : base.term_dictionary_) {
+      strs.push_back(str);
+    }
+  }
+  std::sort(strs.begin(), strs.end());
+  strs.erase(std::unique(strs.begin(), strs.end()), strs.end());
+
+  // Postings are encoded again with the final document ids. Terms are handed
+  // out a few at a time, since their postings vary widely in size.
+  std::vector<InMemoryInvertedIndexBase::Postings> postings(strs.size());
+  std::vector<size_t> term_counts(strs.size(), 0);
+  std::atomic<size_t> next_term = 0;
+  run_threads(thread_count, [&](size_t) {
+    constexpr size_t range_size = 64;
+    size_t beg;
+    while ((beg = next_term.fetch_add(range_size)) < strs.size()) {
+      auto end = std::min(beg + range_size, strs.size());
+      for (auto i = beg; i < end; i++) {
+        for (size_t p = 0; p < parts.size(); p++) {
+          const auto &base = parts[p]->base();
+          auto it = base.term_dictionary_.find(strs[i]);
+          if (it == base.term_dictionary_.end()) {
+            continue;
+          }
+          const auto &term = base.terms_[it->second];
+          term_counts[i] += term.term_count;
+          auto cursor = term.postings.cursor();
+          for (; !cursor->is_end(); cursor->next()) {
+            auto document_id = bases[p] + cursor->document_id();
+            for (size_t j = 0; j < cursor->freq(); j++) {
+              postings[i].add_term_position(document_id,
+                                            cursor->term_position(j));
+            }
+          }
+        }
+        postings[i].flush();
+      }
+    }
+  });
+
+  for (size_t i = 0; i < strs.size(); i++) {
+    builder.add_term(strs[i], term_counts[i], postings[i]);
+  }
+  return builder.finish(text_range_store);
+}
+
+std::shared_ptr<SealedInvertedIndex>
+seal(const InMemoryInvertedIndex<TextRange> &invidx) {
+  auto image = std::make_shared<std::vector<uint8_t>>(
+      SealedInvertedIndex::build_image(invidx));
+  auto p = image->data();
+  auto size = image->size();
+  return std::make_shared<SealedInvertedIndex>(std::move(image), p, size,
+                                               invidx.document_source());
+}
+
+namespace {
+
+// Keeps the documents given to `make_sealed_index` in order. A document
+// which is indexed again or deleted is marked as such, as the in-memory
+// index would delete it.
+class DocumentCollector : public IIndexer<TextRange> {
+public:
+  struct Document {
+    size_t external_document_id;
+    Tokenizer<TextRange> tokenizer;
+    bool live;
+  };
+
+  void index_document(size_t external_document_id,
+                      Tokenizer<TextRange> tokenizer) override {
+    delete_document(external_document_id);
+    indexes_[external_document_id] = documents.size();
+    documents.push_back({external_document_id, std::move(tokenizer), true});
+  }
+
+  bool delete_document(size_t external_document_id) override {
+    auto it = indexes_.find(external_document_id);
+    if (it == indexes_.end()) {
+      return false;
+    }
+    documents[it->second].live = false;
+    indexes_.erase(it);
+    return true;
+  }
+
+  std::vector<Document> documents;
+
+private:
+  std::unordered_map<size_t /*external_document_id*/, size_t /*index*/>
+      indexes_;
+};
+
+} // namespace
+
+std::shared_ptr<SealedInvertedIndex> make_sealed_index(
+    Normalizer normalizer,
+    std::function<void(IIndexer<TextRange> &indexer)> callback,
+    size_t thread_count) {
+  thread_count = capped_thread_count(thread_count);
+  if (thread_count == 1) {
+    InMemoryInvertedIndex<TextRange> invidx;
+    {
+      InMemoryIndexer indexer(invidx, normalizer);
+      callback(indexer);
+    }
+    return seal(invidx);
+  }
+
+  DocumentCollector collector;
+  callback(collector);
+
+  std::vector<const DocumentCollector::Document *> documents;
+  for (const auto &document : collector.documents) {
+    if (document.live) {
+      documents.push_back(&document);
+    }
+  }
+
+  // Each worker indexes a run of documents into its own index
+  auto part_count =
+      std::max<size_t>(std::min(thread_count, documents.size()), 1);
+  std::vector<InMemoryInvertedIndex<TextRange>> parts(part_count);
+  run_threads(part_count, [&](size_t part) {
+    auto beg = documents.size() * part / part_count;
+    auto end = documents.size() * (part + 1) / part_count;
+    InMemoryIndexer<TextRange> indexer(parts[part], normalizer);
+    for (auto i = beg; i < end; i++) {
+      indexer.index_document(documents[i]->external_document_id,
+                             documents[i]->tokenizer);
+    }
+  });
+
+  std::vector<const InMemoryInvertedIndex<TextRange> *> part_pointers;
+  for (const auto &part : parts) {
+    part_pointers.push_back(&part);
+  }
+  auto image = std::make_shared<std::vector<uint8_t>>(
+      SealedInvertedIndex::build_image(part_pointers, thread_count));
+  auto p = image->data();
+  auto size = image->size();
+  return std::make_shared<SealedInvertedIndex>(std::move(image), p, size);
+}
+
+//-----------------------------------------------------------------------------
+
+// Flushes a file written through `fp` from the OS to the disk.
+static bool sync_file(std::FILE *fp) {
+#ifdef _WIN32
+  return ::_commit(::_fileno(fp)) == 0;
+#else
+  return ::fsync(::fileno(fp)) == 0;
+#endif
+}
+
+// The data goes to a temporary file first, which replaces `path` only once
+// the data is on disk. A crash leaves either the old or the new file.
+static void write_file(const std::string &path, const uint8_t *data,
+                       size_t size) {
+  auto tmp_path = path + ".tmp";
+  auto fp = std::fopen(tmp_path.c_str(), "wb");
+  if (!fp) {
+    throw std::runtime_error("save_index: failed to open " + tmp_path);
+  }
+  auto ok = std::fwrite(data, 1, size, fp) == size && std::fflush(fp) == 0 &&
+            sync_file(fp);
+  if (std::fclose(fp) != 0 || !ok) {
+    std::error_code ec;
+    std::filesystem::remove(tmp_path, ec);
+    throw std::runtime_error("save_index: failed to write " + tmp_path);
+  }
+  std::filesystem::rename(tmp_path, path);
+
+#ifndef _WIN32
+  // The rename itself is made durable by syncing the directory
+  auto dir = std::filesystem::absolute(path).parent_path();
+  auto fd = ::open(dir.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    ::fsync(fd);
+    ::close(fd);
+  }
+#endif
+}
+
+void save_index(const InMemoryInvertedIndex<TextRange> &invidx,
+                const std::string &path) {
+  auto image = SealedInvertedIndex::build_image(invidx);
+  write_file(path, image.data(), image.size());
+}
+
+void save_index(const SealedInvertedIndex &invidx, const std::string &path) {
+  write_file(path, invidx.image(), invidx.image_size());
+}
+
+std::shared_ptr<SealedInvertedIndex>
+load_index(const std::string &path,
+           DocumentSource<TextRange> document_source) {
+  std::ifstream fs(path, std::ios::binary | std::ios::ate);
+  if (!fs) {
+    throw std::runtime_error("load_index: failed to open " + path);
+  }
+  auto size = static_cast<size_t>(fs.tellg());
+  fs.seekg(0);
+
+  auto image = std::make_shared<std::vector<uint8_t>>(size);
+  if (!fs.read(reinterpret_cast<char *>(image->data()), size)) {
+    throw std::runtime_error("load_index: failed to read " + path);
+  }
+
+  auto p = image->data();
+  return std::make_shared<SealedInvertedIndex>(std::move(image), p, size,
+                                               std::move(document_source));
+}
+
+#ifndef _WIN32
+
+namespace {
+
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path) {
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("map_index: failed to open " + path);
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+      size_ = static_cast<size_t>(st.st_size);
+      auto p = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+      if (p != MAP_FAILED) {
+        data_ = static_cast<const uint8_t *>(p);
+      }
+    }
+    ::close(fd);
+
+    if (!data_) {
+      throw std::runtime_error("map_index: failed to map " + path);
+    }
+  }
+
+  ~MappedFile() { ::munmap(const_cast<uint8_t *>(data_), size_); }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  // Hints are only hints, so failures are ignored.
+  void advise(const SectionEntry &section, int advice) const {
+    static const auto page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    if (section.size == 0 || section.offset > size_ ||
+        section.size > size_ - section.offset) {
+      return;
+    }
+    auto beg = section.offset / page_size * page_size;
+    auto end = section.offset + section.size;
+    ::madvise(const_cast<uint8_t *>(data_) + beg, end - beg, advice);
+  }
+
+private:
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+} // namespace
+
+#endif
+
+std::shared_ptr<SealedInvertedIndex>
+map_index(const std::string &path,
+          DocumentSource<TextRange> document_source) {
+#ifdef _WIN32
+  return load_index(path, std::move(document_source));
+#else
+  auto file = std::make_shared<MappedFile>(path);
+  auto p = file->data();
+  auto size = file->size();
+
+  // The dictionary and per-term data are visited by every query, while
+  // postings and text ranges are read in small pieces wherever the hits are.
+  Header header{};
+  std::memcpy(&header, p, std::min(size, sizeof(header)));
+  for (auto section : {ExternalDocumentIds, SortedDocumentIds,
+                       DocumentTermCounts, DictionaryData,
+                       DictionaryBlockOffsets, Terms, Blocks}) {
+    file->advise(header.sections[section], MADV_WILLNEED);
+  }
+  for (auto section : {PostingsData, TextRangeEntries, TextRangeWords}) {
+    file->advise(header.sections[section], MADV_RANDOM);
+  }
+
+  return std::make_shared<SealedInvertedIndex>(file, p, size,
+                                               std::move(document_source));
+#endif
+}
+
+} // namespace searchlib
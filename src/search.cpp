@@ -7,6 +7,7 @@
 
 #include <array>
 #include <cassert>
+#include <cmath>
 #include <iostream>
 #include <numeric>
 
@@ -15,38 +16,121 @@
 
 namespace searchlib {
 
+// A cursor which skips the entries of deleted documents
+class LiveCursor : public IPostingsCursor {
+public:
+  LiveCursor(std::unique_ptr<IPostingsCursor> cursor,
+             const LiveDocuments &live_documents)
+      : cursor_(std::move(cursor)), live_documents_(live_documents) {
+    skip_deleted();
+  }
+
+  bool is_end() const override { return cursor_->is_end(); }
+
+  void next() override {
+    cursor_->next();
+    skip_deleted();
+  }
+
+  void advance_to(size_t document_id) override {
+    cursor_->advance_to(document_id);
+    skip_deleted();
+  }
+
+  size_t document_id() const override { return cursor_->document_id(); }
+
+  size_t freq() const override { return cursor_->freq(); }
+
+  size_t term_position(size_t search_hit_index) const override {
+    return cursor_->term_position(search_hit_index);
+  }
+
+  size_t term_length(size_t search_hit_index) const override {
+    return cursor_->term_length(search_hit_index);
+  }
+
+  bool is_term_position(size_t term_pos) const override {
+    return cursor_->is_term_position(term_pos);
+  }
+
+private:
+  void skip_deleted() {
+    while (!cursor_->is_end() &&
+           !live_documents_.contains(cursor_->document_id())) {
+      cursor_->next();
+    }
+  }
+
+  std::unique_ptr<IPostingsCursor> cursor_;
+  const LiveDocuments &live_documents_;
+};
+
+// The postings of a term without the entries of deleted documents. Deleted
+// documents are skipped here, at the leaves of a query, so that operators
+// and scorers never see them.
 class TermSearchResult : public IPostings {
 public:
-  TermSearchResult(const IInvertedIndex &inverted_index,
-                   const std::u32string &str)
-      : postings_(inverted_index.postings(str)) {}
+  TermSearchResult(const IInvertedIndex &inverted_index, size_t term_id)
+      : postings_(inverted_index.postings(term_id)),
+        live_documents_(inverted_index.live_documents()),
+        size_(live_documents_ ? inverted_index.df(term_id)
+                              : postings_.size()) {}
 
   ~TermSearchResult() override = default;
 
-  size_t size() const override { return postings_.size(); }
+  size_t size() const override { return size_; }
 
   size_t document_id(size_t index) const override {
-    return postings_.document_id(index);
+    return postings_.document_id(entry(index));
   }
 
   size_t search_hit_count(size_t index) const override {
-    return postings_.search_hit_count(index);
+    return postings_.search_hit_count(entry(index));
   }
 
   size_t term_position(size_t index, size_t search_hit_index) const override {
-    return postings_.term_position(index, search_hit_index);
+    return postings_.term_position(entry(index), search_hit_index);
   }
 
-  size_t term_length(size_t index, size_t search_hit_index) const override {
-    return 1;
-  }
+  size_t term_length(size_t, size_t) const override { return 1; }
 
   bool is_term_position(size_t index, size_t term_pos) const override {
-    return postings_.is_term_position(index, term_pos);
+    return postings_.is_term_position(entry(index), term_pos);
+  }
+
+  std::unique_ptr<IPostingsCursor> cursor() const override {
+    if (live_documents_) {
+      return std::make_unique<LiveCursor>(postings_.cursor(),
+                                          *live_documents_);
+    }
+    return postings_.cursor();
   }
 
 private:
+  // The index in `postings_` of the entry at `index`. Operators only use
+  // cursors, so the entries of live documents are listed on first access by
+  // index.
+  size_t entry(size_t index) const {
+    if (!live_documents_) {
+      return index;
+    }
+    std::call_once(entries_listed_, [&] {
+      size_t i = 0;
+      for (auto cursor = postings_.cursor(); !cursor->is_end();
+           cursor->next(), i++) {
+        if (live_documents_->contains(cursor->document_id())) {
+          entries_.push_back(i);
+        }
+      }
+    });
+    return entries_[index];
+  }
+
   const IPostings &postings_;
+  const LiveDocuments *live_documents_;
+  size_t size_;
+  mutable std::once_flag entries_listed_;
+  mutable std::vector<size_t> entries_;
 };
 
 //-----------------------------------------------------------------------------
@@ -109,33 +193,90 @@ public:
     return positions_[index]->is_term_position(term_pos);
   }
 
+  std::unique_ptr<IPostingsCursor> cursor() const override {
+    return std::make_unique<Cursor>(*this);
+  }
+
   void push_back(std::shared_ptr<Position> info) {
     positions_.push_back(std::move(info));
   }
 
 private:
+  class Cursor : public IPostingsCursor {
+  public:
+    explicit Cursor(const SearchResult &result)
+        : positions_(result.positions_) {}
+
+    bool is_end() const override { return index_ == positions_.size(); }
+
+    void next() override { index_++; }
+
+    void advance_to(size_t document_id) override {
+      auto it = gallop_lower_bound(
+          positions_.begin() + index_, positions_.end(), document_id,
+          [](const auto &p, auto id) { return p->document_id() < id; });
+      index_ = std::distance(positions_.begin(), it);
+    }
+
+    size_t document_id() const override {
+      return positions_[index_]->document_id();
+    }
+
+    size_t freq() const override {
+      return positions_[index_]->search_hit_count();
+    }
+
+    size_t term_position(size_t search_hit_index) const override {
+      return positions_[index_]->term_position(search_hit_index);
+    }
+
+    size_t term_length(size_t search_hit_index) const override {
+      return positions_[index_]->term_length(search_hit_index);
+    }
+
+    bool is_term_position(size_t term_pos) const override {
+      return positions_[index_]->is_term_position(term_pos);
+    }
+
+  private:
+    const std::vector<std::shared_ptr<Position>> &positions_;
+    size_t index_ = 0;
+  };
+
   std::vector<std::shared_ptr<Position>> positions_;
 };
 
 //-----------------------------------------------------------------------------
 
+using Cursors = std::vector<std::unique_ptr<IPostingsCursor>>;
+
+static std::shared_ptr<IPostings>
+search_postings(const IInvertedIndex &inverted_index, const Expression &expr);
+
 static auto positings_list(const IInvertedIndex &inverted_index,
                            const std::vector<Expression> &nodes) {
   std::vector<std::shared_ptr<IPostings>> positings_list;
   for (const auto &expr : nodes) {
-    positings_list.push_back(perform_search(inverted_index, expr));
+    positings_list.push_back(search_postings(inverted_index, expr));
   }
   return positings_list;
 }
 
-static std::vector<size_t /*slot*/>
-min_slots(const std::vector<std::shared_ptr<IPostings>> &positings_list,
-          const std::vector<size_t> &cursors) {
+static Cursors
+make_cursors(const std::vector<std::shared_ptr<IPostings>> &positings_list) {
+  Cursors cursors;
+  for (const auto &p : positings_list) {
+    cursors.push_back(p->cursor());
+  }
+  return cursors;
+}
+
+static std::vector<size_t /*slot*/> min_slots(const Cursors &cursors) {
   std::vector<size_t> slots = {0};
 
-  for (size_t slot = 1; slot < positings_list.size(); slot++) {
-    auto prev = positings_list[slots[0]]->document_id(cursors[slots[0]]);
-    auto curr = positings_list[slot]->document_id(cursors[slot]);
+  for (size_t slot = 1; slot < cursors.size(); slot++) {
+    auto prev = cursors[slots[0]]->document_id();
+    auto curr = cursors[slot]->document_id();
 
     if (curr < prev) {
       slots.clear();
@@ -148,77 +289,57 @@ min_slots(const std::vector<std::shared_ptr<IPostings>> &positings_list,
   return slots;
 }
 
-static std::pair<size_t /*min*/, size_t /*max*/>
-min_max_slots(const std::vector<std::shared_ptr<IPostings>> &positings_list,
-              const std::vector<size_t> &cursors) {
-  auto min = positings_list[0]->document_id(cursors[0]);
-  auto max = min;
-
-  for (size_t slot = 1; slot < positings_list.size(); slot++) {
-    auto id = positings_list[slot]->document_id(cursors[slot]);
-    if (id < min) {
-      min = id;
-    } else if (id > max) {
-      max = id;
+// Leapfrog join: every cursor jumps straight to the largest document id seen
+// so far instead of stepping through the entries in between. `order` lists
+// the slots from the shortest postings to the longest one, so that the rarest
+// term drives the intersection.
+static bool leapfrog(Cursors &cursors, const std::vector<size_t> &order) {
+  size_t target = 0;
+  for (const auto &cursor : cursors) {
+    if (cursor->is_end()) {
+      return false;
     }
+    target = std::max(target, cursor->document_id());
   }
 
-  return std::make_pair(min, max);
-}
-
-static bool
-skip_cursors(const std::vector<std::shared_ptr<IPostings>> &positings_list,
-             std::vector<size_t> &cursors, size_t document_id) {
-  for (size_t slot = 0; slot < positings_list.size(); slot++) {
-    // TODO: skip list support
-    while (cursors[slot] < positings_list[slot]->size()) {
-      if (positings_list[slot]->document_id(cursors[slot]) >= document_id) {
-        break;
-      }
-      cursors[slot]++;
+  size_t aligned = 0;
+  size_t i = 0;
+  while (aligned < cursors.size()) {
+    auto &cursor = cursors[order[i]];
+    cursor->advance_to(target);
+    if (cursor->is_end()) {
+      return false;
     }
 
-    if (cursors[slot] == positings_list[slot]->size()) {
-      return true;
+    auto document_id = cursor->document_id();
+    if (document_id == target) {
+      aligned++;
+    } else {
+      target = document_id;
+      aligned = 1;
     }
-  }
-  return false;
-}
 
-static bool increment_all_cursors(
-    const std::vector<std::shared_ptr<IPostings>> &positings_list,
-    std::vector<size_t> &cursors) {
-  for (size_t slot = 0; slot < positings_list.size(); slot++) {
-    cursors[slot]++;
-    if (cursors[slot] == positings_list[slot]->size()) {
-      return true;
-    }
+    i = (i + 1) % order.size();
   }
-  return false;
+  return true;
 }
 
-static void
-increment_cursors(std::vector<std::shared_ptr<IPostings>> &positings_list,
-                  std::vector<size_t> &cursors,
-                  const std::vector<size_t> &slots) {
+static void increment_cursors(Cursors &cursors,
+                              const std::vector<size_t> &slots) {
   for (int i = slots.size() - 1; i >= 0; i--) {
     auto slot = slots[i];
-    cursors[slot]++;
-    if (cursors[slot] == positings_list[slot]->size()) {
+    cursors[slot]->next();
+    if (cursors[slot]->is_end()) {
       cursors.erase(cursors.begin() + slot);
-      positings_list.erase(positings_list.begin() + slot);
     }
   }
 }
 
-static size_t
-shortest_slot(const std::vector<std::shared_ptr<IPostings>> &positings_list,
-              const std::vector<size_t> &cursors) {
+static size_t shortest_slot(const Cursors &cursors) {
   size_t shortest_slot = 0;
-  auto shortest_count =
-      positings_list[shortest_slot]->search_hit_count(cursors[shortest_slot]);
-  for (size_t slot = 1; slot < positings_list.size(); slot++) {
-    auto count = positings_list[slot]->search_hit_count(cursors[slot]);
+  auto shortest_count = cursors[shortest_slot]->freq();
+  for (size_t slot = 1; slot < cursors.size(); slot++) {
+    auto count = cursors[slot]->freq();
     if (count < shortest_count) {
       shortest_slot = slot;
       shortest_count = count;
@@ -227,20 +348,18 @@ shortest_slot(const std::vector<std::shared_ptr<IPostings>> &positings_list,
   return shortest_slot;
 }
 
-static bool
-is_adjacent(const std::vector<std::shared_ptr<IPostings>> &positings_list,
-            const std::vector<size_t> &cursors, size_t target_slot,
-            size_t term_pos) {
+static bool is_adjacent(const Cursors &cursors, size_t target_slot,
+                        size_t term_pos) {
   auto ret = true;
 
-  for (size_t slot = 0; ret && slot < positings_list.size(); slot++) {
+  for (size_t slot = 0; ret && slot < cursors.size(); slot++) {
     if (slot == target_slot) {
       continue;
     }
 
     auto delta = slot - target_slot;
     auto next_term_pos = term_pos + delta;
-    ret = positings_list[slot]->is_term_position(cursors[slot], next_term_pos);
+    ret = cursors[slot]->is_term_position(next_term_pos);
   }
 
   return ret;
@@ -251,45 +370,44 @@ static std::shared_ptr<IPostings> intersect_postings(
     const std::vector<std::shared_ptr<IPostings>> &positings_list,
     T make_positions) {
   auto result = std::make_shared<SearchResult>();
-  std::vector<size_t> cursors(positings_list.size(), 0);
-
-  auto done = false;
-  while (!done) {
-    auto [min, max] = min_max_slots(positings_list, cursors);
-    if (min == max) {
-      auto positions = make_positions(positings_list, cursors);
-      if (positions) {
-        result->push_back(positions);
-      }
-      done = increment_all_cursors(positings_list, cursors);
-    } else {
-      done = skip_cursors(positings_list, cursors, max);
+  auto cursors = make_cursors(positings_list);
+
+  std::vector<size_t> order(positings_list.size(), 0);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](auto a, auto b) {
+    return positings_list[a]->size() < positings_list[b]->size();
+  });
+
+  while (leapfrog(cursors, order)) {
+    auto positions = make_positions(cursors);
+    if (positions) {
+      result->push_back(positions);
     }
+    cursors[order[0]]->next();
   }
 
   return result;
 }
 
-static void merge_term_positions(
-    const std::vector<std::shared_ptr<IPostings>> &positings_list,
-    const std::vector<size_t> &cursors, const std::vector<size_t> &slots,
-    std::vector<size_t> &term_positions, std::vector<size_t> &term_lengths) {
-  std::vector<size_t> search_hit_cursors(positings_list.size(), 0);
+static void merge_term_positions(const Cursors &cursors,
+                                 const std::vector<size_t> &slots,
+                                 std::vector<size_t> &term_positions,
+                                 std::vector<size_t> &term_lengths) {
+  std::vector<size_t> search_hit_cursors(cursors.size(), 0);
 
   while (true) {
-    size_t min_slot = -1;
+    std::optional<size_t> min_slot;
     size_t min_term_pos = -1;
     size_t min_term_length = -1;
 
     // TODO: improve performance by reducing slots
     for (auto slot : slots) {
-      auto index = cursors[slot];
-      auto p = positings_list[slot];
+      const auto &cursor = cursors[slot];
       auto hit_index = search_hit_cursors[slot];
 
-      if (hit_index < p->search_hit_count(index)) {
-        auto term_pos = p->term_position(index, hit_index);
-        auto term_length = p->term_length(index, hit_index);
+      if (hit_index < cursor->freq()) {
+        auto term_pos = cursor->term_position(hit_index);
+        auto term_length = cursor->term_length(hit_index);
 
         if (term_pos < min_term_pos) {
           min_slot = slot;
@@ -299,35 +417,39 @@ static void merge_term_positions(
       }
     }
 
-    if (min_slot == -1) {
+    if (!min_slot) {
       break;
     }
 
     term_positions.push_back(min_term_pos);
     term_lengths.push_back(min_term_length);
-    search_hit_cursors[min_slot]++;
+    search_hit_cursors[*min_slot]++;
   }
 }
 
 static std::shared_ptr<IPostings>
-union_postings(std::vector<std::shared_ptr<IPostings>> &&positings_list) {
+union_postings(const std::vector<std::shared_ptr<IPostings>> &positings_list) {
   auto result = std::make_shared<SearchResult>();
-  std::vector<size_t> cursors(positings_list.size(), 0);
 
-  while (!positings_list.empty()) {
-    auto slots = min_slots(positings_list, cursors);
+  Cursors cursors;
+  for (auto &cursor : make_cursors(positings_list)) {
+    if (!cursor->is_end()) {
+      cursors.push_back(std::move(cursor));
+    }
+  }
+
+  while (!cursors.empty()) {
+    auto slots = min_slots(cursors);
 
     std::vector<size_t> term_positions;
     std::vector<size_t> term_lengths;
-    merge_term_positions(positings_list, cursors, slots, term_positions,
-                         term_lengths);
+    merge_term_positions(cursors, slots, term_positions, term_lengths);
 
     result->push_back(std::make_shared<Position>(
-        positings_list[slots[0]]->document_id(cursors[slots[0]]),
-        std::move(term_positions), std::move(term_lengths)));
+        cursors[slots[0]]->document_id(), std::move(term_positions),
+        std::move(term_lengths)));
 
-    increment_cursors(positings_list, cursors, slots);
-    assert(positings_list.size() == cursors.size());
+    increment_cursors(cursors, slots);
   }
 
   return result;
@@ -338,26 +460,24 @@ union_postings(std::vector<std::shared_ptr<IPostings>> &&positings_list) {
 static std::shared_ptr<IPostings>
 perform_term_operation(const IInvertedIndex &inverted_index,
                        const Expression &expr) {
-  return std::make_shared<TermSearchResult>(inverted_index, expr.term_str);
+  return std::make_shared<TermSearchResult>(inverted_index, expr.term_id);
 }
 
 static std::shared_ptr<IPostings>
 perform_and_operation(const IInvertedIndex &inverted_index,
                       const Expression &expr) {
   return intersect_postings(
-      positings_list(inverted_index, expr.nodes),
-      [](const auto &positings_list, const auto &cursors) {
-        std::vector<size_t> slots(positings_list.size(), 0);
+      positings_list(inverted_index, expr.nodes), [](const auto &cursors) {
+        std::vector<size_t> slots(cursors.size(), 0);
         std::iota(slots.begin(), slots.end(), 0);
 
         std::vector<size_t> term_positions;
         std::vector<size_t> term_lengths;
-        merge_term_positions(positings_list, cursors, slots, term_positions,
-                             term_lengths);
+        merge_term_positions(cursors, slots, term_positions, term_lengths);
 
-        return std::make_shared<Position>(
-            positings_list[0]->document_id(cursors[0]),
-            std::move(term_positions), std::move(term_lengths));
+        return std::make_shared<Position>(cursors[0]->document_id(),
+                                          std::move(term_positions),
+                                          std::move(term_lengths));
       });
 }
 
@@ -365,32 +485,30 @@ static std::shared_ptr<IPostings>
 perform_adjacent_operation(const IInvertedIndex &inverted_index,
                            const Expression &expr) {
   return intersect_postings(
-      positings_list(inverted_index, expr.nodes),
-      [](const auto &positings_list, const auto &cursors) {
+      positings_list(inverted_index, expr.nodes), [](const auto &cursors) {
         std::vector<size_t> term_positions;
         std::vector<size_t> term_lengths;
 
-        auto target_slot = shortest_slot(positings_list, cursors);
+        auto target_slot = shortest_slot(cursors);
+        const auto &target = cursors[target_slot];
 
-        auto count =
-            positings_list[target_slot]->search_hit_count(cursors[target_slot]);
+        auto count = target->freq();
 
         for (size_t i = 0; i < count; i++) {
-          auto term_pos = positings_list[target_slot]->term_position(
-              cursors[target_slot], i);
-          if (is_adjacent(positings_list, cursors, target_slot, term_pos)) {
+          auto term_pos = target->term_position(i);
+          if (is_adjacent(cursors, target_slot, term_pos)) {
             auto start_term_pos = term_pos - target_slot;
             term_positions.push_back(start_term_pos);
-            term_lengths.push_back(positings_list.size());
+            term_lengths.push_back(cursors.size());
           }
         }
 
         if (term_positions.empty()) {
           return std::shared_ptr<Position>();
         } else {
-          return std::make_shared<Position>(
-              positings_list[0]->document_id(cursors[0]),
-              std::move(term_positions), std::move(term_lengths));
+          return std::make_shared<Position>(cursors[0]->document_id(),
+                                            std::move(term_positions),
+                                            std::move(term_lengths));
         }
       });
 }
@@ -405,11 +523,10 @@ static std::shared_ptr<IPostings>
 perform_near_operation(const IInvertedIndex &inverted_index,
                        const Expression &expr) {
   return intersect_postings(
-      positings_list(inverted_index, expr.nodes),
-      [&](const auto &positings_list, const auto &cursors) {
+      positings_list(inverted_index, expr.nodes), [&](const auto &cursors) {
         std::vector<size_t> term_positions;
         std::vector<size_t> term_lengths;
-        std::vector<size_t> search_hit_cursors(positings_list.size(), 0);
+        std::vector<size_t> search_hit_cursors(cursors.size(), 0);
 
         auto done = false;
         while (!done) {
@@ -420,11 +537,10 @@ perform_near_operation(const IInvertedIndex &inverted_index,
               slots_by_term_pos;
           {
             auto slot = 0;
-            for (const auto &p : positings_list) {
-              auto index = cursors[slot];
+            for (const auto &cursor : cursors) {
               auto hit_index = search_hit_cursors[slot];
-              auto term_pos = p->term_position(index, hit_index);
-              auto term_length = p->term_length(index, hit_index);
+              auto term_pos = cursor->term_position(hit_index);
+              auto term_length = cursor->term_length(hit_index);
               slots_by_term_pos[term_pos] = std::pair(slot, term_length);
               slot++;
             }
@@ -457,8 +573,7 @@ perform_near_operation(const IInvertedIndex &inverted_index,
               term_lengths.push_back(term_length);
               search_hit_cursors[slot]++;
 
-              if (search_hit_cursors[slot] ==
-                  positings_list[slot]->search_hit_count(cursors[slot])) {
+              if (search_hit_cursors[slot] == cursors[slot]->freq()) {
                 done = true;
               }
             }
@@ -467,8 +582,7 @@ perform_near_operation(const IInvertedIndex &inverted_index,
             auto slot = slots_by_term_pos.begin()->second.first;
             search_hit_cursors[slot]++;
 
-            if (search_hit_cursors[slot] ==
-                positings_list[slot]->search_hit_count(cursors[slot])) {
+            if (search_hit_cursors[slot] == cursors[slot]->freq()) {
               done = true;
             }
           }
@@ -477,17 +591,19 @@ perform_near_operation(const IInvertedIndex &inverted_index,
         if (term_positions.empty()) {
           return std::shared_ptr<Position>();
         } else {
-          return std::make_shared<Position>(
-              positings_list[0]->document_id(cursors[0]),
-              std::move(term_positions), std::move(term_lengths));
+          return std::make_shared<Position>(cursors[0]->document_id(),
+                                            std::move(term_positions),
+                                            std::move(term_lengths));
         }
       });
 }
 
 //-----------------------------------------------------------------------------
 
-std::shared_ptr<IPostings> perform_search(const IInvertedIndex &inverted_index,
-                                          const Expression &expr) {
+// Term results skip deleted documents, and so does every operator built on
+// them.
+static std::shared_ptr<IPostings>
+search_postings(const IInvertedIndex &inverted_index, const Expression &expr) {
   switch (expr.operation) {
   case Operation::Term:
     return perform_term_operation(inverted_index, expr);
@@ -504,9 +620,143 @@ std::shared_ptr<IPostings> perform_search(const IInvertedIndex &inverted_index,
   }
 }
 
+std::shared_ptr<IPostings> perform_search(const IInvertedIndex &inverted_index,
+                                          const Expression &expr) {
+  return search_postings(inverted_index, expr);
+}
+
+//-----------------------------------------------------------------------------
+
+static DocumentSet document_set_from_postings(const IPostings &postings) {
+  DocumentSet document_set;
+  for (auto cursor = postings.cursor(); !cursor->is_end(); cursor->next()) {
+    document_set.add(cursor->document_id());
+  }
+  return document_set;
+}
+
+static DocumentSet search_document_set(const IInvertedIndex &inverted_index,
+                                       const Expression &expr);
+
+static DocumentSet search_documents_and(const IInvertedIndex &inverted_index,
+                                        const Expression &expr) {
+  std::vector<const IPostings *> sparse_postings;
+  std::vector<const DocumentSet *> document_sets;
+  std::vector<DocumentSet> results;
+  results.reserve(expr.nodes.size());
+
+  for (const auto &node : expr.nodes) {
+    if (node.operation == Operation::Term) {
+      auto document_set = inverted_index.document_set(node.term_id);
+      if (document_set) {
+        document_sets.push_back(document_set);
+      } else {
+        sparse_postings.push_back(&inverted_index.postings(node.term_id));
+      }
+    } else {
+      results.push_back(search_document_set(inverted_index, node));
+      document_sets.push_back(&results.back());
+    }
+  }
+
+  std::sort(document_sets.begin(), document_sets.end(),
+            [](auto a, auto b) { return a->size() < b->size(); });
+
+  if (sparse_postings.empty()) {
+    auto result = *document_sets[0];
+    for (size_t i = 1; i < document_sets.size() && !result.empty(); i++) {
+      result = DocumentSet::intersect(result, *document_sets[i]);
+    }
+    return result;
+  }
+
+  // Join the sparse postings first, and probe the document sets only with
+  // the documents they have in common.
+  Cursors cursors;
+  for (auto postings : sparse_postings) {
+    cursors.push_back(postings->cursor());
+  }
+
+  std::vector<size_t> order(cursors.size(), 0);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](auto a, auto b) {
+    return sparse_postings[a]->size() < sparse_postings[b]->size();
+  });
+
+  DocumentSet result;
+  while (leapfrog(cursors, order)) {
+    auto document_id = cursors[order[0]]->document_id();
+    auto found = std::all_of(
+        document_sets.begin(), document_sets.end(),
+        [&](auto document_set) { return document_set->contains(document_id); });
+    if (found) {
+      result.add(document_id);
+    }
+    cursors[order[0]]->next();
+  }
+  return result;
+}
+
+static DocumentSet search_documents_or(const IInvertedIndex &inverted_index,
+                                       const Expression &expr) {
+  DocumentSet result;
+  for (const auto &node : expr.nodes) {
+    auto document_set = node.operation == Operation::Term
+                            ? inverted_index.document_set(node.term_id)
+                            : nullptr;
+    if (document_set) {
+      result = DocumentSet::unite(result, *document_set);
+    } else {
+      result =
+          DocumentSet::unite(result, search_document_set(inverted_index, node));
+    }
+  }
+  return result;
+}
+
+static DocumentSet search_document_set(const IInvertedIndex &inverted_index,
+                                       const Expression &expr) {
+  switch (expr.operation) {
+  case Operation::Term: {
+    auto document_set = inverted_index.document_set(expr.term_id);
+    if (document_set) {
+      return *document_set;
+    }
+    return document_set_from_postings(inverted_index.postings(expr.term_id));
+  }
+  case Operation::And:
+    return search_documents_and(inverted_index, expr);
+  case Operation::Or:
+    return search_documents_or(inverted_index, expr);
+  default:
+    // Phrase and proximity matches need term positions
+    return document_set_from_postings(*search_postings(inverted_index, expr));
+  }
+}
+
+// Document sets of frequent terms still have the deleted documents, and
+// they're intersected a container at a time, so deleted documents are
+// dropped once from the result instead.
+DocumentSet search_documents(const IInvertedIndex &inverted_index,
+                             const Expression &expr) {
+  auto result = search_document_set(inverted_index, expr);
+  auto live_documents = inverted_index.live_documents();
+  if (!live_documents) {
+    return result;
+  }
+
+  DocumentSet live;
+  result.for_each([&](auto document_id) {
+    if (live_documents->contains(document_id)) {
+      live.add(document_id);
+    }
+  });
+  return live;
+}
+
 template <typename T> void enumerate_terms(const Expression &expr, T fn) {
   if (expr.operation == Operation::Term) {
-    fn(expr.term_str);
+    fn(expr.term_id);
   } else {
     for (const auto &node : expr.nodes) {
       enumerate_terms(node, fn);
@@ -518,8 +768,8 @@ size_t term_count_score(const IInvertedIndex &invidx, const Expression &expr,
                         const IPostings &postings, size_t index) {
   auto document_id = postings.document_id(index);
   size_t score = 0;
-  enumerate_terms(expr, [&](const auto &term) {
-    score += invidx.term_count(term, document_id);
+  enumerate_terms(expr, [&](auto term_id) {
+    score += invidx.term_count(term_id, document_id);
   });
   return score;
 }
@@ -527,12 +777,12 @@ size_t term_count_score(const IInvertedIndex &invidx, const Expression &expr,
 double tf_idf_score(const IInvertedIndex &invidx, const Expression &expr,
                     const IPostings &postings, size_t index) {
   auto document_id = postings.document_id(index);
-  auto N = static_cast<double>(invidx.document_count());
+  auto N = static_cast<double>(invidx.live_document_count());
   double score = 0.0;
-  enumerate_terms(expr, [&](const auto &term) {
-    auto n = static_cast<double>(invidx.df(term));
+  enumerate_terms(expr, [&](auto term_id) {
+    auto n = static_cast<double>(invidx.df(term_id));
     auto idf = std::log2((N + 0.001) / (n + 0.001));
-    score += invidx.tf(term, document_id) * idf;
+    score += invidx.tf(term_id, document_id) * idf;
   });
   return score;
 }
@@ -541,15 +791,15 @@ double bm25_score(const IInvertedIndex &invidx, const Expression &expr,
                   const IPostings &postings, size_t index, double k1,
                   double b) {
   auto document_id = postings.document_id(index);
-  auto N = static_cast<double>(invidx.document_count());
+  auto N = static_cast<double>(invidx.live_document_count());
   auto dl = static_cast<double>(invidx.document_term_count(document_id));
   auto avgdl = static_cast<double>(invidx.average_document_term_count());
 
   double score = 0.0;
-  enumerate_terms(expr, [&](const auto &term) {
-    auto n = static_cast<double>(invidx.df(term));
+  enumerate_terms(expr, [&](auto term_id) {
+    auto n = static_cast<double>(invidx.df(term_id));
     auto idf = std::log2((N - n + 0.5) / (n + 0.5));
-    auto tf = invidx.tf(term, document_id);
+    auto tf = invidx.tf(term_id, document_id);
 
     score +=
         idf * ((tf * (k1 + 1.0)) / (tf + k1 * (1.0 - b + b * (dl / avgdl))));
@@ -557,4 +807,112 @@ double bm25_score(const IInvertedIndex &invidx, const Expression &expr,
   return score;
 }
 
+//-----------------------------------------------------------------------------
+
+namespace {
+
+// One cursor per query term. Results are scored in ascending document order,
+// so each cursor only moves forward and the whole batch costs a single pass
+// over every term's postings.
+class TermCursors {
+public:
+  TermCursors(const IInvertedIndex &invidx, const Expression &expr) {
+    enumerate_terms(expr, [&](auto term_id) {
+      term_ids_.push_back(term_id);
+      postings_.push_back(&invidx.postings(term_id));
+      cursors_.push_back(postings_.back()->cursor());
+      last_document_ids_.push_back(0);
+    });
+  }
+
+  size_t size() const { return term_ids_.size(); }
+
+  size_t term_id(size_t i) const { return term_ids_[i]; }
+
+  size_t freq(size_t i, size_t document_id) {
+    auto &cursor = cursors_[i];
+    if (document_id < last_document_ids_[i]) {
+      cursor = postings_[i]->cursor();
+    }
+    last_document_ids_[i] = document_id;
+
+    cursor->advance_to(document_id);
+    if (!cursor->is_end() && cursor->document_id() == document_id) {
+      return cursor->freq();
+    }
+    return 0;
+  }
+
+private:
+  std::vector<size_t> term_ids_;
+  std::vector<const IPostings *> postings_;
+  Cursors cursors_;
+  std::vector<size_t> last_document_ids_;
+};
+
+} // namespace
+
+std::vector<size_t> term_count_scores(const IInvertedIndex &invidx,
+                                      const Expression &expr,
+                                      const IPostings &postings) {
+  TermCursors terms(invidx, expr);
+  std::vector<size_t> scores(postings.size(), 0);
+  for (size_t index = 0; index < postings.size(); index++) {
+    auto document_id = postings.document_id(index);
+    for (size_t i = 0; i < terms.size(); i++) {
+      scores[index] += terms.freq(i, document_id);
+    }
+  }
+  return scores;
+}
+
+std::vector<double> tf_idf_scores(const IInvertedIndex &invidx,
+                                  const Expression &expr,
+                                  const IPostings &postings) {
+  TermCursors terms(invidx, expr);
+  auto N = static_cast<double>(invidx.live_document_count());
+  std::vector<double> idfs;
+  for (size_t i = 0; i < terms.size(); i++) {
+    auto n = static_cast<double>(invidx.df(terms.term_id(i)));
+    idfs.push_back(std::log2((N + 0.001) / (n + 0.001)));
+  }
+
+  std::vector<double> scores(postings.size(), 0.0);
+  for (size_t index = 0; index < postings.size(); index++) {
+    auto document_id = postings.document_id(index);
+    auto dl = static_cast<double>(invidx.document_term_count(document_id));
+    for (size_t i = 0; i < terms.size(); i++) {
+      auto tf = static_cast<double>(terms.freq(i, document_id)) / dl;
+      scores[index] += tf * idfs[i];
+    }
+  }
+  return scores;
+}
+
+std::vector<double> bm25_scores(const IInvertedIndex &invidx,
+                                const Expression &expr,
+                                const IPostings &postings, double k1,
+                                double b) {
+  TermCursors terms(invidx, expr);
+  auto N = static_cast<double>(invidx.live_document_count());
+  auto avgdl = static_cast<double>(invidx.average_document_term_count());
+  std::vector<double> idfs;
+  for (size_t i = 0; i < terms.size(); i++) {
+    auto n = static_cast<double>(invidx.df(terms.term_id(i)));
+    idfs.push_back(std::log2((N - n + 0.5) / (n + 0.5)));
+  }
+
+  std::vector<double> scores(postings.size(), 0.0);
+  for (size_t index = 0; index < postings.size(); index++) {
+    auto document_id = postings.document_id(index);
+    auto dl = static_cast<double>(invidx.document_term_count(document_id));
+    auto norm = k1 * (1.0 - b + b * (dl / avgdl));
+    for (size_t i = 0; i < terms.size(); i++) {
+      auto tf = static_cast<double>(terms.freq(i, document_id)) / dl;
+      scores[index] += idfs[i] * ((tf * (k1 + 1.0)) / (tf + norm));
+    }
+  }
+  return scores;
+}
+
 } // namespace searchlib
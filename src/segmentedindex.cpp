@@ -0,0 +1,650 @@
+//
+//  segmentedindex.cpp
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <deque>
+#include <limits>
+#include <stdexcept>
+
+#include "postings.h"
+#include "searchlib.h"
+
+namespace searchlib {
+
+static constexpr uint32_t no_term = std::numeric_limits<uint32_t>::max();
+
+// One entry of `positions`, with its document id made local to a segment
+class SegmentLocalEntry : public IPostings {
+public:
+  SegmentLocalEntry(const IPostings &positions, size_t index, size_t base)
+      : positions_(positions), index_(index), base_(base) {}
+
+  size_t size() const override { return 1; }
+
+  size_t document_id(size_t) const override {
+    return positions_.document_id(index_) - base_;
+  }
+
+  size_t search_hit_count(size_t) const override {
+    return positions_.search_hit_count(index_);
+  }
+
+  size_t term_position(size_t, size_t search_hit_index) const override {
+    return positions_.term_position(index_, search_hit_index);
+  }
+
+  size_t term_length(size_t, size_t search_hit_index) const override {
+    return positions_.term_length(index_, search_hit_index);
+  }
+
+  bool is_term_position(size_t, size_t term_pos) const override {
+    return positions_.is_term_position(index_, term_pos);
+  }
+
+  std::unique_ptr<IPostingsCursor> cursor() const override {
+    return std::make_unique<Cursor>(*this);
+  }
+
+private:
+  class Cursor : public IPostingsCursor {
+  public:
+    explicit Cursor(const SegmentLocalEntry &entry) : entry_(entry) {}
+
+    bool is_end() const override { return end_; }
+
+    void next() override { end_ = true; }
+
+    void advance_to(size_t document_id) override {
+      if (!end_ && entry_.document_id(0) < document_id) {
+        end_ = true;
+      }
+    }
+
+    size_t document_id() const override { return entry_.document_id(0); }
+
+    size_t freq() const override { return entry_.search_hit_count(0); }
+
+    size_t term_position(size_t search_hit_index) const override {
+      return entry_.term_position(0, search_hit_index);
+    }
+
+    size_t term_length(size_t search_hit_index) const override {
+      return entry_.term_length(0, search_hit_index);
+    }
+
+    bool is_term_position(size_t term_pos) const override {
+      return entry_.is_term_position(0, term_pos);
+    }
+
+  private:
+    const SegmentLocalEntry &entry_;
+    bool end_ = false;
+  };
+
+  const IPostings &positions_;
+  size_t index_;
+  size_t base_;
+};
+
+//-----------------------------------------------------------------------------
+
+class MultiSegmentIndex::Cursor : public IPostingsCursor {
+public:
+  Cursor(const MultiSegmentIndex &index,
+         const std::vector<uint32_t> &local_term_ids)
+      : index_(index), local_term_ids_(local_term_ids) {
+    open(0);
+  }
+
+  bool is_end() const override { return !cursor_; }
+
+  void next() override {
+    cursor_->next();
+    if (cursor_->is_end()) {
+      open(segment_ + 1);
+    }
+  }
+
+  void advance_to(size_t document_id) override {
+    while (cursor_ && index_.bases_[segment_ + 1] <= document_id) {
+      open(segment_ + 1);
+    }
+    if (cursor_ && index_.bases_[segment_] < document_id) {
+      cursor_->advance_to(document_id - index_.bases_[segment_]);
+      if (cursor_->is_end()) {
+        open(segment_ + 1);
+      }
+    }
+  }
+
+  size_t document_id() const override {
+    return index_.bases_[segment_] + cursor_->document_id();
+  }
+
+  size_t freq() const override { return cursor_->freq(); }
+
+  size_t term_position(size_t search_hit_index) const override {
+    return cursor_->term_position(search_hit_index);
+  }
+
+  size_t term_length(size_t search_hit_index) const override {
+    return cursor_->term_length(search_hit_index);
+  }
+
+  bool is_term_position(size_t term_pos) const override {
+    return cursor_->is_term_position(term_pos);
+  }
+
+private:
+  // Moves to the first segment from `segment` which has the term
+  void open(size_t segment) {
+    cursor_.reset();
+    for (; segment < index_.segments_.size(); segment++) {
+      auto local_term_id = local_term_ids_[segment];
+      if (local_term_id == no_term) {
+        continue;
+      }
+      const auto &segment_index = *index_.segments_[segment];
+      auto cursor = segment_index.postings(local_term_id).cursor();
+      if (!cursor->is_end()) {
+        cursor_ = std::move(cursor);
+        segment_ = segment;
+        return;
+      }
+    }
+  }
+
+  const MultiSegmentIndex &index_;
+  const std::vector<uint32_t> &local_term_ids_;
+  size_t segment_ = 0;
+  std::unique_ptr<IPostingsCursor> cursor_;
+};
+
+class MultiSegmentIndex::Postings : public IPostings {
+public:
+  Postings(const MultiSegmentIndex &index,
+           std::vector<uint32_t> local_term_ids)
+      : index_(index), local_term_ids_(std::move(local_term_ids)) {}
+
+  // The id of the term in `segment`, or `no_term` if the segment lacks it
+  uint32_t local_term_id(size_t segment) const {
+    return local_term_ids_[segment];
+  }
+
+  size_t size() const override {
+    size_t size = 0;
+    for (size_t s = 0; s < index_.segments_.size(); s++) {
+      auto local_term_id = local_term_ids_[s];
+      if (local_term_id != no_term) {
+        size += index_.segments_[s]->postings(local_term_id).size();
+      }
+    }
+    return size;
+  }
+
+  size_t document_id(size_t index) const override {
+    return locate(index, [&](auto s, const auto &postings, auto i) {
+      return index_.bases_[s] + postings.document_id(i);
+    });
+  }
+
+  size_t search_hit_count(size_t index) const override {
+    return locate(index, [](auto, const auto &postings, auto i) {
+      return postings.search_hit_count(i);
+    });
+  }
+
+  size_t term_position(size_t index, size_t search_hit_index) const override {
+    return locate(index, [&](auto, const auto &postings, auto i) {
+      return postings.term_position(i, search_hit_index);
+    });
+  }
+
+  size_t term_length(size_t, size_t) const override { return 1; }
+
+  bool is_term_position(size_t index, size_t term_pos) const override {
+    return locate(index, [&](auto, const auto &postings, auto i) {
+      return postings.is_term_position(i, term_pos);
+    });
+  }
+
+  std::unique_ptr<IPostingsCursor> cursor() const override {
+    return std::make_unique<Cursor>(index_, local_term_ids_);
+  }
+
+private:
+  // Calls `fn` with the segment which holds the entry at `index`, its
+  // postings and the index within them.
+  template <typename T>
+  auto locate(size_t index, T fn) const
+      -> decltype(fn(size_t(0), std::declval<const IPostings &>(), index)) {
+    for (size_t s = 0; s < index_.segments_.size(); s++) {
+      auto local_term_id = local_term_ids_[s];
+      if (local_term_id == no_term) {
+        continue;
+      }
+      const auto &postings = index_.segments_[s]->postings(local_term_id);
+      if (index < postings.size()) {
+        return fn(s, postings, index);
+      }
+      index -= postings.size();
+    }
+    throw std::out_of_range("MultiSegmentIndex::Postings");
+  }
+
+  const MultiSegmentIndex &index_;
+  std::vector<uint32_t> local_term_ids_;
+};
+
+// Terms resolved so far. Postings are never moved once added, so a
+// reference to them holds while the view does.
+struct MultiSegmentIndex::Terms {
+  std::mutex mutex;
+  std::unordered_map<std::u32string, size_t> term_ids;
+  std::deque<Postings> postings;
+};
+
+//-----------------------------------------------------------------------------
+
+MultiSegmentIndex::MultiSegmentIndex(
+    std::vector<std::shared_ptr<const SealedInvertedIndex>> segments,
+    const std::vector<std::shared_ptr<const LiveDocuments>> &live_documents)
+    : segments_(std::move(segments)), terms_(std::make_unique<Terms>()) {
+  bases_.push_back(0);
+  for (const auto &segment : segments_) {
+    bases_.push_back(bases_.back() + segment->document_count());
+    total_term_count_ += segment->total_term_count();
+  }
+
+  for (size_t s = 0; s < live_documents.size(); s++) {
+    if (live_documents[s] && live_documents[s]->deleted_count() > 0) {
+      live_documents_.resize(document_count());
+      live_documents[s]->for_each_deleted([&](auto document_id) {
+        live_documents_.remove(bases_[s] + document_id);
+        total_term_count_ -= segments_[s]->document_term_count(document_id);
+      });
+    }
+  }
+}
+
+MultiSegmentIndex::~MultiSegmentIndex() = default;
+
+size_t MultiSegmentIndex::document_count() const { return bases_.back(); }
+
+size_t MultiSegmentIndex::external_document_id(size_t document_id) const {
+  auto s = segment_of(document_id);
+  return segments_[s]->external_document_id(document_id - bases_[s]);
+}
+
+std::optional<size_t>
+MultiSegmentIndex::internal_document_id(size_t external_document_id) const {
+  for (size_t s = segments_.size(); s-- > 0;) {
+    auto id = segments_[s]->internal_document_id(external_document_id);
+    if (id && (live_documents_.deleted_count() == 0 ||
+               live_documents_.contains(bases_[s] + *id))) {
+      return bases_[s] + *id;
+    }
+  }
+  return std::nullopt;
+}
+
+size_t MultiSegmentIndex::document_term_count(size_t document_id) const {
+  auto s = segment_of(document_id);
+  return segments_[s]->document_term_count(document_id - bases_[s]);
+}
+
+double MultiSegmentIndex::average_document_term_count() const {
+  auto count = live_document_count();
+  if (count == 0) {
+    return 0.0;
+  }
+  return static_cast<double>(total_term_count_) / static_cast<double>(count);
+}
+
+bool MultiSegmentIndex::term_exists(const std::u32string &str) const {
+  return term_id(str).has_value();
+}
+
+size_t MultiSegmentIndex::term_count(const std::u32string &str) const {
+  return term_count(checked_term_id(str));
+}
+
+size_t MultiSegmentIndex::term_count(const std::u32string &str,
+                                     size_t document_id) const {
+  return term_count(checked_term_id(str), document_id);
+}
+
+size_t MultiSegmentIndex::df(const std::u32string &str) const {
+  return df(checked_term_id(str));
+}
+
+double MultiSegmentIndex::tf(const std::u32string &str,
+                             size_t document_id) const {
+  return tf(checked_term_id(str), document_id);
+}
+
+const IPostings &MultiSegmentIndex::postings(const std::u32string &str) const {
+  return postings(checked_term_id(str));
+}
+
+// The dictionaries of the segments are searched without the lock. Another
+// thread may resolve the same term meanwhile, in which case its id is kept.
+std::optional<size_t>
+MultiSegmentIndex::term_id(const std::u32string &str) const {
+  {
+    std::lock_guard<std::mutex> lock(terms_->mutex);
+    auto it = terms_->term_ids.find(str);
+    if (it != terms_->term_ids.end()) {
+      return it->second;
+    }
+  }
+
+  std::vector<uint32_t> local_term_ids(segments_.size(), no_term);
+  auto found = false;
+  for (size_t s = 0; s < segments_.size(); s++) {
+    if (auto local_term_id = segments_[s]->term_id(str)) {
+      local_term_ids[s] = static_cast<uint32_t>(*local_term_id);
+      found = true;
+    }
+  }
+  if (!found) {
+    return std::nullopt;
+  }
+
+  std::lock_guard<std::mutex> lock(terms_->mutex);
+  auto [it, inserted] =
+      terms_->term_ids.try_emplace(str, terms_->postings.size());
+  if (inserted) {
+    terms_->postings.emplace_back(*this, std::move(local_term_ids));
+  }
+  return it->second;
+}
+
+size_t MultiSegmentIndex::term_count(size_t term_id) const {
+  const auto &postings = term_postings(term_id);
+  size_t count = 0;
+  for (size_t s = 0; s < segments_.size(); s++) {
+    auto local_term_id = postings.local_term_id(s);
+    if (local_term_id != no_term) {
+      count += segments_[s]->term_count(local_term_id);
+    }
+  }
+  return live_term_count(postings, count, live_documents());
+}
+
+size_t MultiSegmentIndex::term_count(size_t term_id,
+                                     size_t document_id) const {
+  auto s = segment_of(document_id);
+  auto local_term_id = term_postings(term_id).local_term_id(s);
+  if (local_term_id == no_term) {
+    return 0;
+  }
+  return segments_[s]->term_count(local_term_id, document_id - bases_[s]);
+}
+
+size_t MultiSegmentIndex::df(size_t term_id) const {
+  return live_document_frequency(postings(term_id), live_documents());
+}
+
+double MultiSegmentIndex::tf(size_t term_id, size_t document_id) const {
+  auto s = segment_of(document_id);
+  auto local_term_id = term_postings(term_id).local_term_id(s);
+  if (local_term_id == no_term) {
+    return 0.0;
+  }
+  return segments_[s]->tf(local_term_id, document_id - bases_[s]);
+}
+
+const IPostings &MultiSegmentIndex::postings(size_t term_id) const {
+  return term_postings(term_id);
+}
+
+const LiveDocuments *MultiSegmentIndex::live_documents() const {
+  return live_documents_.deleted_count() > 0 ? &live_documents_ : nullptr;
+}
+
+TextRange MultiSegmentIndex::text_range(const IPostings &positions,
+                                        size_t index,
+                                        size_t search_hit_index) const {
+  auto s = segment_of(positions.document_id(index));
+  SegmentLocalEntry entry(positions, index, bases_[s]);
+  return segments_[s]->text_range(entry, 0, search_hit_index);
+}
+
+const std::vector<std::shared_ptr<const SealedInvertedIndex>> &
+MultiSegmentIndex::segments() const {
+  return segments_;
+}
+
+size_t MultiSegmentIndex::checked_term_id(const std::u32string &str) const {
+  auto term_id = this->term_id(str);
+  if (!term_id) {
+    throw std::out_of_range("MultiSegmentIndex: unknown term");
+  }
+  return *term_id;
+}
+
+size_t MultiSegmentIndex::segment_of(size_t document_id) const {
+  if (document_id >= document_count()) {
+    throw std::out_of_range("MultiSegmentIndex: unknown document");
+  }
+  auto it = std::upper_bound(bases_.begin(), bases_.end(), document_id);
+  return std::distance(bases_.begin(), it) - 1;
+}
+
+const MultiSegmentIndex::Postings &
+MultiSegmentIndex::term_postings(size_t term_id) const {
+  std::lock_guard<std::mutex> lock(terms_->mutex);
+  return terms_->postings.at(term_id);
+}
+
+//-----------------------------------------------------------------------------
+
+SegmentedIndex::SegmentedIndex(Normalizer normalizer, size_t segment_size,
+                               size_t merge_factor)
+    : normalizer_(std::move(normalizer)),
+      segment_size_(std::max<size_t>(segment_size, 1)),
+      merge_factor_(std::max<size_t>(merge_factor, 2)),
+      reader_(std::make_shared<MultiSegmentIndex>(
+          std::vector<std::shared_ptr<const SealedInvertedIndex>>())) {
+  reset_buffer();
+  merge_thread_ = std::thread([this] { merge_loop(); });
+}
+
+SegmentedIndex::~SegmentedIndex() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  merge_thread_.join();
+}
+
+void SegmentedIndex::index_document(size_t external_document_id,
+                                    Tokenizer<TextRange> tokenizer) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    delete_from_segments(external_document_id);
+  }
+
+  // The buffer replaces a document indexed before by itself
+  indexer_->index_document(external_document_id, std::move(tokenizer));
+  if (buffer_->document_count() >= segment_size_) {
+    flush();
+  }
+}
+
+bool SegmentedIndex::delete_document(size_t external_document_id) {
+  auto deleted = indexer_->delete_document(external_document_id);
+  std::lock_guard<std::mutex> lock(mutex_);
+  return delete_from_segments(external_document_id) || deleted;
+}
+
+void SegmentedIndex::flush() {
+  // Documents deleted in the buffer are purged when it is sealed
+  std::shared_ptr<const SealedInvertedIndex> segment;
+  if (buffer_->document_count() > 0) {
+    indexer_.reset();
+    segment = seal(*buffer_);
+    reset_buffer();
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (segment && segment->document_count() > 0) {
+    segments_.push_back(std::move(segment));
+    live_documents_.push_back(nullptr);
+  } else if (!deleted_) {
+    return;
+  }
+  deleted_ = false;
+  publish(lock);
+  cv_.notify_all();
+}
+
+void SegmentedIndex::wait_for_merges() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [&] { return !merging_ && !find_merge(); });
+}
+
+std::shared_ptr<const MultiSegmentIndex> SegmentedIndex::reader() const {
+  return std::atomic_load(&reader_);
+}
+
+void SegmentedIndex::reset_buffer() {
+  buffer_ = std::make_unique<InMemoryInvertedIndex<TextRange>>();
+  indexer_ = std::make_unique<InMemoryIndexer<TextRange>>(*buffer_,
+                                                          normalizer_);
+}
+
+// Called with `mutex_` held
+bool SegmentedIndex::delete_from_segments(size_t external_document_id) {
+  auto deleted = false;
+  for (size_t s = 0; s < segments_.size(); s++) {
+    auto document_id = segments_[s]->internal_document_id(external_document_id);
+    auto &live = live_documents_[s];
+    if (!document_id || (live && !live->contains(*document_id))) {
+      continue;
+    }
+
+    if (!live) {
+      live = std::make_shared<LiveDocuments>(segments_[s]->document_count());
+    } else if (live.use_count() > 1) {
+      live = std::make_shared<LiveDocuments>(*live);
+    }
+    live->remove(*document_id);
+    deleted = deleted_ = true;
+  }
+  return deleted;
+}
+
+void SegmentedIndex::merge_loop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [&] { return stop_ || find_merge(); });
+    if (stop_) {
+      return;
+    }
+
+    auto [beg, end] = *find_merge();
+    std::vector<const SealedInvertedIndex *> run;
+    std::vector<std::shared_ptr<const LiveDocuments>> run_live_documents;
+    std::vector<const LiveDocuments *> live_documents;
+    for (auto i = beg; i < end; i++) {
+      run.push_back(segments_[i].get());
+      run_live_documents.push_back(live_documents_[i]);
+      live_documents.push_back(live_documents_[i].get());
+    }
+    merging_ = true;
+
+    // Segments are only appended while the lock is released, so the run
+    // stays where it is.
+    lock.unlock();
+    auto image = std::make_shared<std::vector<uint8_t>>(
+        SealedInvertedIndex::merge_images(run, live_documents));
+    auto p = image->data();
+    auto size = image->size();
+    auto merged = std::make_shared<const SealedInvertedIndex>(std::move(image),
+                                                              p, size);
+    lock.lock();
+
+    // Carry over the deletions made during the merge. A live document is in
+    // the merged segment once, so it is found by its external id.
+    std::shared_ptr<LiveDocuments> merged_live_documents;
+    for (auto i = beg; i < end; i++) {
+      const auto &live = live_documents_[i];
+      const auto &snapshot = run_live_documents[i - beg];
+      if (live == snapshot) {
+        continue;
+      }
+      live->for_each_deleted([&](auto document_id) {
+        if (snapshot && !snapshot->contains(document_id)) {
+          return;
+        }
+        auto id = merged->internal_document_id(
+            segments_[i]->external_document_id(document_id));
+        if (!merged_live_documents) {
+          merged_live_documents =
+              std::make_shared<LiveDocuments>(merged->document_count());
+        }
+        merged_live_documents->remove(*id);
+      });
+    }
+
+    segments_.erase(segments_.begin() + beg, segments_.begin() + end);
+    segments_.insert(segments_.begin() + beg, std::move(merged));
+    live_documents_.erase(live_documents_.begin() + beg,
+                          live_documents_.begin() + end);
+    live_documents_.insert(live_documents_.begin() + beg,
+                           std::move(merged_live_documents));
+    merging_ = false;
+    publish(lock);
+    cv_.notify_all();
+  }
+}
+
+std::optional<std::pair<size_t, size_t>> SegmentedIndex::find_merge() const {
+  size_t beg = 0;
+  for (size_t i = 1; i <= segments_.size(); i++) {
+    if (i == segments_.size() ||
+        tier(*segments_[i]) != tier(*segments_[beg])) {
+      if (i - beg >= merge_factor_) {
+        return std::make_pair(beg, beg + merge_factor_);
+      }
+      beg = i;
+    }
+  }
+  return std::nullopt;
+}
+
+size_t SegmentedIndex::tier(const SealedInvertedIndex &segment) const {
+  size_t tier = 0;
+  for (auto limit = segment_size_; segment.document_count() > limit;
+       limit *= merge_factor_) {
+    tier++;
+  }
+  return tier;
+}
+
+void SegmentedIndex::publish(std::unique_lock<std::mutex> &lock) {
+  auto version = ++version_;
+  auto segments = segments_;
+  std::vector<std::shared_ptr<const LiveDocuments>> live_documents(
+      live_documents_.begin(), live_documents_.end());
+
+  lock.unlock();
+  auto reader = std::make_shared<const MultiSegmentIndex>(std::move(segments),
+                                                          live_documents);
+  lock.lock();
+
+  if (version > reader_version_) {
+    // The previous view goes away when its last reader releases it
+    std::atomic_store(&reader_, std::shared_ptr<const MultiSegmentIndex>(
+                                    std::move(reader)));
+    reader_version_ = version;
+  }
+}
+
+} // namespace searchlib
@@ -0,0 +1,156 @@
+//
+//  termdictionary.cpp
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <stdexcept>
+
+#include "./codec.h"
+#include "./utils.h"
+#include "searchlib.h"
+
+namespace searchlib {
+
+[[noreturn]] static void fail() {
+  throw std::runtime_error("TermDictionary: corrupted data");
+}
+
+// Decodes the term at `p` into `str`, which holds the previous term of the
+// same block on entry. The data may come from an image, so it is read no
+// further than `end`.
+static const uint8_t *decode_term(const uint8_t *p, const uint8_t *end,
+                                  bool first, std::string &str) {
+  uint64_t shared = 0;
+  uint64_t len;
+  if ((!first && !varint_decode(p, end, shared)) ||
+      !varint_decode(p, end, len) || shared > str.size() ||
+      len > static_cast<size_t>(end - p)) {
+    fail();
+  }
+  str.resize(shared);
+  str.append(reinterpret_cast<const char *>(p), len);
+  return p + len;
+}
+
+TermDictionary::TermDictionary(const std::vector<std::u32string> &terms)
+    : term_count_(terms.size()) {
+  std::string prev;
+  for (size_t i = 0; i < terms.size(); i++) {
+    auto str = u8(terms[i]);
+    if (i % block_size == 0) {
+      block_offsets_.push_back(static_cast<uint32_t>(data_.size()));
+      varint_encode(str.size(), data_);
+      data_.insert(data_.end(), str.begin(), str.end());
+    } else {
+      size_t shared = 0;
+      while (shared < prev.size() && shared < str.size() &&
+             prev[shared] == str[shared]) {
+        shared++;
+      }
+      varint_encode(shared, data_);
+      varint_encode(str.size() - shared, data_);
+      data_.insert(data_.end(), str.begin() + shared, str.end());
+    }
+    prev = std::move(str);
+  }
+  data_.shrink_to_fit();
+  block_offsets_.shrink_to_fit();
+}
+
+TermDictionary::TermDictionary(size_t term_count, const uint8_t *data,
+                               size_t data_size, const uint32_t *block_offsets,
+                               size_t block_count)
+    : term_count_(term_count), data_view_(data), data_view_size_(data_size),
+      block_offsets_view_(block_offsets), block_count_view_(block_count) {}
+
+size_t TermDictionary::size() const { return term_count_; }
+
+std::optional<size_t> TermDictionary::find(const std::u32string &str) const {
+  auto key = u8(str);
+
+  // Find the last block whose first term is not greater than the key
+  size_t lo = 0;
+  size_t hi = block_count();
+  while (lo < hi) {
+    auto mid = (lo + hi) / 2;
+    if (block_first_term(mid) <= key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return std::nullopt;
+  }
+
+  auto block = lo - 1;
+  auto p = data() + block_offsets()[block];
+  auto end = data() + data_size();
+  auto count = std::min(block_size, term_count_ - block * block_size);
+  std::string curr;
+  for (size_t i = 0; i < count; i++) {
+    p = decode_term(p, end, i == 0, curr);
+    if (curr == key) {
+      return block * block_size + i;
+    } else if (key < curr) {
+      break;
+    }
+  }
+  return std::nullopt;
+}
+
+std::u32string TermDictionary::term(size_t term_id) const {
+  auto block = term_id / block_size;
+  auto p = data() + block_offsets()[block];
+  auto end = data() + data_size();
+  std::string curr;
+  for (size_t i = 0; i <= term_id % block_size; i++) {
+    p = decode_term(p, end, i == 0, curr);
+  }
+  return u32(curr);
+}
+
+void TermDictionary::for_each(
+    std::function<void(size_t term_id, const std::u32string &str)> fn) const {
+  auto p = data();
+  auto end = data() + data_size();
+  std::string curr;
+  for (size_t term_id = 0; term_id < term_count_; term_id++) {
+    p = decode_term(p, end, term_id % block_size == 0, curr);
+    fn(term_id, u32(curr));
+  }
+}
+
+size_t TermDictionary::storage_size() const {
+  return data_size() + block_count() * sizeof(uint32_t);
+}
+
+const uint8_t *TermDictionary::data() const {
+  return data_view_ ? data_view_ : data_.data();
+}
+
+size_t TermDictionary::data_size() const {
+  return data_view_ ? data_view_size_ : data_.size();
+}
+
+const uint32_t *TermDictionary::block_offsets() const {
+  return block_offsets_view_ ? block_offsets_view_ : block_offsets_.data();
+}
+
+size_t TermDictionary::block_count() const {
+  return block_offsets_view_ ? block_count_view_ : block_offsets_.size();
+}
+
+std::string_view TermDictionary::block_first_term(size_t block) const {
+  auto p = data() + block_offsets()[block];
+  auto end = data() + data_size();
+  uint64_t len;
+  if (!varint_decode(p, end, len) || len > static_cast<size_t>(end - p)) {
+    fail();
+  }
+  return std::string_view(reinterpret_cast<const char *>(p), len);
+}
+
+} // namespace searchlib
@@ -5,6 +5,13 @@
 //  MIT License
 //
 
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+#include "./codec.h"
 #include "lib/unicodelib.h"
 #include "lib/unicodelib_encodings.h"
 #include "searchlib.h"
@@ -13,24 +20,410 @@ using namespace unicode;
 
 namespace searchlib {
 
-TextRange text_range(const TextRangeList<TextRange> &text_range_list,
+TextRangeStore::TextRangeStore(const uint64_t *entries, size_t entry_count,
+                               const uint64_t *words, size_t word_count)
+    : entries_view_(entries), entry_count_view_(entry_count),
+      words_view_(words), word_count_view_(word_count) {}
+
+// An entry takes 40 bits for the bit offset and 8 bits for each width.
+uint64_t TextRangeStore::pack_entry(const Entry &entry) {
+  return entry.bit_offset | uint64_t(entry.position_bits) << 40 |
+         uint64_t(entry.length_bits) << 48 | uint64_t(entry.delta_bits) << 56;
+}
+
+TextRangeStore::Entry TextRangeStore::unpack_entry(uint64_t packed) {
+  return Entry{packed & ((uint64_t(1) << 40) - 1), (packed >> 40) & 0xff,
+               (packed >> 48) & 0xff, packed >> 56};
+}
+
+// Bit offset of a token within the document. The delta of a token, if any,
+// comes right before its length.
+size_t TextRangeStore::token_offset(const Entry &entry, size_t term_pos) {
+  auto block = term_pos / block_size;
+  auto k = term_pos % block_size;
+  auto pair_bits = entry.delta_bits + entry.length_bits;
+  auto block_bits = entry.position_bits + entry.length_bits +
+                    (block_size - 1) * pair_bits;
+  auto offset = block * block_bits;
+  return k == 0 ? offset
+                : offset + entry.position_bits + entry.length_bits +
+                      (k - 1) * pair_bits;
+}
+
+void TextRangeStore::add_document(size_t document_id,
+                                  const std::vector<TextRange> &text_ranges) {
+  assert(!entries_view_);
+
+  size_t position_bits = 0;
+  size_t length_bits = 0;
+  size_t delta_bits = 0;
+  for (size_t i = 0; i < text_ranges.size(); i++) {
+    const auto &rng = text_ranges[i];
+    length_bits = std::max(length_bits, bit_width(rng.length));
+    if (i % block_size == 0) {
+      position_bits = std::max(position_bits, bit_width(rng.position));
+    } else {
+      assert(text_ranges[i - 1].position <= rng.position);
+      auto delta = rng.position - text_ranges[i - 1].position;
+      delta_bits = std::max(delta_bits, bit_width(delta));
+    }
+  }
+
+  assert(bit_size_ < (uint64_t(1) << 40));
+  Entry entry{bit_size_, position_bits, length_bits, delta_bits};
+
+  auto offset = bit_size_;
+  for (size_t i = 0; i < text_ranges.size(); i++) {
+    const auto &rng = text_ranges[i];
+    if (i % block_size == 0) {
+      write_bits(words_, offset, rng.position, position_bits);
+      offset += position_bits;
+    } else {
+      auto delta = rng.position - text_ranges[i - 1].position;
+      write_bits(words_, offset, delta, delta_bits);
+      offset += delta_bits;
+    }
+    write_bits(words_, offset, rng.length, length_bits);
+    offset += length_bits;
+  }
+  bit_size_ = offset;
+
+  // A document indexed again leaves its old bits unused
+  if (document_id >= entries_.size()) {
+    entries_.resize(document_id + 1, 0);
+  }
+  entries_[document_id] = pack_entry(entry);
+}
+
+void TextRangeStore::append(const TextRangeStore &other) {
+  assert(!entries_view_ && !other.entries_view_);
+
+  for (auto packed : other.entries_) {
+    auto entry = unpack_entry(packed);
+    entry.bit_offset += bit_size_;
+    assert(entry.bit_offset < (uint64_t(1) << 40));
+    entries_.push_back(pack_entry(entry));
+  }
+
+  for (size_t offset = 0; offset < other.bit_size_; offset += 64) {
+    auto bits = std::min<size_t>(64, other.bit_size_ - offset);
+    write_bits(words_, bit_size_ + offset,
+               read_bits(other.words_.data(), offset, bits), bits);
+  }
+  bit_size_ += other.bit_size_;
+}
+
+TextRange TextRangeStore::text_range(size_t document_id,
+                                     size_t term_pos) const {
+  if (document_id >= entry_count()) {
+    throw std::out_of_range("TextRangeStore::text_range");
+  }
+  auto entry = unpack_entry(entries()[document_id]);
+  auto words = this->words();
+  // Entries of a store kept elsewhere may be corrupted
+  if (entry.position_bits > 64 || entry.length_bits > 64 ||
+      entry.delta_bits > 64) {
+    throw std::runtime_error("TextRangeStore: corrupted data");
+  }
+
+  // The length comes last, so no bit past it is read. The store doesn't
+  // know how many tokens a document has, so this is all that keeps a term
+  // position past the end of the document in bounds.
+  auto first = term_pos - term_pos % block_size;
+  auto length_offset =
+      entry.bit_offset + token_offset(entry, term_pos) +
+      (term_pos == first ? entry.position_bits : entry.delta_bits);
+  if (length_offset + entry.length_bits > word_count() * 64) {
+    throw std::out_of_range("TextRangeStore::text_range");
+  }
+
+  auto offset = entry.bit_offset + token_offset(entry, first);
+  auto position = read_bits(words, offset, entry.position_bits);
+  for (auto i = first + 1; i <= term_pos; i++) {
+    position += read_bits(
+        words, entry.bit_offset + token_offset(entry, i), entry.delta_bits);
+  }
+
+  auto length = read_bits(words, length_offset, entry.length_bits);
+  return TextRange{position, length};
+}
+
+size_t TextRangeStore::storage_size() const {
+  return (entry_count() + word_count()) * sizeof(uint64_t);
+}
+
+const uint64_t *TextRangeStore::entries() const {
+  return entries_view_ ? entries_view_ : entries_.data();
+}
+
+size_t TextRangeStore::entry_count() const {
+  return entries_view_ ? entry_count_view_ : entries_.size();
+}
+
+const uint64_t *TextRangeStore::words() const {
+  return entries_view_ ? words_view_ : words_.data();
+}
+
+size_t TextRangeStore::word_count() const {
+  return entries_view_ ? word_count_view_ : words_.size();
+}
+
+//-----------------------------------------------------------------------------
+
+static TextRange merge_text_ranges(const TextRange &beg, const TextRange &end) {
+  auto length = end.position + end.length - beg.position;
+  return TextRange{beg.position, length};
+}
+
+TextRange text_range(const TextRangeStore &text_range_store,
                      const IPostings &positions, size_t index,
                      size_t search_hit_index) {
   auto document_id = positions.document_id(index);
   auto term_pos = positions.term_position(index, search_hit_index);
   auto term_length = positions.term_length(index, search_hit_index);
   if (term_length == 1) {
-    return text_range_list.at(document_id)[term_pos];
+    return text_range_store.text_range(document_id, term_pos);
   } else {
-    auto beg = text_range_list.at(document_id)[term_pos];
-    auto end = text_range_list.at(document_id)[term_pos + term_length - 1];
-    auto length = end.position + end.length - beg.position;
-    return TextRange{beg.position, length};
+    auto beg = text_range_store.text_range(document_id, term_pos);
+    auto end =
+        text_range_store.text_range(document_id, term_pos + term_length - 1);
+    return merge_text_ranges(beg, end);
   }
 }
 
+TextRange text_range(Tokenizer<TextRange> tokenizer,
+                     const IPostings &positions, size_t index,
+                     size_t search_hit_index) {
+  auto term_pos = positions.term_position(index, search_hit_index);
+  auto last_term_pos =
+      term_pos + positions.term_length(index, search_hit_index) - 1;
+
+  TextRange beg{0, 0};
+  TextRange end{0, 0};
+  tokenizer(nullptr, [&](const auto & /*str*/, auto pos, auto text_range) {
+    if (pos == term_pos) {
+      beg = text_range;
+    }
+    if (pos == last_term_pos) {
+      end = text_range;
+    }
+  });
+  return merge_text_ranges(beg, end);
+}
+
 //-----------------------------------------------------------------------------
 
+std::u32string
+LowercaseNormalizer::operator()(const std::u32string &str) const {
+  std::u32string out;
+  (*this)(str, out);
+  return out;
+}
+
+void LowercaseNormalizer::operator()(const std::u32string &str,
+                                     std::u32string &out) const {
+  if (std::all_of(str.begin(), str.end(), [](auto cp) { return cp < 0x80; })) {
+    out.resize(str.size());
+    std::transform(str.begin(), str.end(), out.begin(), [](char32_t cp) {
+      return cp - U'A' < 26 ? cp + 0x20 : cp;
+    });
+    return;
+  }
+  out = unicode::to_lowercase(str);
+}
+
+//-----------------------------------------------------------------------------
+
+// Readers don't lock. Each bucket has a sequence number, which writers make
+// odd while they change its entries, and a reader takes a hit only if the
+// number was even and unchanged around its read. Entries are kept in atomic
+// words so that such reads aren't data races. Writers take the stripe of the
+// bucket, and a reader which keeps meeting a writer reads under it too.
+struct CachingNormalizer::Cache {
+  static constexpr size_t max_length = 22;
+  static constexpr size_t ways = 8;
+  static constexpr size_t stripe_count = 64;
+
+  // Key length, value length, key and value, packed in that order. A key
+  // length of 0 marks an empty slot.
+  struct Slot {
+    uint8_t key_length;
+    uint8_t value_length;
+    char key[max_length];
+    char value[max_length];
+  };
+  static constexpr size_t slot_words =
+      (sizeof(Slot) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  struct Entry {
+    std::atomic<uint64_t> words[slot_words];
+    std::atomic<bool> referenced;
+
+    // The lengths and the start of the key are in the first word
+    size_t key_length() const {
+      uint64_t first = words[0].load(std::memory_order_acquire);
+      uint8_t length;
+      std::memcpy(&length, &first, sizeof(length));
+      return length;
+    }
+  };
+
+  struct Bucket {
+    std::atomic<uint32_t> sequence;
+    Entry entries[ways];
+    size_t hand; // Guarded by the stripe
+
+    // Looks `key` up, and copies the slot of a hit into `slot`. Without the
+    // stripe, the result is only valid if `sequence` didn't change.
+    bool find(const char *key, size_t len, Slot &slot, size_t &way) const {
+      for (way = 0; way < ways; way++) {
+        if (entries[way].key_length() != len) {
+          continue;
+        }
+        const auto &words = entries[way].words;
+        uint64_t packed[slot_words];
+        for (size_t i = 0; i < slot_words; i++) {
+          packed[i] = words[i].load(std::memory_order_acquire);
+        }
+        std::memcpy(&slot, packed, sizeof(slot));
+        if (!std::memcmp(slot.key, key, len)) {
+          return true;
+        }
+      }
+      return false;
+    }
+  };
+
+  Normalizer normalizer;
+  size_t bucket_count = 0;
+  std::unique_ptr<Bucket[]> buckets;
+  // Bucket `i` is written under `stripes[i % stripe_count]`
+  std::array<std::mutex, stripe_count> stripes;
+};
+
+// Copies `str` into `buf` if it's short ASCII
+static bool to_cache_key(const std::u32string &str, char *buf,
+                         size_t max_length) {
+  if (str.empty() || str.size() > max_length) {
+    return false;
+  }
+  for (size_t i = 0; i < str.size(); i++) {
+    if (str[i] >= 0x80) {
+      return false;
+    }
+    buf[i] = static_cast<char>(str[i]);
+  }
+  return true;
+}
+
+CachingNormalizer::CachingNormalizer(Normalizer normalizer, size_t capacity)
+    : cache_(std::make_shared<Cache>()) {
+  size_t bucket_count = 1;
+  while (bucket_count * Cache::ways < capacity) {
+    bucket_count *= 2;
+  }
+  cache_->normalizer = std::move(normalizer);
+  cache_->bucket_count = bucket_count;
+  // Value-initialized, so every slot starts empty
+  cache_->buckets = std::make_unique<Cache::Bucket[]>(bucket_count);
+}
+
+std::u32string CachingNormalizer::operator()(const std::u32string &str) const {
+  std::u32string out;
+  (*this)(str, out);
+  return out;
+}
+
+void CachingNormalizer::operator()(const std::u32string &str,
+                                   std::u32string &out) const {
+  char key[Cache::max_length];
+  if (!to_cache_key(str, key, Cache::max_length)) {
+    out = cache_->normalizer(str);
+    return;
+  }
+
+  auto len = str.size();
+  auto index = std::hash<std::string_view>()(std::string_view(key, len)) &
+               (cache_->bucket_count - 1);
+  auto &bucket = cache_->buckets[index];
+  auto &stripe = cache_->stripes[index % Cache::stripe_count];
+
+  auto hit = [&](const Cache::Slot &value, size_t way) {
+    auto &referenced = bucket.entries[way].referenced;
+    if (!referenced.load(std::memory_order_relaxed)) {
+      referenced.store(true, std::memory_order_relaxed);
+    }
+    out.resize(value.value_length);
+    std::copy(value.value, value.value + value.value_length, out.begin());
+  };
+
+  Cache::Slot value;
+  size_t way;
+  bool stable = false;
+  for (size_t attempt = 0; attempt < 2 && !stable; attempt++) {
+    auto sequence = bucket.sequence.load(std::memory_order_acquire);
+    if (sequence % 2 != 0) {
+      continue;
+    }
+    auto found = bucket.find(key, len, value, way);
+    stable = bucket.sequence.load(std::memory_order_relaxed) == sequence;
+    if (stable && found) {
+      hit(value, way);
+      return;
+    }
+  }
+  if (!stable) {
+    std::lock_guard<std::mutex> lock(stripe);
+    if (bucket.find(key, len, value, way)) {
+      hit(value, way);
+      return;
+    }
+  }
+
+  // The normalizer runs unlocked, and another thread may add the same key
+  // meanwhile
+  out = cache_->normalizer(str);
+  Cache::Slot slot{};
+  if (!to_cache_key(out, slot.value, Cache::max_length)) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(stripe);
+  if (bucket.find(key, len, value, way)) {
+    return;
+  }
+
+  // A new entry starts unreferenced, and is kept only if it's used again
+  // before the hand comes back
+  while (true) {
+    auto &entry = bucket.entries[bucket.hand];
+    bucket.hand = (bucket.hand + 1) % Cache::ways;
+    if (entry.key_length() == 0 ||
+        !entry.referenced.load(std::memory_order_relaxed)) {
+      slot.key_length = static_cast<uint8_t>(len);
+      slot.value_length = static_cast<uint8_t>(out.size());
+      std::memcpy(slot.key, key, len);
+      uint64_t packed[Cache::slot_words] = {};
+      std::memcpy(packed, &slot, sizeof(slot));
+
+      auto sequence = bucket.sequence.load(std::memory_order_relaxed);
+      bucket.sequence.store(sequence + 1, std::memory_order_relaxed);
+      // A reader which sees any of these words also sees the odd sequence
+      for (size_t i = 0; i < Cache::slot_words; i++) {
+        entry.words[i].store(packed[i], std::memory_order_release);
+      }
+      entry.referenced.store(false, std::memory_order_relaxed);
+      bucket.sequence.store(sequence + 2, std::memory_order_release);
+      return;
+    }
+    entry.referenced.store(false, std::memory_order_relaxed);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+static bool is_ascii(char c) { return !(static_cast<uint8_t>(c) & 0x80); }
+
 UTF8PlainTextTokenizer::UTF8PlainTextTokenizer(std::string_view text)
     : text_(text) {}
 
@@ -39,39 +432,79 @@ void UTF8PlainTextTokenizer::operator()(
     std::function<void(const std::u32string &str, size_t term_pos,
                        TextRange text_range)>
         callback) {
-  size_t pos = 0;
-  size_t term_pos = 0;
-  while (pos < text_.size()) {
-    // Skip
+  tokenize(normalizer, callback);
+}
+
+// ASCII text is classified 64 bytes at a time, and runs of it are found by
+// scanning the bitmaps. Other code points are decoded and classified one by
+// one.
+bool UTF8PlainTextTokenizer::next_term(Scan &scan, size_t &beg,
+                                       std::u32string &str) const {
+  // Finds the first byte from `pos` whose bit is set in `bitmap()`
+  auto find = [&](size_t pos, auto bitmap) {
     while (pos < text_.size()) {
-      char32_t cp;
-      auto len = utf8::decode_codepoint(&text_[pos], text_.size() - pos, cp);
-      if (is_letter(cp)) {
-        break;
+      if (pos >= scan.block_end) {
+        scan.block = pos - pos % 64;
+        scan.block_end = scan.block + 64;
+        classify_ascii(&text_[scan.block],
+                       std::min<size_t>(64, text_.size() - scan.block),
+                       scan.letters, scan.non_ascii);
       }
-      pos += len;
+      auto bits = bitmap() >> (pos - scan.block);
+      if (bits) {
+        return std::min(pos + count_trailing_zeros(bits), text_.size());
+      }
+      pos = scan.block_end;
     }
+    return text_.size();
+  };
 
-    // Term
-    auto beg = pos;
-    std::u32string str;
+  auto &pos = scan.pos;
 
-    while (pos < text_.size()) {
-      char32_t cp;
-      auto len = utf8::decode_codepoint(&text_[pos], text_.size() - pos, cp);
-      if (!is_letter(cp)) {
-        break;
-      }
-      str += cp;
-      pos += len;
+  // Skip
+  while (pos < text_.size()) {
+    pos = find(pos, [&] { return scan.letters | scan.non_ascii; });
+    if (pos == text_.size() || is_ascii(text_[pos])) {
+      break;
     }
 
-    if (!str.empty()) {
-      callback((normalizer ? normalizer(str) : str), term_pos,
-               {beg, pos - beg});
-      term_pos++;
+    // A malformed byte is skipped like a non-letter
+    char32_t cp;
+    auto len = utf8::decode_codepoint(&text_[pos], text_.size() - pos, cp);
+    if (len == 0) {
+      pos++;
+      continue;
     }
+    if (is_letter(cp)) {
+      break;
+    }
+    pos += len;
   }
+
+  // Term
+  beg = pos;
+  str.clear();
+
+  while (pos < text_.size()) {
+    auto end = find(pos, [&] { return ~scan.letters; });
+    auto size = str.size();
+    str.resize(size + end - pos);
+    std::copy(text_.begin() + pos, text_.begin() + end, str.begin() + size);
+    pos = end;
+    if (pos == text_.size() || is_ascii(text_[pos])) {
+      break;
+    }
+
+    char32_t cp;
+    auto len = utf8::decode_codepoint(&text_[pos], text_.size() - pos, cp);
+    if (len == 0 || !is_letter(cp)) {
+      break;
+    }
+    str += cp;
+    pos += len;
+  }
+
+  return !str.empty();
 }
 
 } // namespace searchlib
@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <string>
 
 namespace searchlib {
@@ -15,4 +16,28 @@ std::string u8(std::u32string_view u32);
 
 std::u32string u32(std::string_view u8);
 
+// Exponential search for the first element in [first, last) which is not
+// less than `value`. It costs O(log d) where d is the distance to the
+// result, so it is cheap when a cursor moves forward by a small step.
+template <typename It, typename T, typename Compare>
+inline It gallop_lower_bound(It first, It last, const T &value, Compare comp) {
+  size_t step = 1;
+  auto lo = first;
+  while (lo != last) {
+    auto remaining = static_cast<size_t>(std::distance(lo, last));
+    auto hi = lo + std::min(step, remaining);
+    if (hi == last || !comp(*(hi - 1), value)) {
+      return std::lower_bound(lo, hi, value, comp);
+    }
+    lo = hi;
+    step *= 2;
+  }
+  return last;
+}
+
+template <typename It, typename T>
+inline It gallop_lower_bound(It first, It last, const T &value) {
+  return gallop_lower_bound(first, last, value, std::less<>());
+}
+
 } // namespace searchlib
@@ -1,6 +1,15 @@
 ﻿#include <gtest/gtest.h>
 #include <searchlib.h>
 
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory_resource>
+#include <tuple>
+
+#include "codec.h"
 #include "test_utils.h"
 
 using namespace searchlib;
@@ -13,7 +22,7 @@ std::vector<std::string> sample_documents = {
     "Hello World!",
 };
 
-auto normalizer = [](auto sv) { return unicode::to_lowercase(sv); };
+static auto normalizer = [](auto sv) { return unicode::to_lowercase(sv); };
 
 auto sample_index() {
   InMemoryInvertedIndex<TextRange> invidx;
@@ -33,6 +42,36 @@ auto sample_index() {
   return invidx;
 }
 
+// Walks `postings` by index, in order and then backwards across block
+// boundaries, and checks it against a cursor.
+void expect_same_as_cursor(const IPostings &postings) {
+  std::vector<std::vector<size_t>> documents;
+  for (auto cursor = postings.cursor(); !cursor->is_end(); cursor->next()) {
+    std::vector<size_t> document{cursor->document_id()};
+    for (size_t i = 0; i < cursor->freq(); i++) {
+      document.push_back(cursor->term_position(i));
+    }
+    documents.push_back(document);
+  }
+  ASSERT_EQ(documents.size(), postings.size());
+
+  auto expect_same = [&](size_t i) {
+    const auto &document = documents[i];
+    EXPECT_EQ(document[0], postings.document_id(i));
+    ASSERT_EQ(document.size() - 1, postings.search_hit_count(i));
+    for (size_t j = 1; j < document.size(); j++) {
+      EXPECT_EQ(document[j], postings.term_position(i, j - 1));
+      EXPECT_TRUE(postings.is_term_position(i, document[j]));
+    }
+  };
+  for (size_t i = 0; i < documents.size(); i++) {
+    expect_same(i);
+  }
+  for (size_t i = documents.size(); i-- > 0;) {
+    expect_same(i);
+  }
+}
+
 TEST(TokenizerTest, UTF8PlainTextTokenizer) {
   std::vector<std::vector<std::string>> expected = {
       {"this", "is", "the", "first", "document"},
@@ -54,6 +93,149 @@ TEST(TokenizerTest, UTF8PlainTextTokenizer) {
   }
 }
 
+TEST(TokenizerTest, NonAsciiText) {
+  std::string doc = "Caf\xc3\xa9 na\xc3\xafve, \xe6\x97\xa5\xe6\x9c\xac-go ok";
+  std::vector<std::string> expected = {
+      "caf\xc3\xa9", "na\xc3\xafve", "\xe6\x97\xa5\xe6\x9c\xac", "go", "ok"};
+  std::vector<std::pair<size_t, size_t>> expected_ranges = {
+      {0, 5}, {6, 6}, {14, 6}, {21, 2}, {24, 2}};
+
+  std::vector<std::string> actual;
+  std::vector<std::pair<size_t, size_t>> ranges;
+  UTF8PlainTextTokenizer tokenizer(doc);
+  tokenizer(normalizer, [&](auto &str, auto, auto rng) {
+    actual.emplace_back(u8(str));
+    ranges.emplace_back(rng.position, rng.length);
+  });
+  EXPECT_EQ(expected, actual);
+  EXPECT_EQ(expected_ranges, ranges);
+}
+
+TEST(TokenizerTest, MalformedText) {
+  // A stray continuation byte, an invalid byte and a truncated sequence
+  std::string doc = "ab\x80" "cd \xff" "ef caf\xc3";
+  std::vector<std::string> expected = {"ab", "cd", "ef", "caf"};
+  std::vector<std::pair<size_t, size_t>> expected_ranges = {
+      {0, 2}, {3, 2}, {7, 2}, {10, 3}};
+
+  std::vector<std::string> actual;
+  std::vector<std::pair<size_t, size_t>> ranges;
+  UTF8PlainTextTokenizer tokenizer(doc);
+  tokenizer(normalizer, [&](auto &str, auto, auto rng) {
+    actual.emplace_back(u8(str));
+    ranges.emplace_back(rng.position, rng.length);
+  });
+  EXPECT_EQ(expected, actual);
+  EXPECT_EQ(expected_ranges, ranges);
+}
+
+TEST(TokenizerTest, InlinedTokenizer) {
+  using Token = std::tuple<std::u32string, size_t, size_t, size_t>;
+
+  for (const auto &doc : sample_documents) {
+    UTF8PlainTextTokenizer tokenizer(doc);
+    std::vector<Token> expected;
+    tokenizer(normalizer, [&](auto &str, auto term_pos, auto rng) {
+      expected.emplace_back(str, term_pos, rng.position, rng.length);
+    });
+
+    std::vector<Token> actual;
+    tokenizer.tokenize(normalizer, [&](auto &str, auto term_pos, auto rng) {
+      actual.emplace_back(str, term_pos, rng.position, rng.length);
+    });
+    EXPECT_EQ(expected, actual);
+  }
+
+  // Indexing through `IIndexer` goes through `Tokenizer<T>` instead
+  InMemoryInvertedIndex<TextRange> invidx;
+  {
+    InMemoryIndexer<TextRange> indexer(invidx, normalizer);
+    IIndexer<TextRange> &base = indexer;
+    size_t document_id = 0;
+    for (const auto &doc : sample_documents) {
+      base.index_document(document_id, UTF8PlainTextTokenizer(doc));
+      document_id++;
+    }
+  }
+
+  const auto &inlined = sample_index();
+  for (auto str : {U"the", U"document", U"second", U"world"}) {
+    const auto &expected = inlined.postings(str);
+    const auto &actual = invidx.postings(str);
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+      EXPECT_EQ(expected.document_id(i), actual.document_id(i));
+      EXPECT_EQ(expected.search_hit_count(i), actual.search_hit_count(i));
+      auto expected_range = inlined.text_range(expected, i, 0);
+      auto actual_range = invidx.text_range(actual, i, 0);
+      EXPECT_EQ(expected_range.position, actual_range.position);
+      EXPECT_EQ(expected_range.length, actual_range.length);
+    }
+  }
+}
+
+TEST(TokenizerTest, LowercaseNormalizer) {
+  LowercaseNormalizer lowercase;
+  std::u32string out;
+  for (auto str : {U"", U"Hello", U"@[`{AZaz", U"\u00c9COLE", U"\u0130stanbul",
+                   U"\u039f\u0394\u039f\u03a3"}) {
+    EXPECT_EQ(unicode::to_lowercase(str), lowercase(str));
+    lowercase(str, out);
+    EXPECT_EQ(unicode::to_lowercase(str), out);
+  }
+
+  // Terms are normalized into the buffers
+  TokenBuffers buffers;
+  for (const auto &doc : sample_documents) {
+    UTF8PlainTextTokenizer tokenizer(doc);
+    std::vector<std::u32string> expected;
+    tokenizer(normalizer, [&](auto &str, auto, auto) {
+      expected.push_back(str);
+    });
+
+    std::vector<std::u32string> actual;
+    tokenizer.tokenize(
+        lowercase,
+        [&](auto &str, auto, auto) {
+          EXPECT_EQ(&buffers.normalized, &str);
+          actual.push_back(str);
+        },
+        buffers);
+    EXPECT_EQ(expected, actual);
+  }
+}
+
+TEST(TokenizerTest, CachingNormalizer) {
+  size_t call_count = 0;
+  CachingNormalizer cached(
+      [&](const auto &str) {
+        call_count++;
+        return unicode::to_lowercase(str);
+      },
+      8);
+
+  std::u32string out;
+  for (auto str :
+       {U"Hello", U"World", U"Hello", U"\u00c9cole", U"\u00c9cole"}) {
+    cached(str, out);
+    EXPECT_EQ(unicode::to_lowercase(str), out);
+  }
+  // Non-ASCII terms aren't cached
+  EXPECT_EQ(4, call_count);
+
+  // The cache holds one bucket of 8 entries. A term used again survives the
+  // eviction of those seen once.
+  for (auto str : {U"a", U"b", U"c", U"d", U"e", U"f"}) {
+    EXPECT_EQ(str, cached(str));
+  }
+  EXPECT_EQ(U"hello", cached(U"Hello"));
+  EXPECT_EQ(10, call_count);
+  EXPECT_EQ(U"g", cached(U"G"));
+  EXPECT_EQ(11, call_count);
+  EXPECT_EQ(U"hello", cached(U"Hello"));
+  EXPECT_EQ(11, call_count);
+}
+
 TEST(QueryTest, ParsingQuery) {
   const auto &invidx = sample_index();
 
@@ -62,6 +244,7 @@ TEST(QueryTest, ParsingQuery) {
     EXPECT_NE(std::nullopt, expr);
     EXPECT_EQ(Operation::Term, (*expr).operation);
     EXPECT_EQ(U"the", (*expr).term_str);
+    EXPECT_EQ(invidx.term_id(U"the"), (*expr).term_id);
   }
 
   {
@@ -70,6 +253,25 @@ TEST(QueryTest, ParsingQuery) {
   }
 }
 
+TEST(QueryTest, TermIds) {
+  const auto &invidx = sample_index();
+
+  EXPECT_EQ(std::nullopt, invidx.term_id(U"nothing"));
+
+  for (auto str : {U"the", U"document", U"second", U"world"}) {
+    auto term_id = invidx.term_id(str);
+    ASSERT_TRUE(term_id);
+    EXPECT_EQ(invidx.term_count(str), invidx.term_count(*term_id));
+    EXPECT_EQ(invidx.df(str), invidx.df(*term_id));
+    EXPECT_EQ(&invidx.postings(str), &invidx.postings(*term_id));
+    for (size_t document_id = 0; document_id < 5; document_id++) {
+      EXPECT_EQ(invidx.term_count(str, document_id),
+                invidx.term_count(*term_id, document_id));
+      EXPECT_EQ(invidx.tf(str, document_id), invidx.tf(*term_id, document_id));
+    }
+  }
+}
+
 TEST(TermTest, TermSearch) {
   const auto &invidx = sample_index();
 
@@ -555,3 +757,1249 @@ TEST(TF_IDF_Test, TF_IDF) {
     EXPECT_EQ(0.2, invidx.tf(term, 1));
   }
 }
+
+TEST(DocumentTest, CollectionStatistics) {
+  InMemoryInvertedIndex<TextRange> invidx;
+  EXPECT_EQ(0.0, invidx.average_document_term_count());
+
+  {
+    InMemoryIndexer indexer(invidx, normalizer);
+    indexer.index_document(10, UTF8PlainTextTokenizer("a b c"));
+    indexer.index_document(2, UTF8PlainTextTokenizer("a b c d e"));
+  }
+  EXPECT_EQ(2, invidx.document_count());
+  EXPECT_EQ(0, invidx.internal_document_id(10));
+  EXPECT_EQ(1, invidx.internal_document_id(2));
+  EXPECT_EQ(std::nullopt, invidx.internal_document_id(0));
+  EXPECT_EQ(10, invidx.external_document_id(0));
+  EXPECT_EQ(2, invidx.external_document_id(1));
+  EXPECT_EQ(3, invidx.document_term_count(0));
+  EXPECT_EQ(5, invidx.document_term_count(1));
+  EXPECT_EQ(8, invidx.base().total_term_count());
+  EXPECT_EQ(4.0, invidx.average_document_term_count());
+
+  {
+    // Indexing a document again replaces it with a new one
+    InMemoryIndexer indexer(invidx, normalizer);
+    indexer.index_document(10, UTF8PlainTextTokenizer("a"));
+  }
+  EXPECT_EQ(3, invidx.document_count());
+  EXPECT_EQ(2, invidx.live_document_count());
+  EXPECT_EQ(2, invidx.internal_document_id(10));
+  EXPECT_EQ(1, invidx.document_term_count(2));
+  EXPECT_EQ(6, invidx.base().total_term_count());
+  EXPECT_EQ(3.0, invidx.average_document_term_count());
+}
+
+TEST(DocumentTest, MemoryResource) {
+  // Counts the bytes handed out by the resource it wraps
+  class CountingResource : public std::pmr::memory_resource {
+  public:
+    size_t allocated_size = 0;
+
+  private:
+    void *do_allocate(size_t bytes, size_t alignment) override {
+      allocated_size += bytes;
+      return upstream_.allocate(bytes, alignment);
+    }
+    // The monotonic upstream frees everything at once when it's destroyed
+    void do_deallocate(void *, size_t, size_t) override {}
+    bool do_is_equal(const memory_resource &other) const noexcept override {
+      return this == &other;
+    }
+
+    std::pmr::monotonic_buffer_resource upstream_;
+  };
+
+  CountingResource resource;
+  {
+    InMemoryInvertedIndex<TextRange> invidx(&resource);
+    {
+      InMemoryIndexer indexer(invidx, normalizer);
+      size_t document_id = 0;
+      for (const auto &doc : sample_documents) {
+        indexer.index_document(document_id, UTF8PlainTextTokenizer(doc));
+        document_id++;
+      }
+    }
+    EXPECT_LT(0, resource.allocated_size);
+
+    auto expr = parse_query(invidx, normalizer, "the second");
+    auto postings = perform_search(invidx, *expr);
+    ASSERT_EQ(2, postings->size());
+    EXPECT_EQ(1, postings->document_id(0));
+    EXPECT_EQ(2, postings->document_id(1));
+    EXPECT_EQ(5, invidx.term_count(U"the"));
+  }
+}
+
+TEST(PostingsTest, OutOfOrderDocuments) {
+  InMemoryInvertedIndexBase::Postings p;
+  p.add_term_position(20, 0);
+  p.add_term_position(10, 1);
+  p.add_term_position(10, 2);
+  p.add_term_position(15, 0);
+  ASSERT_EQ(3, p.size());
+
+  EXPECT_EQ(10, p.document_id(0));
+  EXPECT_EQ(2, p.search_hit_count(0));
+  EXPECT_EQ(1, p.term_position(0, 0));
+  EXPECT_EQ(2, p.term_position(0, 1));
+  EXPECT_TRUE(p.is_term_position(0, 2));
+  EXPECT_FALSE(p.is_term_position(0, 0));
+
+  EXPECT_EQ(15, p.document_id(1));
+  EXPECT_EQ(1, p.search_hit_count(1));
+  EXPECT_EQ(0, p.term_position(1, 0));
+
+  EXPECT_EQ(20, p.document_id(2));
+  EXPECT_EQ(1, p.search_hit_count(2));
+  EXPECT_EQ(0, p.term_position(2, 0));
+}
+
+TEST(PostingsTest, AddTermPositions) {
+  const uint32_t positions[] = {1, 4, 9};
+
+  InMemoryInvertedIndexBase::Postings p;
+  p.add_term_positions(20, positions, 3);
+  p.add_term_positions(10, positions, 2);
+  p.add_term_position(30, 0);
+  p.add_term_positions(30, positions + 1, 2);
+  ASSERT_EQ(3, p.size());
+
+  EXPECT_EQ(10, p.document_id(0));
+  EXPECT_EQ(2, p.search_hit_count(0));
+  EXPECT_EQ(4, p.term_position(0, 1));
+
+  EXPECT_EQ(20, p.document_id(1));
+  EXPECT_EQ(3, p.search_hit_count(1));
+  EXPECT_EQ(9, p.term_position(1, 2));
+
+  EXPECT_EQ(30, p.document_id(2));
+  EXPECT_EQ(3, p.search_hit_count(2));
+  EXPECT_EQ(0, p.term_position(2, 0));
+  EXPECT_EQ(9, p.term_position(2, 2));
+}
+
+TEST(PostingsTest, InternalDocumentIds) {
+  const std::vector<std::pair<size_t, std::string>> documents = {
+      {20, "apple orange"},
+      {10, "orange apple apple"},
+      {30, "banana"},
+      {15, "apple"},
+  };
+
+  InMemoryInvertedIndex<TextRange> invidx;
+  {
+    InMemoryIndexer indexer(invidx, normalizer);
+    for (const auto &[document_id, doc] : documents) {
+      indexer.index_document(document_id, UTF8PlainTextTokenizer(doc));
+    }
+  }
+
+  // Documents are numbered in the order they were indexed
+  auto expr = parse_query(invidx, normalizer, "apple");
+  auto postings = perform_search(invidx, *expr);
+  ASSERT_EQ(3, postings->size());
+
+  std::vector<size_t> external_document_ids;
+  for (size_t i = 0; i < postings->size(); i++) {
+    external_document_ids.push_back(
+        invidx.external_document_id(postings->document_id(i)));
+  }
+  EXPECT_EQ(std::vector<size_t>({20, 10, 15}), external_document_ids);
+
+  EXPECT_EQ(2, postings->search_hit_count(1));
+  EXPECT_AP(2.0 / 3.0, invidx.tf(U"apple", *invidx.internal_document_id(10)));
+
+  auto text_range = invidx.text_range(*postings, 1, 1);
+  EXPECT_EQ(13, text_range.position);
+  EXPECT_EQ(5, text_range.length);
+}
+
+TEST(PostingsTest, Cursor) {
+  const auto &invidx = sample_index();
+
+  {
+    auto cursor = invidx.postings(U"document").cursor();
+    ASSERT_FALSE(cursor->is_end());
+    EXPECT_EQ(0, cursor->document_id());
+    EXPECT_EQ(1, cursor->freq());
+    EXPECT_EQ(4, cursor->term_position(0));
+
+    cursor->next();
+    EXPECT_EQ(1, cursor->document_id());
+
+    cursor->advance_to(1);
+    EXPECT_EQ(1, cursor->document_id());
+
+    cursor->advance_to(3);
+    ASSERT_FALSE(cursor->is_end());
+    EXPECT_EQ(3, cursor->document_id());
+    EXPECT_EQ(1, cursor->freq());
+    EXPECT_TRUE(cursor->is_term_position(1));
+
+    cursor->advance_to(4);
+    EXPECT_TRUE(cursor->is_end());
+  }
+
+  {
+    auto expr = parse_query(invidx, normalizer, " third | HELLO | second ");
+    auto postings = perform_search(invidx, *expr);
+
+    auto cursor = postings->cursor();
+    cursor->advance_to(2);
+    ASSERT_FALSE(cursor->is_end());
+    EXPECT_EQ(2, cursor->document_id());
+    EXPECT_EQ(3, cursor->freq());
+    EXPECT_EQ(8, cursor->term_position(1));
+
+    cursor->next();
+    EXPECT_EQ(4, cursor->document_id());
+
+    cursor->next();
+    EXPECT_TRUE(cursor->is_end());
+  }
+}
+
+TEST(PostingsTest, SkipTo) {
+  InMemoryInvertedIndexBase::Postings p;
+  for (size_t document_id = 0; document_id < 5000; document_id++) {
+    p.add_term_position(document_id * 2, 0);
+  }
+  // Out-of-order documents rebuild the skip data
+  p.add_term_position(1, 0);
+  p.flush();
+
+  ASSERT_EQ(5001, p.size());
+  auto cursor = p.cursor();
+  cursor->advance_to(0);
+  EXPECT_EQ(0, cursor->document_id());
+  cursor->advance_to(1);
+  EXPECT_EQ(1, cursor->document_id());
+  cursor->advance_to(3);
+  EXPECT_EQ(4, cursor->document_id());
+  cursor->advance_to(4999);
+  EXPECT_EQ(5000, cursor->document_id());
+  cursor->advance_to(9996);
+  EXPECT_EQ(9996, cursor->document_id());
+  cursor->advance_to(10000);
+  EXPECT_TRUE(cursor->is_end());
+
+  InMemoryInvertedIndex<TextRange> invidx;
+  {
+    InMemoryIndexer indexer(invidx, normalizer);
+    for (size_t document_id = 0; document_id < 5000; document_id++) {
+      std::string doc = "common";
+      if (document_id % 7 == 0) {
+        doc += " seven";
+      }
+      if (document_id % 997 == 0) {
+        doc += " rare";
+      }
+      indexer.index_document(document_id, UTF8PlainTextTokenizer(doc));
+    }
+  }
+
+  auto expr = parse_query(invidx, normalizer, " common seven rare ");
+  auto postings = perform_search(invidx, *expr);
+
+  std::vector<size_t> expected;
+  for (size_t document_id = 0; document_id < 5000; document_id++) {
+    if (document_id % 7 == 0 && document_id % 997 == 0) {
+      expected.push_back(document_id);
+    }
+  }
+
+  ASSERT_EQ(expected.size(), postings->size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i], postings->document_id(i));
+    EXPECT_EQ(3, postings->search_hit_count(i));
+  }
+}
+
+TEST(PostingsTest, CompressedBlocks) {
+  InMemoryInvertedIndexBase::Postings p;
+  std::vector<size_t> document_ids;
+  size_t document_id = 0;
+  for (size_t i = 0; i < 1000; i++) {
+    // Large gaps between some documents need 64-bit document ids
+    document_id += (i % 300 == 299) ? (size_t(1) << 40) : (i % 5 + 1);
+    document_ids.push_back(document_id);
+    p.add_term_position(document_id, 0);
+    p.add_term_position(document_id, 2);
+    if (i % 2) {
+      p.add_term_position(document_id, 3);
+    }
+  }
+  // Out-of-order document in the middle of the compressed blocks
+  document_ids.insert(document_ids.begin() + 199, document_ids[199] - 1);
+  p.add_term_position(document_ids[199], 0);
+  p.flush();
+
+  // Append to the flushed postings
+  document_ids.push_back(document_ids.back() + 1);
+  p.add_term_position(document_ids.back(), 0);
+  p.flush();
+
+  ASSERT_EQ(document_ids.size(), p.size());
+
+  for (size_t i = 0; i < document_ids.size(); i++) {
+    EXPECT_EQ(document_ids[i], p.document_id(i));
+  }
+
+  EXPECT_EQ(1, p.search_hit_count(199));
+  EXPECT_EQ(0, p.term_position(199, 0));
+
+  EXPECT_EQ(2, p.search_hit_count(0));
+  EXPECT_EQ(0, p.term_position(0, 0));
+  EXPECT_EQ(2, p.term_position(0, 1));
+
+  EXPECT_EQ(3, p.search_hit_count(1000));
+  EXPECT_EQ(0, p.term_position(1000, 0));
+  EXPECT_EQ(2, p.term_position(1000, 1));
+  EXPECT_EQ(3, p.term_position(1000, 2));
+  EXPECT_TRUE(p.is_term_position(1000, 3));
+  EXPECT_FALSE(p.is_term_position(1000, 1));
+
+  EXPECT_EQ(1, p.search_hit_count(1001));
+
+  auto cursor = p.cursor();
+  for (size_t i = 0; i < document_ids.size(); i++) {
+    ASSERT_FALSE(cursor->is_end());
+    EXPECT_EQ(document_ids[i], cursor->document_id());
+    cursor->next();
+  }
+  EXPECT_TRUE(cursor->is_end());
+
+  cursor = p.cursor();
+  cursor->advance_to(document_ids[700]);
+  EXPECT_EQ(document_ids[700], cursor->document_id());
+  cursor->advance_to(document_ids[299] + 1);
+  EXPECT_EQ(document_ids[700], cursor->document_id());
+  cursor->advance_to(document_ids[900] - 1);
+  EXPECT_EQ(document_ids[900], cursor->document_id());
+  EXPECT_EQ(3, cursor->freq());
+}
+
+TEST(PostingsTest, IndexAccess) {
+  InMemoryInvertedIndexBase::Postings p1;
+  InMemoryInvertedIndexBase::Postings p2;
+  for (size_t i = 0; i < 1000; i++) {
+    for (size_t j = 0; j < i % 4 + 1; j++) {
+      p1.add_term_position(i * 2, j * 3);
+    }
+    p2.add_term_position(i * 3, i % 7);
+  }
+  p1.flush();
+  expect_same_as_cursor(p1);
+
+  // Interleaved access to two postings
+  for (size_t i = 0; i < 1000; i++) {
+    EXPECT_EQ(i * 2, p1.document_id(i));
+    EXPECT_EQ(i * 3, p2.document_id(i));
+    EXPECT_EQ(i % 7, p2.term_position(i, 0));
+  }
+
+  // Blocks which were read by index are encoded again with other documents
+  EXPECT_EQ(2, p1.document_id(1));
+  p1.add_term_position(1, 5);
+  p1.flush();
+  EXPECT_EQ(1, p1.document_id(1));
+  EXPECT_EQ(5, p1.term_position(1, 0));
+  expect_same_as_cursor(p1);
+  expect_same_as_cursor(p2);
+}
+
+TEST(CodecTest, StreamVByte) {
+  std::vector<uint32_t> values;
+  uint32_t seed = 12345;
+  for (size_t i = 0; i < 1000; i++) {
+    seed = seed * 1103515245 + 12345;
+    auto bits = (seed >> 16) % 33;
+    values.push_back(bits == 32 ? seed : seed & ((1u << bits) - 1));
+  }
+
+  for (auto count : {0, 1, 3, 4, 5, 16, 17, 127, 128, 1000}) {
+    std::vector<uint8_t> buf(svb_max_encoded_size(count));
+    auto size = svb_encode(values.data(), count, buf.data());
+
+    std::vector<uint32_t> scalar(count);
+    EXPECT_EQ(size, svb_decode_scalar(buf.data(), count, scalar.data()));
+    EXPECT_TRUE(std::equal(scalar.begin(), scalar.end(), values.begin()));
+
+    std::vector<uint32_t> decoded(count);
+    EXPECT_EQ(size, svb_decode(buf.data(), count, decoded.data()));
+    EXPECT_EQ(scalar, decoded);
+
+    prefix_sum_scalar(scalar.data(), count);
+    prefix_sum(decoded.data(), count);
+    EXPECT_EQ(scalar, decoded);
+  }
+}
+
+TEST(CodecTest, ClassifyAscii) {
+  std::string text;
+  uint32_t seed = 12345;
+  for (size_t i = 0; i < 1000; i++) {
+    seed = seed * 1103515245 + 12345;
+    text += static_cast<char>(seed >> 16);
+  }
+
+  for (size_t pos = 0; pos < text.size(); pos += 7) {
+    auto size = std::min<size_t>(64, text.size() - pos);
+    uint64_t letters, non_ascii;
+    uint64_t expected_letters, expected_non_ascii;
+    classify_ascii(&text[pos], size, letters, non_ascii);
+    classify_ascii_scalar(&text[pos], size, expected_letters,
+                          expected_non_ascii);
+    EXPECT_EQ(expected_letters, letters);
+    EXPECT_EQ(expected_non_ascii, non_ascii);
+  }
+
+  uint64_t letters, non_ascii;
+  classify_ascii("aZ@[`{\xc3\xa9", 8, letters, non_ascii);
+  EXPECT_EQ(0x03, letters);
+  EXPECT_EQ(0xc0, non_ascii);
+}
+
+TEST(DocumentSetTest, Containers) {
+  std::vector<size_t> document_ids;
+  for (size_t i = 0; i < 10000; i++) {
+    document_ids.push_back(i); // runs
+  }
+  for (size_t i = 0; i < 65536; i += 3) {
+    document_ids.push_back((size_t(1) << 16) + i); // bitmap
+  }
+  for (size_t i = 0; i < 100; i++) {
+    document_ids.push_back((size_t(5) << 32) + i * 7); // array
+  }
+
+  DocumentSet set;
+  for (auto document_id : document_ids) {
+    set.add(document_id);
+  }
+  set.optimize();
+
+  EXPECT_TRUE(set.has_dense_containers());
+  EXPECT_EQ(document_ids.size(), set.size());
+  EXPECT_EQ(document_ids, set.to_vector());
+  EXPECT_TRUE(set.contains(9999));
+  EXPECT_FALSE(set.contains(10000));
+  EXPECT_TRUE(set.contains((size_t(1) << 16) + 3));
+  EXPECT_FALSE(set.contains((size_t(1) << 16) + 4));
+  EXPECT_TRUE(set.contains((size_t(5) << 32) + 14));
+  EXPECT_FALSE(set.contains((size_t(5) << 32) + 15));
+  EXPECT_LT(set.storage_size(), document_ids.size() * sizeof(uint16_t));
+
+  std::vector<size_t> other_ids;
+  for (size_t i = 0; i < 200000; i += 2) {
+    other_ids.push_back(i);
+  }
+  for (size_t i = 0; i < 100; i++) {
+    other_ids.push_back((size_t(5) << 32) + i * 2);
+  }
+
+  DocumentSet other;
+  for (auto document_id : other_ids) {
+    other.add(document_id);
+  }
+
+  std::vector<size_t> expected;
+  std::set_intersection(document_ids.begin(), document_ids.end(),
+                        other_ids.begin(), other_ids.end(),
+                        std::back_inserter(expected));
+  EXPECT_EQ(expected, DocumentSet::intersect(set, other).to_vector());
+  EXPECT_EQ(expected, DocumentSet::intersect(other, set).to_vector());
+
+  expected.clear();
+  std::set_union(document_ids.begin(), document_ids.end(), other_ids.begin(),
+                 other_ids.end(), std::back_inserter(expected));
+  EXPECT_EQ(expected, DocumentSet::unite(set, other).to_vector());
+  EXPECT_EQ(expected, DocumentSet::unite(other, set).to_vector());
+}
+
+TEST(DocumentSetTest, SearchDocuments) {
+  InMemoryInvertedIndex<TextRange> invidx;
+  {
+    InMemoryIndexer indexer(invidx, normalizer);
+    for (size_t i = 0; i < 20000; i++) {
+      auto doc = std::string("foo") + (i % 2 == 0 ? " bar" : "") +
+                 (i % 100 == 0 ? " baz" : "");
+      indexer.index_document(i, UTF8PlainTextTokenizer(doc));
+    }
+  }
+
+  EXPECT_NE(nullptr, invidx.document_set(U"foo"));
+  EXPECT_NE(nullptr, invidx.document_set(U"bar"));
+  EXPECT_EQ(nullptr, invidx.document_set(U"baz"));
+
+  for (auto query : {"foo", "baz", "foo bar", "bar baz", "foo bar baz",
+                     "foo | baz", "bar | baz", "(foo | baz) bar",
+                     R"("bar baz")", "foo ~ baz"}) {
+    auto expr = parse_query(invidx, normalizer, query);
+    ASSERT_TRUE(expr);
+
+    auto postings = perform_search(invidx, *expr);
+    std::vector<size_t> expected;
+    for (size_t i = 0; i < postings->size(); i++) {
+      expected.push_back(postings->document_id(i));
+    }
+    EXPECT_EQ(expected, search_documents(invidx, *expr).to_vector()) << query;
+  }
+}
+
+TEST(TermDictionaryTest, Lookup) {
+  std::vector<std::u32string> terms;
+  for (auto str : {U"apple", U"applesauce", U"apply", U"banana", U"band",
+                   U"bandana", U"can", U"canal", U"candle", U"candy", U"cane",
+                   U"dog", U"door", U"dorm", U"dot", U"dove", U"down",
+                   U"drive", U"café", U"cafés", U"日本", U"日本語"}) {
+    terms.push_back(str);
+  }
+  std::sort(terms.begin(), terms.end());
+
+  TermDictionary dict(terms);
+  ASSERT_EQ(terms.size(), dict.size());
+
+  for (size_t i = 0; i < terms.size(); i++) {
+    EXPECT_EQ(i, dict.find(terms[i]));
+    EXPECT_EQ(terms[i], dict.term(i));
+  }
+
+  EXPECT_FALSE(dict.find(U""));
+  EXPECT_FALSE(dict.find(U"aaa"));
+  EXPECT_FALSE(dict.find(U"appl"));
+  EXPECT_FALSE(dict.find(U"cand"));
+  EXPECT_FALSE(dict.find(U"zzz"));
+  EXPECT_FALSE(dict.find(U"日"));
+
+  std::vector<std::u32string> visited;
+  dict.for_each([&](auto term_id, const auto &str) {
+    EXPECT_EQ(visited.size(), term_id);
+    visited.push_back(str);
+  });
+  EXPECT_EQ(terms, visited);
+
+  TermDictionary empty;
+  EXPECT_EQ(0, empty.size());
+  EXPECT_FALSE(empty.find(U"apple"));
+}
+
+TEST(TextRangeTest, TextRangeStore) {
+  std::vector<std::vector<TextRange>> documents(3);
+  size_t position = 0;
+  for (size_t i = 0; i < 100; i++) {
+    documents[0].push_back({position, i % 7 + 1});
+    position += i % 7 + 2 + (i % 40 == 39 ? 1000 : 0);
+  }
+  documents[2].push_back({size_t(1) << 33, 3});
+
+  TextRangeStore store;
+  for (size_t document_id = 0; document_id < documents.size();
+       document_id++) {
+    store.add_document(document_id, documents[document_id]);
+  }
+
+  for (size_t document_id = 0; document_id < documents.size();
+       document_id++) {
+    const auto &text_ranges = documents[document_id];
+    for (size_t term_pos = 0; term_pos < text_ranges.size(); term_pos++) {
+      auto rng = store.text_range(document_id, term_pos);
+      EXPECT_EQ(text_ranges[term_pos].position, rng.position);
+      EXPECT_EQ(text_ranges[term_pos].length, rng.length);
+    }
+  }
+
+  // Adding a document again replaces its ranges
+  store.add_document(0, {{5, 2}});
+  EXPECT_EQ(5, store.text_range(0, 0).position);
+  EXPECT_EQ(2, store.text_range(0, 0).length);
+}
+
+TEST(TextRangeTest, RecomputeTextRanges) {
+  InMemoryInvertedIndex<TextRange> invidx([](size_t document_id) {
+    return UTF8PlainTextTokenizer(sample_documents[document_id]);
+  });
+  {
+    InMemoryIndexer indexer(invidx, normalizer);
+    for (size_t i = 0; i < sample_documents.size(); i++) {
+      indexer.index_document(i, UTF8PlainTextTokenizer(sample_documents[i]));
+    }
+  }
+  const auto &stored = sample_index();
+
+  for (auto query : {"the", R"("the second")", "second ~ document"}) {
+    auto expr = parse_query(invidx, normalizer, query);
+    auto postings = perform_search(invidx, *expr);
+    auto expected = perform_search(stored, *expr);
+    ASSERT_EQ(expected->size(), postings->size());
+
+    for (size_t i = 0; i < postings->size(); i++) {
+      for (size_t j = 0; j < postings->search_hit_count(i); j++) {
+        auto rng = invidx.text_range(*postings, i, j);
+        auto expected_rng = stored.text_range(*expected, i, j);
+        EXPECT_EQ(expected_rng.position, rng.position);
+        EXPECT_EQ(expected_rng.length, rng.length);
+      }
+    }
+  }
+}
+
+TEST(SealedIndexTest, SameResults) {
+  const auto &invidx = sample_index();
+  auto sealed = seal(invidx);
+
+  EXPECT_EQ(invidx.document_count(), sealed->document_count());
+  EXPECT_EQ(invidx.average_document_term_count(),
+            sealed->average_document_term_count());
+  for (size_t i = 0; i < invidx.document_count(); i++) {
+    EXPECT_EQ(invidx.external_document_id(i), sealed->external_document_id(i));
+    EXPECT_EQ(i, sealed->internal_document_id(invidx.external_document_id(i)));
+    EXPECT_EQ(invidx.document_term_count(i), sealed->document_term_count(i));
+  }
+  EXPECT_FALSE(sealed->internal_document_id(100));
+
+  EXPECT_TRUE(sealed->term_exists(U"second"));
+  EXPECT_FALSE(sealed->term_exists(U"apple"));
+  EXPECT_EQ(5, sealed->term_count(U"the"));
+  EXPECT_EQ(3, sealed->term_count(U"the", 2));
+  EXPECT_EQ(invidx.df(U"document"), sealed->df(U"document"));
+  EXPECT_EQ(invidx.tf(U"the", 2), sealed->tf(U"the", 2));
+
+  // Term ids are ranks in the sealed dictionary
+  EXPECT_EQ(0, sealed->term_id(U"document"));
+  EXPECT_EQ(U"world", sealed->term_dictionary().term(
+                          *sealed->term_id(U"world")));
+
+  for (auto query : {"the", "second document", "the | world",
+                     R"("the second")", "second ~ document"}) {
+    auto expr = parse_query(invidx, normalizer, query);
+    auto sealed_expr = parse_query(*sealed, normalizer, query);
+    auto expected = perform_search(invidx, *expr);
+    auto postings = perform_search(*sealed, *sealed_expr);
+    ASSERT_EQ(expected->size(), postings->size()) << query;
+
+    auto expected_scores = bm25_scores(invidx, *expr, *expected);
+    auto scores = bm25_scores(*sealed, *sealed_expr, *postings);
+
+    for (size_t i = 0; i < postings->size(); i++) {
+      EXPECT_EQ(expected->document_id(i), postings->document_id(i));
+      EXPECT_DOUBLE_EQ(expected_scores[i], scores[i]);
+      ASSERT_EQ(expected->search_hit_count(i), postings->search_hit_count(i));
+      for (size_t j = 0; j < postings->search_hit_count(i); j++) {
+        auto expected_rng = invidx.text_range(*expected, i, j);
+        auto rng = sealed->text_range(*postings, i, j);
+        EXPECT_EQ(expected_rng.position, rng.position);
+        EXPECT_EQ(expected_rng.length, rng.length);
+      }
+    }
+  }
+}
+
+TEST(SealedIndexTest, ManyBlocks) {
+  InMemoryInvertedIndex<TextRange> invidx;
+  {
+    InMemoryIndexer indexer(invidx, normalizer);
+    for (size_t i = 0; i < 3000; i++) {
+      auto doc = i % 3 == 0 ? "apple orange apple" : "orange";
+      indexer.index_document(i * 10, UTF8PlainTextTokenizer(doc));
+    }
+  }
+  auto sealed = seal(invidx);
+
+  EXPECT_EQ(3000, sealed->df(U"orange"));
+  EXPECT_EQ(1000, sealed->df(U"apple"));
+  EXPECT_NE(nullptr, sealed->document_set(U"orange"));
+  EXPECT_EQ(invidx.document_set(U"orange")->to_vector(),
+            sealed->document_set(U"orange")->to_vector());
+
+  auto cursor = sealed->postings(U"apple").cursor();
+  cursor->advance_to(1500);
+  ASSERT_FALSE(cursor->is_end());
+  EXPECT_EQ(1500, cursor->document_id());
+  EXPECT_EQ(2, cursor->freq());
+  EXPECT_EQ(2, cursor->term_position(1));
+  cursor->advance_to(3000);
+  EXPECT_TRUE(cursor->is_end());
+
+  expect_same_as_cursor(sealed->postings(U"apple"));
+  expect_same_as_cursor(sealed->postings(U"orange"));
+
+  auto expr = parse_query(*sealed, normalizer, "apple orange");
+  EXPECT_EQ(1000, perform_search(*sealed, *expr)->size());
+  EXPECT_EQ(1000, search_documents(*sealed, *expr).size());
+}
+
+TEST(SealedIndexTest, BrokenImage) {
+  InMemoryInvertedIndex<TextRange> invidx;
+  {
+    InMemoryIndexer indexer(invidx, normalizer);
+    for (size_t i = 0; i < 2000; i++) {
+      auto doc = i % 2 ? "apple orange" : "orange";
+      indexer.index_document(i, UTF8PlainTextTokenizer(doc));
+    }
+  }
+  auto image = SealedInvertedIndex::build_image(invidx);
+
+  // Reads every part of the index, as a broken field may be found only when
+  // it is first used
+  auto read_all = [](const std::vector<uint8_t> &image, size_t size) {
+    SealedInvertedIndex sealed(nullptr, image.data(), size);
+    for (size_t i = 0; i < sealed.document_count(); i++) {
+      EXPECT_EQ(i, sealed.internal_document_id(sealed.external_document_id(i)));
+    }
+    const auto &dictionary = sealed.term_dictionary();
+    for (size_t term_id = 0; term_id < dictionary.size(); term_id++) {
+      EXPECT_EQ(term_id, sealed.term_id(dictionary.term(term_id)));
+      sealed.document_set(term_id);
+      const auto &postings = sealed.postings(term_id);
+      for (auto cursor = postings.cursor(); !cursor->is_end();
+           cursor->next()) {
+        sealed.text_range(postings, 0, cursor->freq() - 1);
+      }
+    }
+  };
+  EXPECT_NO_THROW(read_all(image, image.size()));
+  EXPECT_THROW(read_all(image, 16), std::runtime_error);
+  EXPECT_THROW(read_all(image, image.size() / 2), std::runtime_error);
+
+  // Sections as laid out by the image format: offset and size pairs after a
+  // 40-byte header, in the order of the sections.
+  enum { SortedDocumentIds = 1, DictionaryData = 3 };
+  enum { DictionaryBlockOffsets = 4, Blocks = 6 };
+  enum { PostingsData = 7, DocumentSetOffsets = 8, DocumentSetData = 9 };
+  enum { TextRangeEntries = 10 };
+  auto section = [&](size_t s) {
+    uint64_t entry[2];
+    std::memcpy(entry, image.data() + 40 + s * 16, sizeof(entry));
+    return std::make_pair(entry[0], entry[1]);
+  };
+  auto expect_broken = [&](size_t offset, auto value) {
+    auto broken = image;
+    std::memcpy(broken.data() + offset, &value, sizeof(value));
+    EXPECT_THROW(read_all(broken, broken.size()), std::runtime_error);
+  };
+
+  ASSERT_NE(0, section(DocumentSetData).second);
+  auto blocks = section(Blocks).first;
+  auto postings_data_size = section(PostingsData).second;
+  // Fields of the first block: ids, data offset, and position and document
+  // counts
+  expect_broken(blocks + 8, uint64_t(1) << 40);
+  expect_broken(blocks + 16, uint64_t(1) << 40);
+  expect_broken(blocks + 16, uint64_t(postings_data_size - 1));
+  expect_broken(blocks + 24, uint32_t(12345));
+  expect_broken(blocks + 28, uint16_t(1000));
+
+  // Terms are checked on first use rather than when the image is opened
+  {
+    auto broken = image;
+    std::memset(broken.data() + blocks + 16, 0xff, sizeof(uint64_t));
+    SealedInvertedIndex sealed(nullptr, broken.data(), broken.size());
+    EXPECT_THROW(sealed.postings(0), std::runtime_error);
+  }
+
+  expect_broken(section(SortedDocumentIds).first + 4000, uint32_t(1) << 30);
+
+  expect_broken(section(DictionaryBlockOffsets).first, uint32_t(1) << 30);
+  expect_broken(section(DictionaryData).first, uint8_t(0x7f));
+  expect_broken(section(DocumentSetOffsets).first + 8, uint64_t(1) << 40);
+  expect_broken(section(DocumentSetData).first, uint8_t(0x7f));
+  expect_broken(section(TextRangeEntries).first, ~uint64_t(0));
+
+  image[0] = 'X';
+  EXPECT_THROW(read_all(image, image.size()), std::runtime_error);
+}
+
+TEST(SealedIndexTest, SaveLoad) {
+  auto path = (std::filesystem::temp_directory_path() / "searchlib_test.idx")
+                  .string();
+  const auto &invidx = sample_index();
+  save_index(invidx, path);
+
+  std::shared_ptr<IInvertedIndexWithTextRange<TextRange>> loaded =
+      load_index(path);
+  EXPECT_EQ(invidx.document_count(), loaded->document_count());
+  EXPECT_EQ(invidx.external_document_id(3), loaded->external_document_id(3));
+
+  auto expr = parse_query(*loaded, normalizer, R"("the second")");
+  auto postings = perform_search(*loaded, *expr);
+  ASSERT_EQ(2, postings->size());
+  EXPECT_EQ(1, postings->document_id(0));
+  EXPECT_EQ(2, postings->document_id(1));
+  auto rng = loaded->text_range(*postings, 1, 0);
+  EXPECT_EQ(36, rng.position);
+  EXPECT_EQ(10, rng.length);
+
+  // A sealed index is written as it is
+  save_index(*seal(invidx), path);
+  EXPECT_EQ(seal(invidx)->image_size(), std::filesystem::file_size(path));
+
+  std::filesystem::resize_file(path, 100);
+  EXPECT_THROW(load_index(path), std::runtime_error);
+  std::filesystem::remove(path);
+  EXPECT_THROW(load_index(path), std::runtime_error);
+}
+
+TEST(SealedIndexTest, MapIndex) {
+  auto path = (std::filesystem::temp_directory_path() / "searchlib_map.idx")
+                  .string();
+  const auto &invidx = sample_index();
+  save_index(invidx, path);
+
+  auto mapped = map_index(path);
+  auto loaded = load_index(path);
+  ASSERT_EQ(loaded->image_size(), mapped->image_size());
+  EXPECT_EQ(0, std::memcmp(loaded->image(), mapped->image(),
+                           mapped->image_size()));
+
+  for (auto query : {"the", R"("the second")", "second ~ document"}) {
+    auto expr = parse_query(*mapped, normalizer, query);
+    auto expected =
+        perform_search(invidx, *parse_query(invidx, normalizer, query));
+    auto postings = perform_search(*mapped, *expr);
+    ASSERT_EQ(expected->size(), postings->size());
+    for (size_t i = 0; i < postings->size(); i++) {
+      EXPECT_EQ(expected->document_id(i), postings->document_id(i));
+      auto expected_rng = invidx.text_range(*expected, i, 0);
+      auto rng = mapped->text_range(*postings, i, 0);
+      EXPECT_EQ(expected_rng.position, rng.position);
+    }
+  }
+  EXPECT_EQ(invidx.df(U"document"), mapped->df(U"document"));
+
+  // The mapping lives as long as the index
+  auto postings = &mapped->postings(U"the");
+  auto weak = std::weak_ptr<SealedInvertedIndex>(mapped);
+  std::filesystem::remove(path);
+  EXPECT_EQ(3, postings->size());
+  mapped.reset();
+  EXPECT_TRUE(weak.expired());
+
+  EXPECT_THROW(map_index(path), std::runtime_error);
+  std::ofstream(path) << "not an index";
+  EXPECT_THROW(map_index(path), std::runtime_error);
+  std::filesystem::remove(path);
+}
+
+TEST(SegmentedIndexTest, SameResults) {
+  const auto &invidx = sample_index();
+  SegmentedIndex segidx(normalizer, 2, 2);
+  for (size_t i = 0; i < sample_documents.size(); i++) {
+    segidx.index_document(i, UTF8PlainTextTokenizer(sample_documents[i]));
+  }
+  segidx.flush();
+  segidx.wait_for_merges();
+
+  auto reader = segidx.reader();
+  EXPECT_EQ(2, reader->segments().size());
+  EXPECT_EQ(invidx.document_count(), reader->document_count());
+  EXPECT_EQ(invidx.average_document_term_count(),
+            reader->average_document_term_count());
+  for (size_t i = 0; i < invidx.document_count(); i++) {
+    EXPECT_EQ(i, reader->external_document_id(i));
+    EXPECT_EQ(i, reader->internal_document_id(i));
+    EXPECT_EQ(invidx.document_term_count(i), reader->document_term_count(i));
+  }
+  EXPECT_EQ(5, reader->term_count(U"the"));
+  EXPECT_EQ(3, reader->term_count(U"the", 2));
+  EXPECT_EQ(invidx.df(U"document"), reader->df(U"document"));
+  EXPECT_EQ(invidx.tf(U"the", 2), reader->tf(U"the", 2));
+  EXPECT_FALSE(reader->term_exists(U"apple"));
+  EXPECT_THROW(reader->df(U"apple"), std::out_of_range);
+
+  // Terms get their ids on first use
+  auto term_id = reader->term_id(U"world");
+  ASSERT_TRUE(term_id);
+  EXPECT_EQ(term_id, reader->term_id(U"world"));
+  EXPECT_EQ(invidx.df(U"world"), reader->df(*term_id));
+  EXPECT_THROW(reader->postings(*term_id + 100), std::out_of_range);
+
+  for (auto query : {"the", "second document", "the | world",
+                     R"("the second")", "second ~ document", "hello"}) {
+    auto expr = parse_query(invidx, normalizer, query);
+    auto reader_expr = parse_query(*reader, normalizer, query);
+    auto expected = perform_search(invidx, *expr);
+    auto postings = perform_search(*reader, *reader_expr);
+    ASSERT_EQ(expected->size(), postings->size()) << query;
+
+    auto expected_scores = bm25_scores(invidx, *expr, *expected);
+    auto scores = bm25_scores(*reader, *reader_expr, *postings);
+
+    for (size_t i = 0; i < postings->size(); i++) {
+      EXPECT_EQ(expected->document_id(i), postings->document_id(i));
+      EXPECT_DOUBLE_EQ(expected_scores[i], scores[i]);
+      ASSERT_EQ(expected->search_hit_count(i), postings->search_hit_count(i));
+      for (size_t j = 0; j < postings->search_hit_count(i); j++) {
+        auto expected_rng = invidx.text_range(*expected, i, j);
+        auto rng = reader->text_range(*postings, i, j);
+        EXPECT_EQ(expected_rng.position, rng.position);
+        EXPECT_EQ(expected_rng.length, rng.length);
+      }
+    }
+  }
+}
+
+TEST(SegmentedIndexTest, TieredMerge) {
+  InMemoryInvertedIndex<TextRange> invidx;
+  InMemoryIndexer indexer(invidx, normalizer);
+  SegmentedIndex segidx(normalizer, 4, 3);
+
+  std::shared_ptr<const MultiSegmentIndex> old_reader;
+  for (size_t i = 0; i < 500; i++) {
+    auto doc = i % 3 == 0 ? "apple orange apple" : "orange banana";
+    indexer.index_document(i, UTF8PlainTextTokenizer(doc));
+    segidx.index_document(i, UTF8PlainTextTokenizer(doc));
+    if (i == 20) {
+      old_reader = segidx.reader();
+    }
+  }
+  segidx.flush();
+  segidx.wait_for_merges();
+
+  // Old views keep their segments alive after they are merged away
+  EXPECT_EQ(20, old_reader->document_count());
+  EXPECT_EQ(7, old_reader->df(U"apple"));
+
+  auto reader = segidx.reader();
+  EXPECT_EQ(500, reader->document_count());
+  EXPECT_LT(reader->segments().size(), 10);
+  for (size_t i = 1; i < reader->segments().size(); i++) {
+    EXPECT_GE(reader->segments()[i - 1]->document_count(),
+              reader->segments()[i]->document_count());
+  }
+
+  for (auto query : {"apple", "orange", R"("orange banana")"}) {
+    auto expected =
+        perform_search(invidx, *parse_query(invidx, normalizer, query));
+    auto postings =
+        perform_search(*reader, *parse_query(*reader, normalizer, query));
+    ASSERT_EQ(expected->size(), postings->size()) << query;
+    for (size_t i = 0; i < postings->size(); i++) {
+      EXPECT_EQ(expected->document_id(i), postings->document_id(i));
+    }
+  }
+
+  auto cursor = reader->postings(U"apple").cursor();
+  cursor->advance_to(250);
+  ASSERT_FALSE(cursor->is_end());
+  EXPECT_EQ(252, cursor->document_id());
+  EXPECT_EQ(2, cursor->freq());
+}
+
+TEST(DeletionTest, DeleteAndUpdate) {
+  InMemoryInvertedIndex<TextRange> invidx;
+  InMemoryIndexer indexer(invidx, normalizer);
+  for (size_t i = 0; i < sample_documents.size(); i++) {
+    indexer.index_document(i, UTF8PlainTextTokenizer(sample_documents[i]));
+  }
+  EXPECT_EQ(nullptr, invidx.live_documents());
+
+  EXPECT_TRUE(indexer.delete_document(1));
+  EXPECT_FALSE(indexer.delete_document(1));
+  EXPECT_FALSE(indexer.delete_document(100));
+  indexer.update_document(2, UTF8PlainTextTokenizer("The second update."));
+
+  ASSERT_NE(nullptr, invidx.live_documents());
+  EXPECT_EQ(2, invidx.live_documents()->deleted_count());
+  EXPECT_FALSE(invidx.internal_document_id(1));
+  EXPECT_EQ(5, invidx.internal_document_id(2));
+  EXPECT_EQ(2, invidx.external_document_id(5));
+
+  auto search = [&](const auto &index, auto query) {
+    auto expr = parse_query(index, normalizer, query);
+    auto postings = perform_search(index, *expr);
+    std::vector<size_t> ids;
+    for (size_t i = 0; i < postings->size(); i++) {
+      ids.push_back(index.external_document_id(postings->document_id(i)));
+    }
+
+    std::vector<size_t> cursor_ids;
+    for (auto cursor = postings->cursor(); !cursor->is_end();
+         cursor->next()) {
+      cursor_ids.push_back(index.external_document_id(cursor->document_id()));
+    }
+    EXPECT_EQ(ids, cursor_ids);
+
+    auto documents = search_documents(index, *expr).to_vector();
+    EXPECT_EQ(postings->size(), documents.size());
+    return ids;
+  };
+
+  EXPECT_EQ(std::vector<size_t>({0, 2}), search(invidx, "the"));
+  EXPECT_EQ(std::vector<size_t>({2}), search(invidx, "second"));
+  EXPECT_EQ(std::vector<size_t>({0, 3}), search(invidx, "document"));
+  EXPECT_EQ(std::vector<size_t>({2}), search(invidx, R"("second update")"));
+  EXPECT_EQ(std::vector<size_t>({0, 3, 2}), search(invidx, "the | fourth"));
+
+  {
+    auto expr = parse_query(invidx, normalizer, "second");
+    auto postings = perform_search(invidx, *expr);
+    auto rng = invidx.text_range(*postings, 0, 0);
+    EXPECT_EQ(4, rng.position);
+    EXPECT_EQ(6, rng.length);
+  }
+
+  // Sealing purges the deleted documents
+  auto sealed = seal(invidx);
+  EXPECT_EQ(nullptr, sealed->live_documents());
+  EXPECT_EQ(4, sealed->document_count());
+  EXPECT_EQ(2, sealed->term_count(U"the"));
+  EXPECT_FALSE(sealed->term_exists(U"third"));
+  EXPECT_EQ(std::vector<size_t>({0, 2}), search(*sealed, "the"));
+  EXPECT_EQ(std::vector<size_t>({2}), search(*sealed, R"("second update")"));
+}
+
+TEST(DeletionTest, LiveStatistics) {
+  InMemoryInvertedIndex<TextRange> invidx;
+  {
+    InMemoryIndexer indexer(invidx, normalizer);
+    indexer.index_document(0, UTF8PlainTextTokenizer("hello world"));
+    indexer.index_document(1, UTF8PlainTextTokenizer("hello there"));
+    indexer.index_document(2, UTF8PlainTextTokenizer("goodbye world"));
+    indexer.index_document(3, UTF8PlainTextTokenizer("hello hello again"));
+    indexer.update_document(0, UTF8PlainTextTokenizer("hello again world"));
+    indexer.update_document(0, UTF8PlainTextTokenizer("hello world world"));
+    indexer.delete_document(2);
+  }
+
+  // The same live documents, in the same order
+  InMemoryInvertedIndex<TextRange> fresh;
+  {
+    InMemoryIndexer indexer(fresh, normalizer);
+    indexer.index_document(1, UTF8PlainTextTokenizer("hello there"));
+    indexer.index_document(3, UTF8PlainTextTokenizer("hello hello again"));
+    indexer.index_document(0, UTF8PlainTextTokenizer("hello world world"));
+  }
+
+  EXPECT_EQ(6, invidx.document_count());
+  EXPECT_EQ(3, invidx.live_document_count());
+  EXPECT_EQ(fresh.average_document_term_count(),
+            invidx.average_document_term_count());
+  for (auto str : {U"hello", U"world", U"again", U"goodbye"}) {
+    auto expected = fresh.term_exists(str) ? fresh.df(str) : 0;
+    EXPECT_EQ(expected, invidx.df(str));
+    expected = fresh.term_exists(str) ? fresh.term_count(str) : 0;
+    EXPECT_EQ(expected, invidx.term_count(str));
+  }
+
+  for (auto query : {"hello", "world", "hello | world", "hello again"}) {
+    auto expr = parse_query(invidx, normalizer, query);
+    auto fresh_expr = parse_query(fresh, normalizer, query);
+    auto postings = perform_search(invidx, *expr);
+    auto expected = perform_search(fresh, *fresh_expr);
+    ASSERT_EQ(expected->size(), postings->size()) << query;
+
+    auto scores = bm25_scores(invidx, *expr, *postings);
+    auto expected_scores = bm25_scores(fresh, *fresh_expr, *expected);
+    auto tf_idfs = tf_idf_scores(invidx, *expr, *postings);
+    auto expected_tf_idfs = tf_idf_scores(fresh, *fresh_expr, *expected);
+    for (size_t i = 0; i < postings->size(); i++) {
+      EXPECT_EQ(fresh.external_document_id(expected->document_id(i)),
+                invidx.external_document_id(postings->document_id(i)));
+      EXPECT_TRUE(std::isfinite(scores[i])) << query;
+      EXPECT_DOUBLE_EQ(expected_scores[i], scores[i]) << query;
+      EXPECT_DOUBLE_EQ(bm25_score(fresh, *fresh_expr, *expected, i),
+                       bm25_score(invidx, *expr, *postings, i));
+      EXPECT_DOUBLE_EQ(expected_tf_idfs[i], tf_idfs[i]) << query;
+    }
+  }
+}
+
+TEST(SegmentedIndexTest, DeleteAndUpdate) {
+  SegmentedIndex segidx(normalizer, 10, 2);
+  for (size_t i = 0; i < 40; i++) {
+    auto doc = i % 2 == 0 ? "apple orange" : "orange";
+    segidx.index_document(i, UTF8PlainTextTokenizer(doc));
+  }
+  segidx.flush();
+  segidx.wait_for_merges();
+
+  auto before = segidx.reader();
+  for (size_t i = 0; i < 40; i += 4) {
+    EXPECT_TRUE(segidx.delete_document(i));
+  }
+  EXPECT_FALSE(segidx.delete_document(0));
+  segidx.update_document(1, UTF8PlainTextTokenizer("apple banana"));
+  segidx.index_document(3, UTF8PlainTextTokenizer("banana"));
+  EXPECT_TRUE(segidx.delete_document(3));
+
+  // Deletions show after a flush
+  EXPECT_EQ(20, before->df(U"apple"));
+  EXPECT_EQ(nullptr, before->live_documents());
+  EXPECT_EQ(nullptr, segidx.reader()->live_documents());
+  segidx.flush();
+
+  auto count = [](const auto &index, auto query) {
+    return perform_search(index, *parse_query(index, normalizer, query))
+        ->size();
+  };
+
+  auto reader = segidx.reader();
+  EXPECT_EQ(11, count(*reader, "apple"));
+  EXPECT_EQ(1, count(*reader, "banana"));
+  EXPECT_EQ(28, count(*reader, "orange"));
+  EXPECT_EQ(11, reader->df(U"apple"));
+  EXPECT_EQ(11, reader->term_count(U"apple"));
+  EXPECT_EQ(28, reader->df(U"orange"));
+  EXPECT_EQ(41, reader->document_count());
+  EXPECT_EQ(29, reader->live_document_count());
+  EXPECT_DOUBLE_EQ(40.0 / 29, reader->average_document_term_count());
+  EXPECT_FALSE(reader->internal_document_id(0));
+  EXPECT_FALSE(reader->internal_document_id(3));
+  EXPECT_EQ(1, reader->external_document_id(*reader->internal_document_id(1)));
+  EXPECT_EQ(20, count(*before, "apple"));
+
+  // Merges purge the deleted documents
+  for (size_t i = 40; i < 80; i++) {
+    segidx.index_document(i, UTF8PlainTextTokenizer("orange"));
+  }
+  segidx.flush();
+  segidx.wait_for_merges();
+
+  reader = segidx.reader();
+  EXPECT_EQ(11, count(*reader, "apple"));
+  EXPECT_EQ(68, count(*reader, "orange"));
+  EXPECT_EQ(69, reader->document_count());
+  EXPECT_EQ(nullptr, reader->live_documents());
+}
+
+TEST(SegmentedIndexTest, ConcurrentReaders) {
+  SegmentedIndex segidx(normalizer, 16, 4);
+  std::atomic<bool> done = false;
+  std::atomic<size_t> searches = 0;
+
+  // Each snapshot must stay consistent while documents come in
+  std::vector<std::thread> readers;
+  for (size_t i = 0; i < 4; i++) {
+    readers.emplace_back([&] {
+      while (!done) {
+        auto reader = segidx.reader();
+        auto document_count = reader->document_count();
+        if (document_count == 0) {
+          continue;
+        }
+        auto expr = parse_query(*reader, normalizer, "orange");
+        auto postings = perform_search(*reader, *expr);
+        EXPECT_EQ(document_count, postings->size());
+        auto scores = bm25_scores(*reader, *expr, *postings);
+        EXPECT_EQ(document_count, scores.size());
+        searches++;
+      }
+    });
+  }
+
+  for (size_t i = 0; i < 2000; i++) {
+    segidx.index_document(i, UTF8PlainTextTokenizer("apple orange"));
+    if (i % 100 == 0) {
+      segidx.flush();
+    }
+  }
+  segidx.flush();
+  segidx.wait_for_merges();
+  while (searches == 0) {
+    std::this_thread::yield();
+  }
+  done = true;
+  for (auto &t : readers) {
+    t.join();
+  }
+
+  EXPECT_EQ(2000, segidx.reader()->df(U"orange"));
+}
+
+TEST(ParallelBuildTest, SameImage) {
+  const std::vector<std::string> words = {"apple", "orange", "banana", "grape",
+                                          "lemon", "melon",  "peach",  "pear"};
+  std::vector<std::string> documents;
+  for (size_t i = 0; i < 3000; i++) {
+    std::string doc;
+    for (size_t j = 0; j < 1 + i % 7; j++) {
+      doc += words[(i * 7 + j * j) % words.size()] + ' ';
+    }
+    if (i % 3 == 0) {
+      doc += "word" + std::to_string(i % 100);
+    }
+    documents.push_back(std::move(doc));
+  }
+
+  auto index = [&](IIndexer<TextRange> &indexer) {
+    for (size_t i = 0; i < documents.size(); i++) {
+      indexer.index_document(i * 3, UTF8PlainTextTokenizer(documents[i]));
+    }
+    indexer.update_document(30, UTF8PlainTextTokenizer("updated apple"));
+    indexer.delete_document(60);
+    indexer.delete_document(90);
+  };
+
+  InMemoryInvertedIndex<TextRange> invidx;
+  {
+    InMemoryIndexer indexer(invidx, normalizer);
+    index(indexer);
+  }
+  auto expected = seal(invidx);
+
+  for (size_t thread_count : {1, 2, 3, 8}) {
+    auto sealed = make_sealed_index(normalizer, index, thread_count);
+    ASSERT_EQ(expected->image_size(), sealed->image_size()) << thread_count;
+    EXPECT_EQ(0, std::memcmp(expected->image(), sealed->image(),
+                             sealed->image_size()))
+        << thread_count;
+  }
+
+  // Indexing threads share the cache
+  for (size_t thread_count : {1, 3}) {
+    auto sealed = make_sealed_index(CachingNormalizer(normalizer, 4), index,
+                                    thread_count);
+    ASSERT_EQ(expected->image_size(), sealed->image_size()) << thread_count;
+    EXPECT_EQ(0, std::memcmp(expected->image(), sealed->image(),
+                             sealed->image_size()))
+        << thread_count;
+  }
+
+  auto sealed = make_sealed_index(normalizer, index);
+  EXPECT_EQ(2998, sealed->document_count());
+  EXPECT_EQ(30, sealed->external_document_id(2997));
+  EXPECT_FALSE(sealed->internal_document_id(60));
+
+  // Thread counts are capped at the cores of the machine, so the merge of
+  // runs is also checked on its own
+  InMemoryInvertedIndex<TextRange> whole;
+  std::vector<InMemoryInvertedIndex<TextRange>> parts(3);
+  std::vector<const InMemoryInvertedIndex<TextRange> *> part_pointers;
+  for (size_t p = 0; p < parts.size(); p++) {
+    InMemoryIndexer whole_indexer(whole, normalizer);
+    InMemoryIndexer part_indexer(parts[p], normalizer);
+    for (size_t i = p * 1000; i < (p + 1) * 1000; i++) {
+      whole_indexer.index_document(i, UTF8PlainTextTokenizer(documents[i]));
+      part_indexer.index_document(i, UTF8PlainTextTokenizer(documents[i]));
+    }
+    part_pointers.push_back(&parts[p]);
+  }
+  EXPECT_EQ(SealedInvertedIndex::build_image(whole),
+            SealedInvertedIndex::build_image(part_pointers, 2));
+}
+
+TEST(ParallelBuildTest, WorkerException) {
+  std::vector<std::string> documents(100, "apple orange");
+  documents.back() = "apple lemon";
+  auto index = [&](IIndexer<TextRange> &indexer) {
+    for (size_t i = 0; i < documents.size(); i++) {
+      indexer.index_document(i, UTF8PlainTextTokenizer(documents[i]));
+    }
+  };
+
+  // Thrown by whichever worker indexes the last document
+  auto throwing = [](const std::u32string &str) -> std::u32string {
+    if (str == U"lemon") {
+      throw std::runtime_error("normalizer failed");
+    }
+    return str;
+  };
+  for (size_t thread_count : {1, 2, 4}) {
+    EXPECT_THROW(make_sealed_index(throwing, index, thread_count),
+                 std::runtime_error)
+        << thread_count;
+  }
+}
@@ -0,0 +1,111 @@
+﻿#include <gtest/gtest.h>
+#include <searchlib.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+
+#include "test_utils.h"
+
+using namespace searchlib;
+
+// This binary replaces the global operator new, so that KJVTest.Allocations
+// can count heap allocations. Other tests live in test-main, which keeps the
+// default one.
+
+static std::atomic<bool> counting = false;
+static std::atomic<size_t> allocation_count = 0;
+
+void *operator new(size_t size) {
+  if (counting.load(std::memory_order_relaxed)) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (auto p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+// Counts allocations made while it's alive
+class AllocationCounter {
+public:
+  AllocationCounter() : start_(allocation_count.load()) { counting = true; }
+  ~AllocationCounter() { counting = false; }
+
+  size_t count() const { return allocation_count.load() - start_; }
+
+private:
+  size_t start_;
+};
+
+const auto KJV_PATH = "../../test/t_kjv.tsv";
+
+static auto normalizer = [](auto sv) { return unicode::to_lowercase(sv); };
+
+TEST(KJVTest, Allocations) {
+  std::vector<std::string> documents;
+  std::ifstream fs(KJV_PATH);
+  std::string line;
+  while (std::getline(fs, line)) {
+    documents.push_back(split(line, '\t')[4]);
+  }
+
+  // Allocations made while tokenizing all documents with `tokenize`
+  size_t token_count = 0;
+  auto count_allocations = [&](auto tokenize) {
+    token_count = 0;
+    auto callback = [&](const auto &, auto, auto) { token_count++; };
+    AllocationCounter counter;
+    for (const auto &s : documents) {
+      tokenize(UTF8PlainTextTokenizer(s), callback);
+    }
+    return counter.count();
+  };
+
+  auto function_allocations =
+      count_allocations([&](auto tokenizer, const auto &callback) {
+        tokenizer(normalizer, callback);
+      });
+
+  // Once the buffers have grown, no term allocates
+  LowercaseNormalizer lowercase;
+  TokenBuffers buffers;
+  auto tokenize = [&](const auto &tokenizer, const auto &callback) {
+    tokenizer.tokenize(lowercase, callback, buffers);
+  };
+  count_allocations(tokenize);
+  EXPECT_EQ(0, count_allocations(tokenize));
+
+  InMemoryInvertedIndex<TextRange> invidx;
+  size_t index_allocations;
+  {
+    AllocationCounter counter;
+    InMemoryIndexer indexer(invidx, lowercase);
+    for (size_t i = 0; i < documents.size(); i++) {
+      indexer.index_document(i, UTF8PlainTextTokenizer(documents[i]));
+    }
+    index_allocations = counter.count();
+  }
+
+  InMemoryInvertedIndex<TextRange> expected;
+  {
+    InMemoryIndexer indexer(expected, normalizer);
+    for (size_t i = 0; i < documents.size(); i++) {
+      indexer.index_document(i, UTF8PlainTextTokenizer(documents[i]));
+    }
+  }
+  EXPECT_EQ(expected.base().term_dictionary_.size(),
+            invidx.base().term_dictionary_.size());
+  EXPECT_EQ(expected.base().total_term_count(),
+            invidx.base().total_term_count());
+
+  std::cout << "  " << token_count << " tokens: "
+            << static_cast<double>(function_allocations) / token_count
+            << " allocations per token through Tokenizer<T>, 0 with buffers, "
+            << static_cast<double>(index_allocations) / token_count
+            << " when indexing" << std::endl;
+}
@@ -1,16 +1,19 @@
 ﻿#include <gtest/gtest.h>
 #include <searchlib.h>
 
+#include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 
+#include "codec.h"
 #include "test_utils.h"
 
 using namespace searchlib;
 
 const auto KJV_PATH = "../../test/t_kjv.tsv";
 
-auto normalizer = [](auto sv) { return unicode::to_lowercase(sv); };
+static auto normalizer = [](auto sv) { return unicode::to_lowercase(sv); };
 
 static auto kjv_index() {
   InMemoryInvertedIndex<TextRange> invidx;
@@ -99,7 +102,353 @@ TEST(KJVTest, UTF8DecodePerformance) {
   std::string s;
   while (std::getline(fs, s)) {
     UTF8PlainTextTokenizer tokenizer(s);
-    tokenizer(normalizer, [&](auto &str, auto, auto) {});
+    tokenizer(normalizer, [&](auto &, auto, auto) {});
   }
 }
 
+
+TEST(KJVTest, PostingsCompression) {
+  const auto &invidx = kjv_index();
+
+  size_t uncompressed = 0;
+  size_t compressed = 0;
+  for (const auto &term : invidx.base().terms_) {
+    const auto &p = term.postings;
+    uncompressed += (p.size() * 2 + term.term_count) * sizeof(size_t);
+    compressed += p.storage_size();
+  }
+
+  EXPECT_LT(compressed * 4, uncompressed);
+}
+
+TEST(KJVTest, BlockDecodePerformance) {
+  const auto &invidx = kjv_index();
+
+  // Encode the document id deltas and position deltas of every postings in
+  // blocks of 128 values, the same way the in-memory postings do.
+  const size_t block_size = InMemoryInvertedIndexBase::Postings::block_size;
+  std::vector<uint32_t> values;
+  for (const auto &term : invidx.base().terms_) {
+    size_t prev_document_id = 0;
+    for (auto cursor = term.postings.cursor(); !cursor->is_end();
+         cursor->next()) {
+      values.push_back(cursor->document_id() - prev_document_id);
+      prev_document_id = cursor->document_id();
+      size_t prev_term_pos = 0;
+      for (size_t i = 0; i < cursor->freq(); i++) {
+        values.push_back(cursor->term_position(i) - prev_term_pos);
+        prev_term_pos = cursor->term_position(i);
+      }
+    }
+  }
+
+  std::vector<uint8_t> buf(svb_max_encoded_size(values.size()) +
+                           values.size() / block_size + 1);
+  std::vector<size_t> block_offsets;
+  {
+    size_t offset = 0;
+    for (size_t i = 0; i < values.size(); i += block_size) {
+      block_offsets.push_back(offset);
+      auto count = std::min(block_size, values.size() - i);
+      offset += svb_encode(&values[i], count, &buf[offset]);
+    }
+  }
+
+  auto run = [&](auto decode, auto prefix_sum) {
+    std::vector<uint32_t> out(values.size());
+    auto start = std::chrono::steady_clock::now();
+    for (size_t n = 0; n < 20; n++) {
+      for (size_t b = 0; b < block_offsets.size(); b++) {
+        auto i = b * block_size;
+        auto count = std::min(block_size, values.size() - i);
+        decode(&buf[block_offsets[b]], count, &out[i]);
+        prefix_sum(&out[i], count);
+      }
+    }
+    auto elapsed = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start);
+    return std::make_pair(out, elapsed.count());
+  };
+
+  auto [scalar, scalar_ms] = run(svb_decode_scalar, prefix_sum_scalar);
+  auto [simd, simd_ms] = run(svb_decode, searchlib::prefix_sum);
+  EXPECT_EQ(scalar, simd);
+
+  std::cout << "  " << values.size() << " values x 20: scalar " << scalar_ms
+            << " ms, simd (level " << static_cast<int>(simd_level()) << ") "
+            << simd_ms << " ms" << std::endl;
+}
+
+TEST(KJVTest, SearchDocuments) {
+  const auto &invidx = kjv_index();
+
+  EXPECT_NE(nullptr, invidx.document_set(U"the"));
+  EXPECT_EQ(nullptr, invidx.document_set(U"apple"));
+
+  for (auto query : {"the and", "the of that", "the | of", "lord god",
+                     "the apple", "apple | tree", R"("the lord" and)"}) {
+    auto expr = parse_query(invidx, normalizer, query);
+    ASSERT_TRUE(expr);
+
+    auto start = std::chrono::steady_clock::now();
+    auto postings = perform_search(invidx, *expr);
+    auto search_ms = std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    start = std::chrono::steady_clock::now();
+    auto document_set = search_documents(invidx, *expr);
+    auto documents_ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+
+    std::vector<size_t> expected;
+    for (size_t i = 0; i < postings->size(); i++) {
+      expected.push_back(postings->document_id(i));
+    }
+    EXPECT_EQ(expected, document_set.to_vector()) << query;
+
+    std::cout << "  " << query << ": " << expected.size() << " documents, "
+              << search_ms << " ms with positions, " << documents_ms
+              << " ms without" << std::endl;
+  }
+}
+
+TEST(KJVTest, TermDictionary) {
+  const auto &invidx = kjv_index();
+
+  std::vector<std::u32string> terms;
+  size_t map_size = 0;
+  for (const auto &[str, _] : invidx.base().term_dictionary_) {
+    terms.emplace_back(str);
+    map_size += sizeof(std::u32string) + str.size() * sizeof(char32_t);
+  }
+  std::sort(terms.begin(), terms.end());
+
+  TermDictionary dict(terms);
+  for (size_t i = 0; i < terms.size(); i++) {
+    ASSERT_EQ(i, dict.find(terms[i]));
+  }
+  EXPECT_LT(dict.storage_size() * 8, map_size);
+}
+
+TEST(KJVTest, BatchScoring) {
+  const auto &invidx = kjv_index();
+
+  for (auto query : {"apple tree", "apple | tree", "the | lord"}) {
+    auto expr = parse_query(invidx, normalizer, query);
+    ASSERT_TRUE(expr);
+    auto postings = perform_search(invidx, *expr);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<double> expected;
+    for (size_t i = 0; i < postings->size(); i++) {
+      expected.push_back(bm25_score(invidx, *expr, *postings, i));
+    }
+    auto each_ms = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+    start = std::chrono::steady_clock::now();
+    auto scores = bm25_scores(invidx, *expr, *postings);
+    auto batch_ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+
+    ASSERT_EQ(expected.size(), scores.size());
+    for (size_t i = 0; i < scores.size(); i++) {
+      EXPECT_DOUBLE_EQ(expected[i], scores[i]);
+    }
+
+    auto tf_idf = tf_idf_scores(invidx, *expr, *postings);
+    auto term_counts = term_count_scores(invidx, *expr, *postings);
+    for (size_t i = 0; i < postings->size(); i++) {
+      EXPECT_DOUBLE_EQ(tf_idf_score(invidx, *expr, *postings, i), tf_idf[i]);
+      EXPECT_EQ(term_count_score(invidx, *expr, *postings, i), term_counts[i]);
+    }
+
+    std::cout << "  " << query << ": " << scores.size() << " hits, "
+              << each_ms << " ms one by one, " << batch_ms << " ms in batch"
+              << std::endl;
+  }
+}
+
+TEST(KJVTest, TextRangeStore) {
+  const auto &invidx = kjv_index();
+
+  // Text ranges take 16 bytes per token in a plain vector
+  std::vector<TextRange> text_ranges;
+  TextRangeStore store;
+  size_t token_count = 0;
+  std::ifstream fs(KJV_PATH);
+  std::string line;
+  size_t document_id = 0;
+  while (std::getline(fs, line)) {
+    auto fields = split(line, '\t');
+    text_ranges.clear();
+    UTF8PlainTextTokenizer tokenizer(fields[4]);
+    tokenizer(nullptr, [&](const auto &, auto, auto text_range) {
+      text_ranges.push_back(text_range);
+    });
+    store.add_document(document_id++, text_ranges);
+    token_count += text_ranges.size();
+  }
+
+  EXPECT_EQ(invidx.base().total_term_count(), token_count);
+  auto bits_per_token = store.storage_size() * 8.0 / token_count;
+  EXPECT_LT(bits_per_token, 12.0);
+  std::cout << "  " << bits_per_token << " bits per token" << std::endl;
+}
+
+TEST(KJVTest, SealedIndex) {
+  const auto &invidx = kjv_index();
+
+  auto start = std::chrono::steady_clock::now();
+  auto sealed = seal(invidx);
+  auto seal_ms = std::chrono::duration<double, std::milli>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+
+  // Rough size of the in-memory structures, not counting allocator overhead
+  const auto &base = invidx.base();
+  auto in_memory_size = invidx.text_range_store().storage_size() +
+                        base.external_document_ids_.size() *
+                            (sizeof(size_t) * 3 + sizeof(uint32_t));
+  for (const auto &[str, term_id] : base.term_dictionary_) {
+    const auto &postings = base.terms_[term_id].postings;
+    in_memory_size += sizeof(std::u32string) + str.size() * sizeof(char32_t) +
+                      sizeof(size_t) + sizeof(InMemoryInvertedIndexBase::Term) +
+                      postings.storage_size();
+  }
+  EXPECT_LT(sealed->storage_size(), in_memory_size);
+
+  std::cout << "  sealed in " << seal_ms << " ms, " << sealed->storage_size()
+            << " bytes, in-memory about " << in_memory_size << " bytes"
+            << std::endl;
+
+  for (auto query : {"apple", "the lord", "the | of", R"("the lord" god)",
+                     "lord ~ god"}) {
+    auto expr = parse_query(invidx, normalizer, query);
+    auto sealed_expr = parse_query(*sealed, normalizer, query);
+    ASSERT_TRUE(expr && sealed_expr);
+
+    start = std::chrono::steady_clock::now();
+    auto expected = perform_search(invidx, *expr);
+    auto expected_scores = bm25_scores(invidx, *expr, *expected);
+    auto in_memory_ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+
+    start = std::chrono::steady_clock::now();
+    auto postings = perform_search(*sealed, *sealed_expr);
+    auto scores = bm25_scores(*sealed, *sealed_expr, *postings);
+    auto sealed_ms = std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    ASSERT_EQ(expected->size(), postings->size());
+    for (size_t i = 0; i < postings->size(); i++) {
+      ASSERT_EQ(expected->document_id(i), postings->document_id(i));
+      ASSERT_DOUBLE_EQ(expected_scores[i], scores[i]);
+      auto expected_rng = invidx.text_range(*expected, i, 0);
+      auto rng = sealed->text_range(*postings, i, 0);
+      ASSERT_EQ(expected_rng.position, rng.position);
+    }
+
+    std::cout << "  " << query << ": " << postings->size() << " hits, "
+              << in_memory_ms << " ms in-memory, " << sealed_ms
+              << " ms sealed" << std::endl;
+  }
+}
+
+TEST(KJVTest, SaveLoad) {
+  auto path =
+      (std::filesystem::temp_directory_path() / "searchlib_kjv.idx").string();
+
+  auto start = std::chrono::steady_clock::now();
+  const auto &invidx = kjv_index();
+  auto build_ms = std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+
+  save_index(invidx, path);
+
+  start = std::chrono::steady_clock::now();
+  auto loaded = load_index(path);
+  auto load_ms = std::chrono::duration<double, std::milli>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+
+  start = std::chrono::steady_clock::now();
+  auto mapped = map_index(path);
+  auto map_ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+
+  // External ids and positions of the hits of a query
+  auto hits = [](const IInvertedIndex &index, const char *query) {
+    auto expr = parse_query(index, normalizer, query);
+    auto result = perform_search(index, *expr);
+    std::vector<std::pair<size_t, size_t>> hits;
+    for (size_t i = 0; i < result->size(); i++) {
+      auto document_id = index.external_document_id(result->document_id(i));
+      for (size_t j = 0; j < result->search_hit_count(i); j++) {
+        hits.emplace_back(document_id, result->term_position(i, j));
+      }
+    }
+    return hits;
+  };
+
+  EXPECT_EQ(invidx.document_count(), loaded->document_count());
+  EXPECT_EQ(invidx.document_count(), mapped->document_count());
+  for (auto query : {R"("the lord" god)", "jesus christ", "moses | aaron"}) {
+    auto expected = hits(invidx, query);
+    EXPECT_FALSE(expected.empty());
+    EXPECT_EQ(expected, hits(*loaded, query));
+    EXPECT_EQ(expected, hits(*mapped, query));
+  }
+
+  std::cout << "  built in " << build_ms << " ms, loaded "
+            << std::filesystem::file_size(path) << " bytes in " << load_ms
+            << " ms, mapped in " << map_ms << " ms" << std::endl;
+  std::filesystem::remove(path);
+}
+
+TEST(KJVTest, ParallelBuild) {
+  std::vector<std::pair<size_t, std::string>> documents;
+  std::ifstream fs(KJV_PATH);
+  std::string line;
+  while (std::getline(fs, line)) {
+    auto fields = split(line, '\t');
+    documents.emplace_back(std::stoi(fields[0]), fields[4]);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto expected = seal(kjv_index());
+  auto sequential_ms = std::chrono::duration<double, std::milli>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+
+  // Requests are capped at the cores, so this is the count actually used
+  auto thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+  start = std::chrono::steady_clock::now();
+  auto sealed = make_sealed_index(
+      normalizer,
+      [&](auto &indexer) {
+        for (const auto &[document_id, s] : documents) {
+          indexer.index_document(document_id, UTF8PlainTextTokenizer(s));
+        }
+      },
+      thread_count);
+  auto parallel_ms = std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+  ASSERT_EQ(expected->image_size(), sealed->image_size());
+  EXPECT_EQ(0, std::memcmp(expected->image(), sealed->image(),
+                           sealed->image_size()));
+
+  std::cout << "  built and sealed in " << sequential_ms << " ms, in "
+            << parallel_ms << " ms on " << thread_count
+            << (thread_count == 1 ? " thread" : " threads") << std::endl;
+}
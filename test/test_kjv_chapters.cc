@@ -10,7 +10,7 @@ using namespace searchlib;
 
 const auto KJV_PATH = "../../test/t_kjv_chapters.tsv";
 
-auto normalizer = [](auto sv) { return unicode::to_lowercase(sv); };
+static auto normalizer = [](auto sv) { return unicode::to_lowercase(sv); };
 
 static auto kjv_index() {
   return make_in_memory_index<TextRange>(normalizer, [&](auto &indexer) {
@@ -43,14 +43,14 @@ TEST(KJVChapterTest, SimpleTest) {
     auto term = U"apple";
     EXPECT_EQ(8, invidx.df(term));
 
-    EXPECT_EQ(532, postings->document_id(0));
-    EXPECT_EQ(1917, postings->document_id(1));
-    EXPECT_EQ(2007, postings->document_id(2));
-    EXPECT_EQ(2202, postings->document_id(3));
-    EXPECT_EQ(2208, postings->document_id(4));
-    EXPECT_EQ(2502, postings->document_id(5));
-    EXPECT_EQ(2901, postings->document_id(6));
-    EXPECT_EQ(3802, postings->document_id(7));
+    EXPECT_EQ(532, invidx.external_document_id(postings->document_id(0)));
+    EXPECT_EQ(1917, invidx.external_document_id(postings->document_id(1)));
+    EXPECT_EQ(2007, invidx.external_document_id(postings->document_id(2)));
+    EXPECT_EQ(2202, invidx.external_document_id(postings->document_id(3)));
+    EXPECT_EQ(2208, invidx.external_document_id(postings->document_id(4)));
+    EXPECT_EQ(2502, invidx.external_document_id(postings->document_id(5)));
+    EXPECT_EQ(2901, invidx.external_document_id(postings->document_id(6)));
+    EXPECT_EQ(3802, invidx.external_document_id(postings->document_id(7)));
 
     EXPECT_EQ(1, postings->search_hit_count(0));
     EXPECT_EQ(1, postings->search_hit_count(1));
@@ -88,9 +88,9 @@ TEST(KJVChapterTest, SimpleTest) {
     ASSERT_TRUE(postings);
     ASSERT_EQ(3, postings->size());
 
-    EXPECT_EQ(2202, postings->document_id(0));
-    EXPECT_EQ(2208, postings->document_id(1));
-    EXPECT_EQ(2901, postings->document_id(2));
+    EXPECT_EQ(2202, invidx.external_document_id(postings->document_id(0)));
+    EXPECT_EQ(2208, invidx.external_document_id(postings->document_id(1)));
+    EXPECT_EQ(2901, invidx.external_document_id(postings->document_id(2)));
 
     EXPECT_EQ(3, postings->search_hit_count(0));
     EXPECT_EQ(2, postings->search_hit_count(1));
@@ -117,7 +117,8 @@ TEST(KJVChapterTest, SimpleTest) {
       size_t i = 0;
       for (auto expected : {426, 434, 534, 602, 603, 604, 605, 606, 607, 608,
                             609, 610, 612, 613, 618, 620, 624, 1116}) {
-        EXPECT_EQ(expected, postings->document_id(i));
+        EXPECT_EQ(expected,
+                  invidx.external_document_id(postings->document_id(i)));
         i++;
       }
     }